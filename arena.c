@@ -0,0 +1,130 @@
+/* arena.c
+ * Bump-pointer memory arenas.
+ *
+ * An arena hands out memory from large blocks, by moving a pointer
+ * forward, and frees everything at once when it is reset or
+ * destroyed; individual allocations are never freed. The arena
+ * itself lives at the start of its first block, so an arena whose
+ * allocations fit in that block costs a single malloc for its whole
+ * lifetime, and resetting it frees nothing. Allocations that do not
+ * fit are made in additional blocks, freed when the arena is reset.
+ *
+ * Arenas are not thread-safe; each one is meant to be used by a
+ * single session.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_block {
+  struct arena_block *next;
+};
+
+struct arena {
+  char               *ptr;        // next free byte in the current block
+  char               *end;        // end of the current block
+  struct arena_block *blocks;     // additional blocks, most recent first
+  size_t              block_size; // size of the first block
+};
+
+// Start of the memory available in the first block, after the arena
+#define FIRST_BLOCK_DATA(a) ((char *) (a) + ARENA_HEADER_SIZE)
+#define ARENA_HEADER_SIZE \
+  ((sizeof(struct arena) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define BLOCK_HEADER_SIZE \
+  ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/** Creates a new, empty, arena.
+ *
+ *  Parameters: block_size: Number of bytes that can be allocated
+ *                          before a new block is needed. Additional
+ *                          blocks have the same size, unless an
+ *                          allocation is larger.
+ *
+ *  Returns: The new arena, or NULL if it cannot be allocated.
+ */
+arena_t arena_create(size_t block_size) {
+
+  struct arena *a = malloc(ARENA_HEADER_SIZE + block_size);
+  if (!a)
+    return NULL;
+  a->ptr = FIRST_BLOCK_DATA(a);
+  a->end = a->ptr + block_size;
+  a->blocks = NULL;
+  a->block_size = block_size;
+  return a;
+}
+
+/** Allocates memory from an arena, aligned for any type. The memory
+ *  is valid until the arena is reset or destroyed.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              size: Number of bytes to be allocated.
+ *
+ *  Returns: The allocated memory (not initialized), or NULL if a new
+ *           block cannot be allocated.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (size > (size_t) (arena->end - arena->ptr)) {
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    struct arena_block *block = malloc(BLOCK_HEADER_SIZE + block_size);
+    if (!block)
+      return NULL;
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    // an allocation larger than a block gets a block of its own, and
+    // allocation continues in the current block
+    if (size > arena->block_size)
+      return (char *) block + BLOCK_HEADER_SIZE;
+    arena->ptr = (char *) block + BLOCK_HEADER_SIZE;
+    arena->end = arena->ptr + block_size;
+  }
+
+  void *rv = arena->ptr;
+  arena->ptr += size;
+  return rv;
+}
+
+/** Copies a null-terminated string to memory allocated from an arena.
+ *
+ *  Returns: The copy, or NULL if it cannot be allocated.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+
+  size_t len = strlen(str) + 1;
+  char *rv = arena_alloc(arena, len);
+  if (rv)
+    memcpy(rv, str, len);
+  return rv;
+}
+
+/** Frees all memory allocated from an arena, keeping only the first
+ *  block for new allocations.
+ */
+void arena_reset(arena_t arena) {
+
+  while (arena->blocks) {
+    struct arena_block *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->ptr = FIRST_BLOCK_DATA(arena);
+  arena->end = arena->ptr + arena->block_size;
+}
+
+/** Frees an arena and all memory allocated from it.
+ */
+void arena_destroy(arena_t arena) {
+  if (arena) {
+    arena_reset(arena);
+    free(arena);
+  }
+}
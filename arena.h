@@ -0,0 +1,19 @@
+/* arena.h
+ * Bump-pointer memory arenas, for objects that share a lifetime
+ * (e.g., a session or a mail transaction) and are freed together.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena *arena_t;
+
+arena_t arena_create(size_t block_size);
+void *arena_alloc(arena_t arena, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+void arena_reset(arena_t arena);
+void arena_destroy(arena_t arena);
+
+#endif
@@ -0,0 +1,219 @@
+/* auth.c
+ * Throttling of failed authentication attempts.
+ *
+ * Each client address and each user name (whether it exists or not)
+ * has a token bucket, kept as the time at which the bucket will be
+ * full again (the generic cell rate algorithm): every failed attempt
+ * moves that time forward by one interval, and attempts are refused,
+ * before any credential is checked, once it is further ahead than
+ * the burst allows. Successful attempts cost nothing, so only clients
+ * and users that keep failing are throttled.
+ *
+ * Buckets are kept in fixed-size hash tables, in an anonymous shared
+ * mapping created before the server starts, so the limits apply to
+ * all forked processes as well as threads. A bucket that is full
+ * again is the same as no bucket at all, so when a table is crowded,
+ * the bucket that refilled first is reused. The tables are protected
+ * by a robust process-shared mutex, as in groupcommit.c.
+ *
+ * If throttling is not initialized, every attempt is allowed.
+ */
+
+#include "auth.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define AUTH_TABLE_SIZE 4096 // buckets in each table (power of two)
+#define AUTH_PROBES     8    // buckets where a key may be stored
+
+struct auth_bucket {
+  uint64_t key;  // hash of the client or user, 0 for an empty bucket
+  uint64_t full; // time the bucket is full again, in microseconds
+};
+
+struct auth_limit {
+  unsigned int burst;
+  uint64_t     interval; // microseconds for one attempt to be refilled
+};
+
+struct auth_state {
+  pthread_mutex_t    lock;
+  struct auth_bucket clients[AUTH_TABLE_SIZE];
+  struct auth_bucket users[AUTH_TABLE_SIZE];
+};
+
+static const struct auth_limit client_limit = {
+  AUTH_CLIENT_BURST, 60000000 / AUTH_CLIENT_RATE
+};
+static const struct auth_limit user_limit = {
+  AUTH_USER_BURST, 60000000 / AUTH_USER_RATE
+};
+
+static struct auth_state *state = NULL;
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Computes a non-zero hash of a sequence of bytes, optionally
+ *  ignoring case (FNV-1a).
+ */
+static uint64_t hash_bytes(const void *data, size_t len, int fold) {
+
+  const unsigned char *p = data;
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= fold ? tolower(p[i]) : p[i];
+    h *= 1099511628211ull;
+  }
+  return h ? h : 1;
+}
+
+/** Locks the shared state, recovering it if its previous owner died.
+ */
+static void lock_state(void) {
+  if (pthread_mutex_lock(&state->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&state->lock);
+}
+
+/** Finds the bucket of a key, optionally replacing the bucket that
+ *  refilled first if the key has none. Must be called with the lock
+ *  held.
+ *
+ *  Returns: The bucket, or NULL if the key has none and create is 0.
+ */
+static struct auth_bucket *find_bucket(struct auth_bucket *table, uint64_t key,
+				       uint64_t time, int create) {
+
+  struct auth_bucket *victim = NULL;
+  for (unsigned int i = 0; i < AUTH_PROBES; i++) {
+    struct auth_bucket *b = &table[(key + i) & (AUTH_TABLE_SIZE - 1)];
+    if (b->key == key)
+      return b;
+    if (!victim || b->full < victim->full)
+      victim = b;
+  }
+  if (!create)
+    return NULL;
+  victim->key = key;
+  victim->full = time;
+  return victim;
+}
+
+/** Returns non-zero if a bucket has room for another failed attempt.
+ */
+static int bucket_allowed(struct auth_bucket *table, const struct auth_limit *limit,
+			  uint64_t key, uint64_t time) {
+
+  struct auth_bucket *b = find_bucket(table, key, time, 0);
+  return !b || b->full <= time + (uint64_t) (limit->burst - 1) * limit->interval;
+}
+
+/** Records a failed attempt in a bucket.
+ */
+static void bucket_fail(struct auth_bucket *table, const struct auth_limit *limit,
+			uint64_t key, uint64_t time) {
+
+  struct auth_bucket *b = find_bucket(table, key, time, 1);
+  b->full = (b->full > time ? b->full : time) + limit->interval;
+}
+
+/** Enables throttling. Must be called before the server creates any
+ *  process or thread.
+ *
+ *  Returns: 0 if throttling is enabled, -1 otherwise.
+ */
+int auth_init(void) {
+
+  pthread_mutexattr_t mutex_attr;
+
+  state = mmap(NULL, sizeof(struct auth_state), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (state == MAP_FAILED) {
+    state = NULL;
+    return -1;
+  }
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&state->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  return 0;
+}
+
+/** Identifies the client connected to a socket by its address (the
+ *  port is ignored, so all connections from a host share a bucket).
+ *
+ *  Parameters: fd: Socket connected to the client.
+ *
+ *  Returns: Key of the client, or 0 if its address is unknown.
+ */
+uint64_t auth_client(int fd) {
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0)
+    return 0;
+  if (addr.ss_family == AF_INET)
+    return hash_bytes(&((struct sockaddr_in *) &addr)->sin_addr, sizeof(struct in_addr), 0);
+  if (addr.ss_family == AF_INET6)
+    return hash_bytes(&((struct sockaddr_in6 *) &addr)->sin6_addr, sizeof(struct in6_addr), 0);
+  return 0;
+}
+
+/** Checks if an attempt may proceed to the credential check.
+ *
+ *  Parameters: client: Key returned by auth_client, 0 if unknown.
+ *              username: Name of the user (ignoring case), or NULL
+ *                        if only the client is checked.
+ *
+ *  Returns: non-zero (true) if neither the client nor the user has
+ *           exceeded its limit of failed attempts, zero otherwise.
+ */
+int auth_allowed(uint64_t client, const char *username) {
+
+  if (!state)
+    return 1;
+
+  uint64_t time = now();
+  int rv = 1;
+  lock_state();
+  if (client)
+    rv = bucket_allowed(state->clients, &client_limit, client, time);
+  if (rv && username)
+    rv = bucket_allowed(state->users, &user_limit,
+			hash_bytes(username, strlen(username), 1), time);
+  pthread_mutex_unlock(&state->lock);
+  return rv;
+}
+
+/** Records a failed attempt (e.g., an unknown user or a wrong
+ *  password) against the client and, if informed, the user.
+ *
+ *  Parameters: client: Key returned by auth_client, 0 if unknown.
+ *              username: Name of the user, or NULL.
+ */
+void auth_failed(uint64_t client, const char *username) {
+
+  if (!state)
+    return;
+
+  uint64_t time = now();
+  lock_state();
+  if (client)
+    bucket_fail(state->clients, &client_limit, client, time);
+  if (username)
+    bucket_fail(state->users, &user_limit, hash_bytes(username, strlen(username), 1), time);
+  pthread_mutex_unlock(&state->lock);
+}
@@ -0,0 +1,23 @@
+/* auth.h
+ * Throttling of failed authentication attempts, per client address
+ * and per user name, shared by all processes and threads of a server.
+ */
+
+#ifndef _AUTH_H_
+#define _AUTH_H_
+
+#include <stdint.h>
+
+// Failed attempts allowed in a burst, and sustained failures allowed
+// per minute, for each client address and for each user name
+#define AUTH_CLIENT_BURST 10
+#define AUTH_CLIENT_RATE  10
+#define AUTH_USER_BURST   5
+#define AUTH_USER_RATE    5
+
+int auth_init(void);
+uint64_t auth_client(int fd);
+int auth_allowed(uint64_t client, const char *username);
+void auth_failed(uint64_t client, const char *username);
+
+#endif
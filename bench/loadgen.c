@@ -0,0 +1,316 @@
+/* loadgen.c
+ * Load generator for mysmtpd and mypopd. Opens a number of
+ * concurrent sessions (one thread each), runs a script of commands
+ * in every session, and reports throughput and latency percentiles
+ * for each step of the script and for whole sessions.
+ *
+ * Scripts:
+ *   smtp: greeting, HELO, MAIL, RCPT (k times), DATA, message, QUIT
+ *   pop:  greeting, USER, PASS, STAT, LIST, RETR 1, QUIT
+ */
+
+#include "../netbuffer.h"
+#include "../metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MAX_LINE_LENGTH 1024
+#define MAX_STEPS       64  // maximum number of distinct steps in a script
+
+#define USAGE "[-c concurrency] [-n sessions] [-t seconds] [-k recipients] " \
+  "[-z message_size] -u user [-p password] smtp|pop <host> <port>"
+
+// A step of a script: a command (or message) sent, and the reply
+// read. Steps with the same label are reported together.
+struct step {
+  int         label;     // position of the step's label in labels
+  const char *command;   // text sent, NULL to only read a reply
+  size_t      len;
+  int         multiline; // 1 if a positive reply is followed by data up to "."
+};
+
+struct options {
+  int         concurrency;
+  long        sessions;
+  int         seconds;
+  int         recipients;
+  size_t      message_size;
+  const char *user;
+  const char *password;
+  int         pop;
+  const char *host;
+  const char *port;
+};
+
+// Totals of a worker thread, merged once the thread is done
+struct worker {
+  pthread_t                thread;
+  struct metrics_histogram steps[MAX_STEPS];
+  struct metrics_histogram sessions;
+  long                     errors;
+  long                     failed_sessions;
+};
+
+static struct options opts;
+static struct step script[3 * MAX_STEPS];
+static int script_len = 0;
+static const char *labels[MAX_STEPS];
+static int label_count = 0;
+static struct addrinfo *server_addr;
+
+static long sessions_started = 0;
+static uint64_t deadline = 0; // 0 if running a fixed number of sessions
+
+/** Adds a step to the script.
+ */
+static void add_step(const char *label, const char *command, int multiline) {
+
+  int i;
+  for (i = 0; i < label_count && strcmp(labels[i], label); i++);
+  if (i == label_count)
+    labels[label_count++] = label;
+
+  script[script_len].label = i;
+  script[script_len].command = command;
+  script[script_len].len = command ? strlen(command) : 0;
+  script[script_len].multiline = multiline;
+  script_len++;
+}
+
+/** Returns a newly allocated printf-style formatted string.
+ */
+static char *format(const char *str, const char *arg) {
+  size_t len = strlen(str) + strlen(arg) + 1;
+  char *rv = malloc(len);
+  snprintf(rv, len, str, arg);
+  return rv;
+}
+
+/** Builds the script selected in the options.
+ */
+static void build_script(void) {
+
+  add_step("greeting", NULL, 0);
+  if (opts.pop) {
+    add_step("USER", format("USER %s\r\n", opts.user), 0);
+    add_step("PASS", format("PASS %s\r\n", opts.password), 0);
+    add_step("STAT", "STAT\r\n", 0);
+    add_step("LIST", "LIST\r\n", 1);
+    add_step("RETR", "RETR 1\r\n", 1);
+    add_step("QUIT", "QUIT\r\n", 0);
+    return;
+  }
+
+  // The message is made of 78-character lines (plus CRLF), the last
+  // one shortened to reach the requested size
+  char *message = malloc(opts.message_size + 64);
+  size_t len = snprintf(message, 64, "Subject: loadgen\r\n\r\n");
+  while (len + 2 < opts.message_size) {
+    size_t line = opts.message_size - len - 2 < 78 ? opts.message_size - len - 2 : 78;
+    memset(message + len, 'x', line);
+    len += line;
+    message[len++] = '\r';
+    message[len++] = '\n';
+  }
+  strcpy(message + len, ".\r\n");
+
+  add_step("HELO", "HELO loadgen\r\n", 0);
+  add_step("MAIL", "MAIL FROM:<loadgen@localhost>\r\n", 0);
+  char *rcpt = format("RCPT TO:<%s>\r\n", opts.user);
+  for (int i = 0; i < opts.recipients && script_len < 3 * MAX_STEPS - 4; i++)
+    add_step("RCPT", rcpt, 0);
+  add_step("DATA", "DATA\r\n", 0);
+  add_step("message", message, 0);
+  add_step("QUIT", "QUIT\r\n", 0);
+}
+
+/** Reads the reply to a step.
+ *
+ *  Returns: 1 if the reply is positive, 0 if negative, -1 if the
+ *           connection failed.
+ */
+static int read_reply(net_buffer_t nb, const struct step *step) {
+
+  char line[MAX_LINE_LENGTH + 1];
+  int rv = nb_read_line(nb, line);
+  if (rv <= 0)
+    return -1;
+
+  if (opts.pop) {
+    if (line[0] != '+')
+      return 0;
+    while (step->multiline) {
+      if ((rv = nb_read_line(nb, line)) <= 0)
+	return -1;
+      if (!strcmp(line, ".\r\n"))
+	break;
+    }
+    return 1;
+  }
+
+  // SMTP replies continue while the code is followed by a hyphen
+  while (rv > 3 && line[3] == '-') {
+    if ((rv = nb_read_line(nb, line)) <= 0)
+      return -1;
+  }
+  return line[0] == '2' || line[0] == '3';
+}
+
+/** Runs a single session, recording the latency of each step.
+ *
+ *  Returns: 0 if the session ran to the end, -1 otherwise.
+ */
+static int run_session(struct worker *w) {
+
+  int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+  if (fd < 0 || connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+  int rv = 0;
+  for (int i = 0; i < script_len && rv == 0; i++) {
+    const struct step *step = &script[i];
+    uint64_t start = metrics_now();
+    if (step->command && send(fd, step->command, step->len, MSG_NOSIGNAL) != step->len) {
+      rv = -1;
+      break;
+    }
+
+    int reply = read_reply(nb, step);
+    if (reply < 0)
+      rv = -1;
+    else if (reply == 0)
+      w->errors++;
+    metrics_record(&w->steps[step->label], metrics_now() - start);
+  }
+
+  nb_destroy(nb);
+  close(fd);
+  return rv;
+}
+
+/** Worker thread, running sessions one after the other until the
+ *  requested number of sessions or time is reached.
+ */
+static void *worker(void *arg) {
+
+  struct worker *w = arg;
+  while (1) {
+    if (deadline) {
+      if (metrics_now() >= deadline)
+	break;
+    } else if (__atomic_fetch_add(&sessions_started, 1, __ATOMIC_RELAXED) >= opts.sessions) {
+      break;
+    }
+
+    uint64_t start = metrics_now();
+    if (run_session(w) < 0)
+      w->failed_sessions++;
+    else
+      metrics_record(&w->sessions, metrics_now() - start);
+  }
+  return NULL;
+}
+
+/** Prints a row of the latency table, in milliseconds.
+ */
+static void print_row(const char *label, const struct metrics_histogram *h) {
+  printf("%-10s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", label,
+	 (unsigned long long) h->count, h->count ? (double) h->sum / h->count / 1000 : 0,
+	 metrics_quantile(h, 0.5) / 1000.0, metrics_quantile(h, 0.99) / 1000.0,
+	 metrics_quantile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+
+  struct addrinfo hints;
+  int opt;
+
+  opts.concurrency = 8;
+  opts.sessions = 1000;
+  opts.recipients = 1;
+  opts.message_size = 1024;
+  opts.password = "";
+  while ((opt = getopt(argc, argv, "c:n:t:k:z:u:p:")) != -1) {
+    switch (opt) {
+    case 'c': opts.concurrency = atoi(optarg); break;
+    case 'n': opts.sessions = atol(optarg); break;
+    case 't': opts.seconds = atoi(optarg); break;
+    case 'k': opts.recipients = atoi(optarg); break;
+    case 'z': opts.message_size = atol(optarg); break;
+    case 'u': opts.user = optarg; break;
+    case 'p': opts.password = optarg; break;
+    default:
+      fprintf(stderr, "Invalid arguments. Expected: %s " USAGE "\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (argc != optind + 3 || !opts.user || opts.concurrency <= 0 ||
+      (strcmp(argv[optind], "smtp") && strcmp(argv[optind], "pop"))) {
+    fprintf(stderr, "Invalid arguments. Expected: %s " USAGE "\n", argv[0]);
+    return 1;
+  }
+  opts.pop = !strcmp(argv[optind], "pop");
+  opts.host = argv[optind + 1];
+  opts.port = argv[optind + 2];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rv = getaddrinfo(opts.host, opts.port, &hints, &server_addr);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return 1;
+  }
+
+  build_script();
+
+  struct worker *workers = calloc(opts.concurrency, sizeof(struct worker));
+  uint64_t start = metrics_now();
+  if (opts.seconds > 0)
+    deadline = start + (uint64_t) opts.seconds * 1000000;
+  for (int i = 0; i < opts.concurrency; i++)
+    pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+
+  struct metrics_histogram *steps = calloc(MAX_STEPS, sizeof(struct metrics_histogram));
+  struct metrics_histogram *sessions = calloc(1, sizeof(struct metrics_histogram));
+  long errors = 0, failed = 0;
+  for (int i = 0; i < opts.concurrency; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (int j = 0; j < label_count; j++)
+      metrics_merge(&steps[j], &workers[i].steps[j]);
+    metrics_merge(sessions, &workers[i].sessions);
+    errors += workers[i].errors;
+    failed += workers[i].failed_sessions;
+  }
+  double elapsed = (metrics_now() - start) / 1e6;
+
+  uint64_t commands = 0;
+  for (int j = 0; j < label_count; j++)
+    commands += steps[j].count;
+
+  printf("%s: %d concurrent sessions, %llu sessions in %.2f s\n", argv[optind],
+	 opts.concurrency, (unsigned long long) sessions->count, elapsed);
+  printf("throughput: %.1f sessions/s, %.1f steps/s\n",
+	 sessions->count / elapsed, commands / elapsed);
+  printf("errors: %ld negative replies, %ld failed sessions\n\n", errors, failed);
+  printf("%-10s %10s %10s %10s %10s %10s %10s\n", "step (ms)", "count", "mean",
+	 "p50", "p99", "p999", "max");
+  for (int j = 0; j < label_count; j++)
+    print_row(labels[j], &steps[j]);
+  print_row("session", sessions);
+
+  freeaddrinfo(server_addr);
+  return failed ? 1 : 0;
+}
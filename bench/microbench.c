@@ -0,0 +1,380 @@
+/* microbench.c
+ * Microbenchmarks for the line reader and the mail storage, run in a
+ * temporary directory with a synthetic users file and mailboxes:
+ *
+ *   nb_read_line:   lines read per second from a socket, with
+ *                   nb_read_line and with nb_peek_line/nb_consume
+ *   textscan:       message text dot-stuffed for sending, and
+ *                   searched for dot lines when received
+ *   is_valid_user:  lookups of existing and missing users, one at a
+ *                   time and in batches (check_valid_users)
+ *   save_user_mail: deliveries to a mailbox, as it grows from 10 to
+ *                   the maximum number of messages
+ *   load_user_mail: loads of the same mailbox at each size, from the
+ *                   index and from a directory scan
+ *   destroy_mail_list: deletion of every message of the mailbox, in
+ *                   two sessions, after which no object should be
+ *                   left in the object store
+ */
+
+#define _XOPEN_SOURCE 700 // for nftw
+
+#include "../netbuffer.h"
+#include "../mailuser.h"
+#include "../metrics.h"
+#include "../textscan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MAX_LINE_LENGTH 1024
+#define LINE_SIZE       80      // bytes in each line sent to the reader
+#define LINE_COUNT      1000000 // lines sent to the reader
+#define WRITE_SIZE      65536   // bytes written to the socket at a time
+#define LOOKUPS         1000000 // user lookups measured
+#define BATCH           64      // user names in each batched lookup
+#define TEXT_CHUNK      16384   // bytes of text scanned at a time
+#define TEXT_CHUNKS     20000   // chunks of text scanned
+
+#define USAGE "[-m max_messages] [-u users]"
+
+static int send_fd;
+
+/** Prints the result of a benchmark.
+ */
+static void report(const char *name, const char *detail, long ops, uint64_t elapsed) {
+  printf("%-16s %-24s %10ld ops %10.3f ms %12.0f ops/s %10.3f us/op\n", name, detail, ops,
+	 elapsed / 1000.0, elapsed ? ops * 1e6 / elapsed : 0, (double) elapsed / ops);
+}
+
+/** Thread that writes LINE_COUNT lines to the socket, in large writes.
+ */
+static void *line_writer(void *arg) {
+
+  char *buf = malloc(WRITE_SIZE);
+  size_t lines_per_write = WRITE_SIZE / LINE_SIZE;
+  for (size_t i = 0; i < lines_per_write; i++) {
+    memset(buf + i * LINE_SIZE, 'a' + i % 26, LINE_SIZE - 2);
+    memcpy(buf + (i + 1) * LINE_SIZE - 2, "\r\n", 2);
+  }
+
+  for (size_t sent = 0; sent < LINE_COUNT; sent += lines_per_write) {
+    size_t len = (LINE_COUNT - sent < lines_per_write ? LINE_COUNT - sent : lines_per_write) *
+      LINE_SIZE;
+    for (size_t off = 0; off < len; ) {
+      ssize_t rv = write(send_fd, buf + off, len - off);
+      if (rv <= 0)
+	goto done;
+      off += rv;
+    }
+  }
+ done:
+  close(send_fd);
+  free(buf);
+  return NULL;
+}
+
+/** Measures the line reader, copying lines out or peeking them.
+ */
+static void bench_line_reader(int peek) {
+
+  int fds[2];
+  pthread_t thread;
+  char out[MAX_LINE_LENGTH + 1];
+  char *line;
+  long lines = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    perror("socketpair");
+    return;
+  }
+  send_fd = fds[1];
+  net_buffer_t nb = nb_create(fds[0], MAX_LINE_LENGTH);
+  pthread_create(&thread, NULL, line_writer, NULL);
+
+  uint64_t start = metrics_now();
+  while (1) {
+    int rv = peek ? nb_peek_line(nb, &line) : nb_read_line(nb, out);
+    if (rv <= 0)
+      break;
+    if (peek)
+      nb_consume(nb, rv);
+    lines++;
+  }
+  uint64_t elapsed = metrics_now() - start;
+
+  pthread_join(thread, NULL);
+  report("nb_read_line", peek ? "peek/consume" : "copy", lines, elapsed);
+  nb_destroy(nb);
+  close(fds[0]);
+}
+
+/** Measures the text scanner on a chunk of lines, with CRLF or bare
+ *  LF line terminators, and a line starting with a dot every 100
+ *  lines.
+ */
+static void bench_textscan(int crlf) {
+
+  char in[TEXT_CHUNK], out[2 * TEXT_CHUNK];
+  size_t line_size = crlf ? LINE_SIZE : LINE_SIZE - 1;
+  long found = 0;
+
+  for (size_t i = 0; i < sizeof(in); i++) {
+    size_t pos = i % line_size, line = i / line_size;
+    in[i] = pos == line_size - 1 ? '\n' : crlf && pos == line_size - 2 ? '\r' :
+      pos == 0 && line % 100 == 0 ? '.' : 'a' + line % 26;
+  }
+
+  char prev = '\n';
+  uint64_t start = metrics_now();
+  for (long i = 0; i < TEXT_CHUNKS; i++)
+    found += textscan_stuff(in, sizeof(in), out, &prev);
+  report("textscan", crlf ? "stuff, CRLF" : "stuff, bare LF", TEXT_CHUNKS, metrics_now() - start);
+
+  start = metrics_now();
+  for (long i = 0; i < TEXT_CHUNKS; i++) {
+    for (const char *p = in; (p = textscan_line_dot(p, in + sizeof(in), '\n')) < in + sizeof(in); p++)
+      found++;
+  }
+  report("textscan", crlf ? "line dots, CRLF" : "line dots, bare LF", TEXT_CHUNKS,
+	 metrics_now() - start);
+
+  if (!found)
+    fprintf(stderr, "textscan: nothing scanned\n");
+}
+
+/** Writes a users file with the given number of users.
+ */
+static void write_users(long users) {
+
+  FILE *file = fopen("users.txt", "w");
+  for (long i = 0; i < users; i++)
+    fprintf(file, "user%ld@bench password%ld\n", i, i);
+  fclose(file);
+}
+
+/** Measures lookups of existing users (with their passwords) and of
+ *  missing users.
+ */
+static void bench_users(long users) {
+
+  char name[64], password[64];
+  char detail[32];
+  long found = 0;
+
+  // the first lookup loads the users file
+  is_valid_user("user0@bench", NULL);
+
+  uint64_t start = metrics_now();
+  for (long i = 0; i < LOOKUPS; i++) {
+    long n = (i * 7919) % users;
+    snprintf(name, sizeof(name), "user%ld@bench", n);
+    snprintf(password, sizeof(password), "password%ld", n);
+    found += is_valid_user(name, password) != 0;
+  }
+  snprintf(detail, sizeof(detail), "%ld users, existing", users);
+  report("is_valid_user", detail, LOOKUPS, metrics_now() - start);
+
+  start = metrics_now();
+  for (long i = 0; i < LOOKUPS; i++) {
+    snprintf(name, sizeof(name), "missing%ld@bench", i);
+    found += is_valid_user(name, NULL) != 0;
+  }
+  snprintf(detail, sizeof(detail), "%ld users, missing", users);
+  report("is_valid_user", detail, LOOKUPS, metrics_now() - start);
+
+  // batches of mostly missing recipients, as in an RCPT storm
+  char names[BATCH][64];
+  const char *batch[BATCH];
+  int results[BATCH];
+  long batch_found = 0;
+  start = metrics_now();
+  for (long i = 0; i < LOOKUPS; i += BATCH) {
+    for (int j = 0; j < BATCH; j++) {
+      if ((i + j) % 8)
+	snprintf(names[j], sizeof(names[j]), "missing%ld@bench", i + j);
+      else
+	snprintf(names[j], sizeof(names[j]), "user%ld@bench", (i + j) % users);
+      batch[j] = names[j];
+    }
+    check_valid_users(batch, BATCH, results);
+    for (int j = 0; j < BATCH; j++)
+      batch_found += results[j] != 0;
+  }
+  snprintf(detail, sizeof(detail), "%ld users, batch of %d", users, BATCH);
+  report("check_valid_users", detail, LOOKUPS, metrics_now() - start);
+
+  if (batch_found != LOOKUPS / 8)
+    fprintf(stderr, "check_valid_users: unexpected result (%ld found)\n", batch_found);
+  if (found != LOOKUPS)
+    fprintf(stderr, "is_valid_user: unexpected result (%ld found)\n", found);
+}
+
+/** Delivers messages to a mailbox until it has the given number of
+ *  messages. Every message has different contents, so no delivery is
+ *  shared with another in the object store.
+ */
+static void deliver(user_list_t users, long from, long to) {
+
+  char detail[32];
+  uint64_t elapsed = 0;
+
+  for (long i = from; i < to; i++) {
+    FILE *file = fopen("spool.tmp", "w");
+    fprintf(file, "Subject: message %ld\r\n\r\nBenchmark message %ld.\r\n", i, i);
+    fclose(file);
+
+    uint64_t start = metrics_now();
+    save_user_mail("spool.tmp", users);
+    elapsed += metrics_now() - start;
+    unlink("spool.tmp");
+  }
+  snprintf(detail, sizeof(detail), "%ld -> %ld messages", from, to);
+  report("save_user_mail", detail, to - from, elapsed);
+}
+
+/** Measures loads of a mailbox, from its index and, if scan is set,
+ *  from a directory scan (which also rebuilds the index).
+ */
+static void bench_load(const char *user, long messages, int scan) {
+
+  char detail[32];
+  int loads = messages >= 10000 ? 10 : 100000 / messages;
+  uint64_t elapsed = 0;
+
+  for (int i = 0; i < loads; i++) {
+    if (scan) {
+      char path[128];
+      snprintf(path, sizeof(path), "mail.store/%s/.index", user);
+      unlink(path);
+    }
+    uint64_t start = metrics_now();
+    mail_list_t list = load_user_mail(user);
+    elapsed += metrics_now() - start;
+    if (get_mail_count(list) != messages)
+      fprintf(stderr, "load_user_mail: expected %ld messages, found %u\n", messages,
+	      get_mail_count(list));
+    destroy_mail_list(list);
+  }
+  snprintf(detail, sizeof(detail), "%ld messages, %s", messages, scan ? "scan" : "index");
+  report("load_user_mail", detail, loads, elapsed);
+}
+
+/** Measures the deletion of the messages of a mailbox, from position
+ *  from to position to, in a single session (with the reclaimer not
+ *  running, the files are deleted when the list is destroyed).
+ */
+static void delete_messages(const char *user, unsigned int from, unsigned int to) {
+
+  char detail[32];
+  mail_list_t list = load_user_mail(user);
+  uint64_t start = metrics_now();
+  for (unsigned int i = from; i < to; i++)
+    mark_mail_item_deleted(get_mail_item(list, i));
+  destroy_mail_list(list);
+  snprintf(detail, sizeof(detail), "%u of %u messages", to - from, to);
+  report("destroy_mail_list", detail, to - from, metrics_now() - start);
+}
+
+/** Returns the number of objects in the object store.
+ */
+static long count_objects(void) {
+
+  long count = 0;
+  DIR *dir = opendir("mail.store/.objects");
+  for (struct dirent *entry; dir && (entry = readdir(dir)) != NULL; )
+    count += entry->d_name[0] != '.';
+  if (dir)
+    closedir(dir);
+  return count;
+}
+
+/** Measures deletions of all messages of a new mailbox, half of them
+ *  in a first session, and the rest in a second one (which reads the
+ *  index compacted by the first), and checks that their objects are
+ *  removed from the object store. The mailbox of the user must not
+ *  exist yet, since a mailbox indexed from a directory scan has no
+ *  object keys.
+ */
+static void bench_delete(const char *user, long messages) {
+
+  long before = count_objects();
+  user_list_t users = create_user_list();
+  add_user_to_list(&users, user);
+  for (long i = 0; i < messages; i++) {
+    FILE *file = fopen("spool.tmp", "w");
+    fprintf(file, "Subject: deleted %ld\r\n\r\nBenchmark message %ld.\r\n", i, i);
+    fclose(file);
+    save_user_mail("spool.tmp", users);
+    unlink("spool.tmp");
+  }
+  destroy_user_list(users);
+
+  delete_messages(user, messages / 2, messages);
+  delete_messages(user, 0, messages / 2);
+
+  long left = count_objects() - before;
+  if (left)
+    fprintf(stderr, "destroy_mail_list: %ld objects left in the object store\n", left);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+
+  long max_messages = 100000, users = 100000;
+  char dir[] = "/tmp/microbenchXXXXXX";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:u:")) != -1) {
+    switch (opt) {
+    case 'm': max_messages = atol(optarg); break;
+    case 'u': users = atol(optarg); break;
+    default:
+      fprintf(stderr, "Invalid arguments. Expected: %s " USAGE "\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc != optind || max_messages < 10 || users < 1) {
+    fprintf(stderr, "Invalid arguments. Expected: %s " USAGE "\n", argv[0]);
+    return 1;
+  }
+
+  // the mail storage uses paths relative to the current directory
+  if (!mkdtemp(dir) || chdir(dir) < 0) {
+    perror(dir);
+    return 1;
+  }
+
+  bench_line_reader(0);
+  bench_line_reader(1);
+  bench_textscan(1);
+  bench_textscan(0);
+
+  write_users(users);
+  bench_users(users);
+
+  user_list_t recipients = create_user_list();
+  add_user_to_list(&recipients, "user0@bench");
+  long messages = 0;
+  for (long size = 10; size <= max_messages; size *= 10) {
+    deliver(recipients, messages, size);
+    messages = size;
+    bench_load("user0@bench", messages, 0);
+    bench_load("user0@bench", messages, 1);
+  }
+  bench_delete("user1@bench", messages);
+  destroy_user_list(recipients);
+
+  if (chdir("/") == 0)
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
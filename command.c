@@ -0,0 +1,120 @@
+/* command.c
+ * Parsing of protocol command lines (as used by SMTP and POP3: a
+ * four-letter verb, or a three-letter one such as POP3 TOP, followed
+ * by arguments separated by spaces), and
+ * dispatch of commands through a table of handlers.
+ *
+ * A line is parsed in a single pass: the verb is converted to a
+ * case-folded 32-bit code, so finding its handler takes one integer
+ * comparison per table entry, and the arguments are recorded as
+ * spans of the line. Arguments are also null-terminated in place, so
+ * they can be passed to functions expecting strings without being
+ * copied.
+ */
+
+#include "command.h"
+
+#include <limits.h>
+
+/** Parses a command line.
+ *
+ *  Parameters: line: Line received from the client, with or without
+ *                    the line terminator. The separators after each
+ *                    argument are overwritten with null bytes.
+ *              len: Number of bytes in the line.
+ *              cmd: Parsed command. A line that does not start with
+ *                   a three- or four-letter verb followed by a space
+ *                   or the end of the line has a verb of 0.
+ */
+void command_parse(char *line, size_t len, struct command *cmd) {
+
+  // the line terminator is not part of the last argument
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    len--;
+
+  cmd->verb = 0;
+  cmd->arg_count = 0;
+  size_t verb_len = len == 3 || (len > 3 && line[3] == ' ') ? 3 : 4;
+  if (len < verb_len || (len > verb_len && line[verb_len] != ' '))
+    return;
+
+  // the code of a three-letter verb ends in a space
+  const unsigned char *p = (const unsigned char *) line;
+  uint32_t verb = ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+		   (uint32_t) (verb_len == 4 ? p[3] : ' ') << 24) | 0x20202020;
+  for (int i = 0; i < 8 * (int) verb_len; i += 8) {
+    unsigned char c = verb >> i;
+    if (c < 'a' || c > 'z')
+      return;
+  }
+  cmd->verb = verb;
+
+  size_t i = verb_len;
+  while (i < len) {
+    while (i < len && line[i] == ' ')
+      line[i++] = '\0';
+    if (i == len)
+      break;
+
+    size_t start = i;
+    while (i < len && line[i] != ' ')
+      i++;
+    if (cmd->arg_count < COMMAND_MAX_ARGS) {
+      cmd->args[cmd->arg_count].ptr = line + start;
+      cmd->args[cmd->arg_count].len = i - start;
+    }
+    cmd->arg_count++;
+  }
+  line[len] = '\0';
+}
+
+/** Finds the handler of a command in a table.
+ *
+ *  Parameters: table: Table of commands.
+ *              count: Number of entries in the table.
+ *              cmd: Command parsed with command_parse.
+ *
+ *  Returns: Position of the command's entry in the table, or -1 if
+ *           the command is not in the table.
+ */
+int command_find(const struct command_entry table[], int count, const struct command *cmd) {
+
+  if (cmd->verb == 0)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    if (table[i].verb == cmd->verb)
+      return i;
+  }
+  return -1;
+}
+
+/** Returns 1 if a command has the number of arguments expected by
+ *  its entry, 0 otherwise.
+ */
+int command_args_valid(const struct command_entry *entry, const struct command *cmd) {
+  return cmd->arg_count >= entry->min_args &&
+    (entry->max_args == COMMAND_ANY_ARGS || cmd->arg_count <= entry->max_args);
+}
+
+/** Converts an argument made only of decimal digits to a number.
+ *
+ *  Parameters: arg: Argument to be converted.
+ *              value: Converted number.
+ *
+ *  Returns: 0 if the argument was converted, -1 if it is not a
+ *           number, or is too large.
+ */
+int command_number(const struct command_arg *arg, unsigned int *value) {
+
+  unsigned int n = 0;
+  if (arg->len == 0)
+    return -1;
+  for (size_t i = 0; i < arg->len; i++) {
+    unsigned int digit = arg->ptr[i] - '0';
+    if (digit > 9 || n > (UINT_MAX - digit) / 10)
+      return -1;
+    n = n * 10 + digit;
+  }
+  *value = n;
+  return 0;
+}
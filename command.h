@@ -0,0 +1,45 @@
+/* command.h
+ * Parsing of protocol command lines, and dispatch of commands
+ * through a table of handlers.
+ */
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMMAND_MAX_ARGS 8  // maximum number of arguments kept for a command
+#define COMMAND_ANY_ARGS -1 // max_args of a command with no maximum
+
+// Code of a four-letter verb, case-folded, as computed by
+// command_parse (e.g., COMMAND_VERB('Q','U','I','T')); a three-letter
+// verb ends in a space (e.g., COMMAND_VERB('T','O','P',' '))
+#define COMMAND_VERB(a, b, c, d)					\
+  ((uint32_t) ((a) | 0x20) | (uint32_t) ((b) | 0x20) << 8 |		\
+   (uint32_t) ((c) | 0x20) << 16 | (uint32_t) ((d) | 0x20) << 24)
+
+struct command_arg {
+  char  *ptr;  // null-terminated (the separator after it is overwritten)
+  size_t len;
+};
+
+struct command {
+  uint32_t           verb;      // COMMAND_VERB of the verb, 0 if not a valid verb
+  int                arg_count; // number of arguments, including those not kept
+  struct command_arg args[COMMAND_MAX_ARGS];
+};
+
+struct command_entry {
+  uint32_t verb;
+  int      min_args;
+  int      max_args; // COMMAND_ANY_ARGS if there is no maximum
+  int    (*handler)(void *session, const struct command *cmd);
+};
+
+void command_parse(char *line, size_t len, struct command *cmd);
+int command_find(const struct command_entry table[], int count, const struct command *cmd);
+int command_args_valid(const struct command_entry *entry, const struct command *cmd);
+int command_number(const struct command_arg *arg, unsigned int *value);
+
+#endif
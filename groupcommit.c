@@ -0,0 +1,315 @@
+/* groupcommit.c
+ * Group commit of deliveries.
+ *
+ * A message is only safe once its file, its links in the mailboxes
+ * and the index records are on disk, but syncing after every message
+ * would limit deliveries to one per disk flush. Instead, a writer
+ * takes a ticket once its writes are done (group_commit_request),
+ * and waits for a sync that started after the ticket was taken
+ * (group_commit_wait). The first waiter becomes the leader: it waits
+ * a short window for more writers to join, then runs a single syncfs
+ * for all tickets taken so far, and wakes every waiter it covered.
+ * Writers arriving while a sync is running are covered by the next
+ * one. If messages are written to several filesystems (e.g., the
+ * queue and shards of the mail storage mounted from other disks),
+ * each of them is synced, and the sync only succeeds if all of them
+ * do.
+ *
+ * If a sync fails, the writes it covered may be lost (the kernel
+ * reports a writeback error once, and may drop the pages), so the
+ * tickets it covered are reported as failed. So are those covered by
+ * the next sync, since a writer may finish its writes before a failed
+ * sync and take its ticket just after it; later tickets are accepted
+ * again once a sync succeeds. The last GROUP_COMMIT_FAILURES ranges
+ * of failed tickets are kept, and a ticket older than all of them is
+ * reported as failed.
+ *
+ * The state is kept in an anonymous shared mapping created before the
+ * server starts, so it is shared by forked processes as well as
+ * threads, and protected by a robust process-shared mutex, so a
+ * process that dies while holding it does not block the others.
+ * Waiters sleep on a futex incremented by every sync, rather than on
+ * a process-shared condition variable, which a waiter killed while
+ * waiting on it would leave blocking the next leader.
+ *
+ * If group commit is not initialized, tickets are always done, and
+ * nothing is synced.
+ */
+
+#define _GNU_SOURCE // for syncfs
+
+#include "groupcommit.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// A waiter takes over from a leader whose sync has taken longer than
+// this (e.g., because the leader's process died), in microseconds
+#define GROUP_COMMIT_TAKEOVER 1000000
+
+#define GROUP_COMMIT_FAILURES 16 // ranges of failed tickets kept
+
+struct failed_range {
+  uint64_t first; // first ticket covered by a failed sync
+  uint64_t last;  // last ticket covered by it, or by the sync after it
+};
+
+struct group_commit {
+  pthread_mutex_t     lock;
+  uint32_t            syncs;        // futex incremented when a sync completes
+  uint64_t            requested;    // last ticket taken
+  uint64_t            completed;    // last ticket covered by a completed sync
+  int                 syncing;      // 1 while a leader is waiting or syncing
+  uint64_t            sync_started; // time the leader started, in microseconds
+  int                 failing;      // 1 if the last sync failed
+  unsigned int        failures;     // ranges of failed tickets recorded so far
+  struct failed_range failed[GROUP_COMMIT_FAILURES]; // the last ones recorded
+};
+
+static struct group_commit *commit = NULL;
+static int sync_fds[GROUP_COMMIT_MAX_FILESYSTEMS]; // one per filesystem synced
+static unsigned int sync_count = 0;
+static unsigned int window;
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Internal function that waits, for at most a second, until a sync
+ *  completes after the count of syncs was read as seen.
+ */
+static void wait_sync(uint32_t seen) {
+  struct timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+  syscall(SYS_futex, &commit->syncs, FUTEX_WAIT, seen, &ts, NULL, 0);
+}
+
+/** Internal function that wakes every waiter once a sync completes.
+ */
+static void wake_syncs(void) {
+  __atomic_add_fetch(&commit->syncs, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &commit->syncs, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/** Locks the shared state, recovering it if its previous owner died.
+ */
+static void lock_commit(void) {
+  if (pthread_mutex_lock(&commit->lock) == EOWNERDEAD) {
+    commit->syncing = 0;
+    pthread_mutex_consistent(&commit->lock);
+  }
+}
+
+/** Internal function that closes the filesystems opened by
+ *  group_commit_init.
+ */
+static void close_filesystems(void) {
+  while (sync_count)
+    close(sync_fds[--sync_count]);
+}
+
+/** Internal function that syncs every filesystem where messages are
+ *  written.
+ *
+ *  Returns: 0 if all of them were synced, -1 otherwise.
+ */
+static int sync_filesystems(void) {
+
+  int rv = 0;
+  for (unsigned int i = 0; i < sync_count; i++) {
+    if (syncfs(sync_fds[i]) < 0) {
+      perror("syncfs");
+      rv = -1;
+    }
+  }
+  return rv;
+}
+
+/** Enables group commit. Must be called before the server creates
+ *  any process or thread.
+ *
+ *  Parameters: paths: Files or directories in the filesystems where
+ *                     messages are written. Each filesystem is synced
+ *                     once, however many of them are in it.
+ *              count: Number of paths.
+ *              sync_window: Time, in microseconds, the leader waits
+ *                           for more writers before syncing.
+ *
+ *  Returns: 0 if group commit is enabled, -1 otherwise (e.g., if a
+ *           path cannot be opened).
+ */
+int group_commit_init(const char *const *paths, unsigned int count, unsigned int sync_window) {
+
+  pthread_mutexattr_t mutex_attr;
+  dev_t devices[GROUP_COMMIT_MAX_FILESYSTEMS];
+  struct stat file_stat;
+
+  for (unsigned int i = 0; i < count; i++) {
+    int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &file_stat) < 0) {
+      if (fd >= 0)
+	close(fd);
+      close_filesystems();
+      return -1;
+    }
+    unsigned int j = 0;
+    while (j < sync_count && devices[j] != file_stat.st_dev)
+      j++;
+    if (j < sync_count) {
+      close(fd);
+      continue;
+    }
+    if (sync_count == GROUP_COMMIT_MAX_FILESYSTEMS) {
+      close(fd);
+      close_filesystems();
+      errno = EMFILE;
+      return -1;
+    }
+    devices[sync_count] = file_stat.st_dev;
+    sync_fds[sync_count++] = fd;
+  }
+
+  commit = mmap(NULL, sizeof(struct group_commit), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (commit == MAP_FAILED) {
+    commit = NULL;
+    close_filesystems();
+    return -1;
+  }
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&commit->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  window = sync_window;
+  return 0;
+}
+
+/** Takes a ticket for all writes made so far by the caller. The
+ *  writes are on disk once the ticket is done.
+ *
+ *  Returns: The ticket, to be passed to group_commit_wait, or 0 if
+ *           group commit is not enabled.
+ */
+uint64_t group_commit_request(void) {
+
+  if (!commit)
+    return 0;
+  lock_commit();
+  uint64_t ticket = ++commit->requested;
+  pthread_mutex_unlock(&commit->lock);
+  return ticket;
+}
+
+/** Returns non-zero if the sync of the writes covered by a ticket is
+ *  done, whether it succeeded or not (see group_commit_failed).
+ */
+int group_commit_done(uint64_t ticket) {
+  return !commit || __atomic_load_n(&commit->completed, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+/** Returns non-zero if the sync of the writes covered by a done
+ *  ticket failed, so they may not be on disk.
+ */
+int group_commit_failed(uint64_t ticket) {
+
+  if (!commit || !ticket)
+    return 0;
+  lock_commit();
+  unsigned int oldest = commit->failures > GROUP_COMMIT_FAILURES ?
+    commit->failures - GROUP_COMMIT_FAILURES : 0;
+  int failed = oldest && ticket < commit->failed[oldest % GROUP_COMMIT_FAILURES].first;
+  for (unsigned int i = oldest; !failed && i < commit->failures; i++) {
+    struct failed_range *range = &commit->failed[i % GROUP_COMMIT_FAILURES];
+    failed = ticket >= range->first && ticket <= range->last;
+  }
+  pthread_mutex_unlock(&commit->lock);
+  return failed;
+}
+
+/** Internal function that records the result of a sync covering a
+ *  range of tickets. Must be called with the lock held.
+ */
+static void record_sync(uint64_t first, uint64_t last, int rv) {
+
+  if (commit->failing) {
+    // the range of the previous, failed, sync is extended over this one
+    commit->failed[(commit->failures - 1) % GROUP_COMMIT_FAILURES].last = last;
+  } else if (rv < 0) {
+    struct failed_range *range = &commit->failed[commit->failures++ % GROUP_COMMIT_FAILURES];
+    range->first = first;
+    range->last = last;
+  }
+  commit->failing = rv < 0;
+}
+
+/** Internal function that returns the result of group_commit_wait
+ *  for a done ticket.
+ */
+static int commit_status(uint64_t ticket) {
+  if (group_commit_failed(ticket)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/** Waits until the writes covered by a ticket are on disk, syncing
+ *  them if no other process or thread is doing it already.
+ *
+ *  Parameters: ticket: Ticket returned by group_commit_request.
+ *
+ *  Returns: 0 if the writes are on disk, -1 if the sync failed, with
+ *           errno set to EIO.
+ */
+int group_commit_wait(uint64_t ticket) {
+
+  if (group_commit_done(ticket))
+    return commit_status(ticket);
+
+  lock_commit();
+  while (commit->completed < ticket) {
+    if (commit->syncing && now() - commit->sync_started < GROUP_COMMIT_TAKEOVER) {
+      uint32_t seen = commit->syncs;
+      pthread_mutex_unlock(&commit->lock);
+      wait_sync(seen);
+      lock_commit();
+      continue;
+    }
+
+    // this thread is the leader for all tickets taken until the end
+    // of the window
+    commit->syncing = 1;
+    commit->sync_started = now();
+    pthread_mutex_unlock(&commit->lock);
+    if (window)
+      usleep(window);
+
+    lock_commit();
+    uint64_t first = commit->completed + 1, target = commit->requested;
+    pthread_mutex_unlock(&commit->lock);
+
+    int rv = sync_filesystems();
+
+    lock_commit();
+    record_sync(first, target, rv);
+    if (commit->completed < target)
+      __atomic_store_n(&commit->completed, target, __ATOMIC_RELEASE);
+    commit->syncing = 0;
+    wake_syncs();
+  }
+  pthread_mutex_unlock(&commit->lock);
+  return commit_status(ticket);
+}
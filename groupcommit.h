@@ -0,0 +1,21 @@
+/* groupcommit.h
+ * Group commit of deliveries: one filesystem sync covers all the
+ * messages written by every process and thread of a server within a
+ * short window.
+ */
+
+#ifndef _GROUP_COMMIT_H_
+#define _GROUP_COMMIT_H_
+
+#include <stdint.h>
+
+#define GROUP_COMMIT_DEFAULT_WINDOW 2000 // microseconds waited for more writes
+#define GROUP_COMMIT_MAX_FILESYSTEMS 128 // distinct filesystems synced
+
+int group_commit_init(const char *const *paths, unsigned int count, unsigned int sync_window);
+uint64_t group_commit_request(void);
+int group_commit_done(uint64_t ticket);
+int group_commit_failed(uint64_t ticket);
+int group_commit_wait(uint64_t ticket);
+
+#endif
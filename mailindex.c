@@ -0,0 +1,483 @@
+/* mailindex.c
+ * Per-mailbox index of messages, used to load a mailbox without
+ * scanning its directory and calling stat for every message.
+ *
+ * The index is a file in the mailbox directory, containing a header
+ * followed by a log of records. Deliveries append a record to the
+ * existing index, and deletions append a tombstone for each removed
+ * message, which hides the message from readers until the index is
+ * rewritten without it. The index is rebuilt from a directory scan if
+ * it is missing or stale.
+ *
+ * The index is considered stale if its modification time is older
+ * than the directory's, i.e., if a message file was added or removed
+ * without the index being updated. Every change to the directory and
+ * the index should be made while holding the mailbox lock
+ * (mail_index_lock), so that a delivery is never lost by a
+ * concurrent rewrite of the index.
+ */
+
+#include "mailindex.h"
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define MAIL_INDEX_TMP_NAME MAIL_INDEX_FILE_NAME ".tmp"
+#define MAIL_INDEX_MAGIC    0x5844494d // "MIDX"
+#define MAIL_INDEX_VERSION  1
+
+#define RECORD_ADD         1 // a message was added to the mailbox
+#define RECORD_ADD_HEADER  2 // same, including the size of its header
+#define RECORD_REMOVE      3 // a message was removed (tombstone)
+
+struct index_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+// Header of every record, followed by the name and then by data_len
+// bytes of type-specific data (records of unknown types are skipped).
+// For RECORD_ADD, the data contains the entry's flags, followed by
+// the entry's key, if any. RECORD_ADD_HEADER is written for entries
+// whose header size is known, which is stored between the flags and
+// the key. RECORD_REMOVE has no data, and refers to the message added
+// by an earlier record with the same name.
+struct index_record {
+  uint16_t type;
+  uint16_t name_len;
+  uint32_t data_len;
+  uint64_t size;
+};
+
+// Largest record written, for a name as long as a file name can be
+#define MAX_RECORD_SIZE (sizeof(struct index_record) + NAME_MAX + sizeof(uint32_t) + \
+			 sizeof(uint64_t) + MAIL_INDEX_MAX_KEY)
+
+// Name of a removed message, pointing into the index data
+struct tombstone {
+  const char *name;
+  size_t      name_len;
+};
+
+struct mail_index_writer {
+  int   dirfd;
+  FILE *file;
+  int   failed; // set if any message could not be added
+};
+
+/** Locks a mailbox for changes in its directory or index. Only one
+ *  process (or thread) holds the lock at a time; the lock is
+ *  released once the directory is closed.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ *
+ *  Returns: 0 if the mailbox was locked, -1 on error.
+ */
+int mail_index_lock(int dirfd) {
+
+  int rv;
+  while ((rv = flock(dirfd, LOCK_EX)) < 0 && errno == EINTR);
+  return rv;
+}
+
+/** Releases the lock obtained with mail_index_lock.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ */
+void mail_index_unlock(int dirfd) {
+  flock(dirfd, LOCK_UN);
+}
+
+/** Internal function that checks if a timestamp is older than another.
+ */
+static int older(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/** Internal function that orders tombstones by name.
+ */
+static int compare_tombstones(const void *a, const void *b) {
+
+  const struct tombstone *t1 = a, *t2 = b;
+  if (t1->name_len != t2->name_len)
+    return t1->name_len < t2->name_len ? -1 : 1;
+  return memcmp(t1->name, t2->name, t1->name_len);
+}
+
+/** Internal function that collects the tombstones of an index, sorted
+ *  by name, so messages can be checked against them.
+ *
+ *  Returns: The number of tombstones found (stored in *tombstones,
+ *           to be freed by the caller), or 0 if there are none.
+ */
+static size_t find_tombstones(const char *data, size_t len, struct tombstone **tombstones) {
+
+  size_t count = 0, capacity = 0;
+  size_t offset = sizeof(struct index_header);
+  *tombstones = NULL;
+  while (offset + sizeof(struct index_record) <= len) {
+
+    struct index_record record;
+    memcpy(&record, data + offset, sizeof(record));
+    size_t record_len = sizeof(record) + record.name_len + record.data_len;
+    if (offset + record_len > len)
+      break;
+
+    if (record.type == RECORD_REMOVE) {
+      if (count == capacity) {
+	capacity = capacity ? capacity * 2 : 16;
+	*tombstones = realloc(*tombstones, capacity * sizeof(struct tombstone));
+      }
+      (*tombstones)[count].name = data + offset + sizeof(record);
+      (*tombstones)[count].name_len = record.name_len;
+      count++;
+    }
+    offset += record_len;
+  }
+
+  if (count)
+    qsort(*tombstones, count, sizeof(struct tombstone), compare_tombstones);
+  return count;
+}
+
+/** Internal function that reads the messages in the index of a
+ *  mailbox, either those that were not removed, or only those that
+ *  were (see mail_index_read and mail_index_read_removed).
+ */
+static int read_index(int dirfd, void (*callback)(void *arg, unsigned int pos,
+						  const struct mail_index_entry *entry),
+		      void *arg, int removed) {
+
+  struct stat dir_stat, index_stat;
+  struct index_header *header;
+  struct tombstone *tombstones;
+  int fd = openat(dirfd, MAIL_INDEX_FILE_NAME, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(dirfd, &dir_stat) < 0 || fstat(fd, &index_stat) < 0 ||
+      older(&index_stat.st_mtim, &dir_stat.st_mtim) ||
+      index_stat.st_size < sizeof(struct index_header)) {
+    close(fd);
+    return -1;
+  }
+
+  char *data = malloc(index_stat.st_size);
+  ssize_t len = read(fd, data, index_stat.st_size);
+  close(fd);
+
+  header = (struct index_header *) data;
+  if (len < (ssize_t) sizeof(struct index_header) ||
+      header->magic != MAIL_INDEX_MAGIC || header->version != MAIL_INDEX_VERSION) {
+    free(data);
+    return -1;
+  }
+
+  size_t tombstone_count = find_tombstones(data, len, &tombstones);
+  if (removed && !tombstone_count) {
+    free(data);
+    return 0;
+  }
+
+  unsigned int count = 0;
+  size_t offset = sizeof(struct index_header);
+  while (offset + sizeof(struct index_record) <= len) {
+
+    struct index_record record;
+    memcpy(&record, data + offset, sizeof(record));
+    size_t record_len = sizeof(record) + record.name_len + record.data_len;
+
+    // a record may be incomplete if a delivery is being appended
+    if (offset + record_len > len)
+      break;
+
+    if (record.type == RECORD_ADD || record.type == RECORD_ADD_HEADER) {
+      struct mail_index_entry entry;
+      const char *p = data + offset + sizeof(record);
+      size_t data_len = record.data_len;
+      entry.name = p;
+      entry.name_len = record.name_len;
+      entry.size = record.size;
+      entry.header_size = MAIL_INDEX_NO_HEADER;
+      entry.flags = 0;
+      entry.key = NULL;
+      entry.key_len = 0;
+      p += record.name_len;
+      if (data_len >= sizeof(entry.flags)) {
+	memcpy(&entry.flags, p, sizeof(entry.flags));
+	p += sizeof(entry.flags);
+	data_len -= sizeof(entry.flags);
+	if (record.type == RECORD_ADD_HEADER && data_len >= sizeof(entry.header_size)) {
+	  memcpy(&entry.header_size, p, sizeof(entry.header_size));
+	  p += sizeof(entry.header_size);
+	  data_len -= sizeof(entry.header_size);
+	}
+	entry.key = p;
+	entry.key_len = data_len;
+      }
+
+      struct tombstone name = { entry.name, entry.name_len };
+      int is_removed = tombstone_count &&
+	bsearch(&name, tombstones, tombstone_count, sizeof(struct tombstone),
+		compare_tombstones) != NULL;
+      if (is_removed == removed)
+	callback(arg, count++, &entry);
+    }
+
+    offset += record_len;
+  }
+
+  // the callback deletes the files of removed messages, which the
+  // index already accounts for, so it is touched to not be
+  // considered stale
+  if (removed && count)
+    utimensat(dirfd, MAIL_INDEX_FILE_NAME, NULL, 0);
+  free(tombstones);
+  free(data);
+  return count;
+}
+
+/** Reads all messages in the index of a mailbox, except those that
+ *  were removed. The callback is called once for every message, in
+ *  the order they were added.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ *              callback: Function called for each message, receiving
+ *                        arg, the position of the message among those
+ *                        read, and the message's entry (valid only
+ *                        during the call).
+ *              arg: Argument passed to the callback.
+ *
+ *  Returns: The number of messages read, or -1 if the index is
+ *           missing, stale or invalid, in which case the mailbox
+ *           directory must be scanned instead.
+ */
+int mail_index_read(int dirfd, void (*callback)(void *arg, unsigned int pos,
+						const struct mail_index_entry *entry),
+		    void *arg) {
+  return read_index(dirfd, callback, arg, 0);
+}
+
+/** Reads the messages in the index of a mailbox that were removed
+ *  (see mail_index_remove) but are still in the index, i.e., whose
+ *  files may still have to be deleted. The callback is called as in
+ *  mail_index_read, and may delete their files: the index is still
+ *  valid afterwards. The caller must hold the mailbox lock.
+ *
+ *  Returns: The number of removed messages read, or -1 if the index
+ *           is missing, stale or invalid.
+ */
+int mail_index_read_removed(int dirfd, void (*callback)(void *arg, unsigned int pos,
+							const struct mail_index_entry *entry),
+			    void *arg) {
+  return read_index(dirfd, callback, arg, 1);
+}
+
+/** Internal function that builds a record for an entry into a buffer.
+ *
+ *  Returns: The size of the record, or 0 if the entry's name is too
+ *           big to be stored.
+ */
+static size_t build_record(char *buf, size_t size, const struct mail_index_entry *entry) {
+
+  struct index_record record;
+  int has_header = entry->header_size != MAIL_INDEX_NO_HEADER;
+  size_t data_len = sizeof(entry->flags) + (has_header ? sizeof(entry->header_size) : 0) +
+    entry->key_len;
+  size_t len = sizeof(record) + entry->name_len + data_len;
+  if (entry->name_len > UINT16_MAX || entry->key_len > MAIL_INDEX_MAX_KEY || len > size)
+    return 0;
+
+  record.type = has_header ? RECORD_ADD_HEADER : RECORD_ADD;
+  record.name_len = entry->name_len;
+  record.data_len = data_len;
+  record.size = entry->size;
+  char *p = buf;
+  memcpy(p, &record, sizeof(record));
+  p += sizeof(record);
+  memcpy(p, entry->name, entry->name_len);
+  p += entry->name_len;
+  memcpy(p, &entry->flags, sizeof(entry->flags));
+  p += sizeof(entry->flags);
+  if (has_header) {
+    memcpy(p, &entry->header_size, sizeof(entry->header_size));
+    p += sizeof(entry->header_size);
+  }
+  if (entry->key_len)
+    memcpy(p, entry->key, entry->key_len);
+  return len;
+}
+
+/** Adds a message to the existing index of a mailbox. If the mailbox
+ *  has no index, nothing is done, as the index will be created from
+ *  a directory scan (which will include the message) once it is
+ *  needed. The caller must hold the mailbox lock, and must add the
+ *  message file to the directory before calling this function.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ *              entry: Message to be added.
+ *
+ *  Returns: 0 if the message was added, -1 otherwise.
+ */
+int mail_index_append(int dirfd, const struct mail_index_entry *entry) {
+
+  char buf[MAX_RECORD_SIZE];
+  size_t len = build_record(buf, sizeof(buf), entry);
+  if (!len)
+    return -1;
+
+  int fd = openat(dirfd, MAIL_INDEX_FILE_NAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  // the record is written with a single call, so readers never see
+  // a partial record followed by another one
+  int rv = write(fd, buf, len) == len ? 0 : -1;
+  close(fd);
+  return rv;
+}
+
+/** Removes messages from the existing index of a mailbox by
+ *  appending a tombstone for each of them, written with a single
+ *  call. Removed messages are no longer returned by mail_index_read,
+ *  but their files are not deleted; they are dropped from the index
+ *  when it is rewritten, which should only be done once their files
+ *  are gone (see mail_index_read_removed). The caller must hold the
+ *  mailbox lock.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ *              names: Names of the messages to be removed.
+ *              count: Number of names.
+ *
+ *  Returns: 0 if the messages were removed, -1 if the index is
+ *           missing or stale (in which case the files must be deleted
+ *           by the caller), or cannot be written.
+ */
+int mail_index_remove(int dirfd, const char *const *names, unsigned int count) {
+
+  struct stat dir_stat, index_stat;
+  size_t len = 0;
+
+  int fd = openat(dirfd, MAIL_INDEX_FILE_NAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(dirfd, &dir_stat) < 0 || fstat(fd, &index_stat) < 0 ||
+      older(&index_stat.st_mtim, &dir_stat.st_mtim)) {
+    close(fd);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    len += sizeof(struct index_record) + strlen(names[i]);
+  char *buf = malloc(len);
+  char *p = buf;
+  for (unsigned int i = 0; i < count; i++) {
+    struct index_record record = { RECORD_REMOVE, strlen(names[i]), 0, 0 };
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), names[i], record.name_len);
+    p += sizeof(record) + record.name_len;
+  }
+
+  int rv = write(fd, buf, len) == len ? 0 : -1;
+  free(buf);
+  close(fd);
+  return rv;
+}
+
+/** Starts writing a new index for a mailbox, replacing the existing
+ *  one once mail_index_commit is called. The caller must hold the
+ *  mailbox lock until the index is committed.
+ *
+ *  Parameters: dirfd: File descriptor of the open mailbox directory.
+ *
+ *  Returns: A writer object, or NULL if the index cannot be created.
+ */
+mail_index_writer_t mail_index_create(int dirfd) {
+
+  struct index_header header = { MAIL_INDEX_MAGIC, MAIL_INDEX_VERSION };
+  struct stat dir_stat, index_stat;
+  int valid = fstat(dirfd, &dir_stat) == 0 &&
+    fstatat(dirfd, MAIL_INDEX_FILE_NAME, &index_stat, 0) == 0 &&
+    !older(&index_stat.st_mtim, &dir_stat.st_mtim);
+  int fd = openat(dirfd, MAIL_INDEX_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return NULL;
+
+  // creating the new index modifies the directory, so an existing
+  // index that was valid is touched, to be read while the new one is
+  // written (e.g., when it is compacted)
+  if (valid)
+    utimensat(dirfd, MAIL_INDEX_FILE_NAME, NULL, 0);
+
+  mail_index_writer_t writer = malloc(sizeof(struct mail_index_writer));
+  writer->dirfd = dirfd;
+  writer->file = fdopen(fd, "w");
+  writer->failed = 0;
+  fwrite(&header, sizeof(header), 1, writer->file);
+  return writer;
+}
+
+/** Adds a message to an index being written.
+ *
+ *  Parameters: writer: Index writer returned by mail_index_create.
+ *              entry: Message to be added.
+ *
+ *  Returns: 0 if the message was added, -1 otherwise.
+ */
+int mail_index_add(mail_index_writer_t writer, const struct mail_index_entry *entry) {
+
+  char buf[MAX_RECORD_SIZE];
+  size_t len = build_record(buf, sizeof(buf), entry);
+  if (!len || fwrite(buf, len, 1, writer->file) != 1) {
+    writer->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/** Discards an index being written, keeping the existing index, and
+ *  frees the writer.
+ *
+ *  Parameters: writer: Index writer returned by mail_index_create.
+ */
+void mail_index_discard(mail_index_writer_t writer) {
+  fclose(writer->file);
+  unlinkat(writer->dirfd, MAIL_INDEX_TMP_NAME, 0);
+  free(writer);
+}
+
+/** Replaces the index of a mailbox with a newly written index, and
+ *  frees the writer. If any message could not be added, the new index
+ *  is discarded (and the existing index, if any, is removed), so the
+ *  directory is scanned the next time it is needed.
+ *
+ *  Parameters: writer: Index writer returned by mail_index_create.
+ *
+ *  Returns: 0 if the index was replaced, -1 otherwise.
+ */
+int mail_index_commit(mail_index_writer_t writer) {
+
+  int dirfd = writer->dirfd;
+  int rv = writer->failed || ferror(writer->file) ? -1 : 0;
+  if (fclose(writer->file))
+    rv = -1;
+  free(writer);
+
+  if (rv < 0 || renameat(dirfd, MAIL_INDEX_TMP_NAME, dirfd, MAIL_INDEX_FILE_NAME) < 0) {
+    unlinkat(dirfd, MAIL_INDEX_TMP_NAME, 0);
+    unlinkat(dirfd, MAIL_INDEX_FILE_NAME, 0);
+    return -1;
+  }
+
+  // renaming the file modifies the directory, so the index must be
+  // touched to not be considered stale
+  utimensat(dirfd, MAIL_INDEX_FILE_NAME, NULL, 0);
+  return 0;
+}
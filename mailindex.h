@@ -0,0 +1,45 @@
+/* mailindex.h
+ * Per-mailbox index of messages, used to load a mailbox without
+ * scanning its directory.
+ */
+
+#ifndef _MAIL_INDEX_H_
+#define _MAIL_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAIL_INDEX_FILE_NAME ".index"
+#define MAIL_INDEX_MAX_KEY   64 // maximum length of an entry's key
+#define MAIL_INDEX_NO_HEADER UINT64_MAX // header size of an entry, if unknown
+
+struct mail_index_entry {
+  const char *name;     // message name (unique id), not null-terminated
+  size_t      name_len;
+  uint64_t    size;     // message size in bytes
+  uint64_t    header_size; // bytes up to the start of the body, or MAIL_INDEX_NO_HEADER
+  uint32_t    flags;    // flags defined by the index user
+  const char *key;      // key defined by the index user, not null-terminated
+  size_t      key_len;  // 0 if the entry has no key
+};
+
+typedef struct mail_index_writer *mail_index_writer_t;
+
+int mail_index_lock(int dirfd);
+void mail_index_unlock(int dirfd);
+
+int mail_index_read(int dirfd, void (*callback)(void *arg, unsigned int pos,
+						const struct mail_index_entry *entry),
+		    void *arg);
+int mail_index_read_removed(int dirfd, void (*callback)(void *arg, unsigned int pos,
+							const struct mail_index_entry *entry),
+			    void *arg);
+int mail_index_append(int dirfd, const struct mail_index_entry *entry);
+int mail_index_remove(int dirfd, const char *const *names, unsigned int count);
+
+mail_index_writer_t mail_index_create(int dirfd);
+int mail_index_add(mail_index_writer_t writer, const struct mail_index_entry *entry);
+int mail_index_commit(mail_index_writer_t writer);
+void mail_index_discard(mail_index_writer_t writer);
+
+#endif
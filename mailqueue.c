@@ -0,0 +1,699 @@
+/* mailqueue.c
+ * Durable queue of accepted messages.
+ *
+ * A message accepted by the SMTP server is moved from its spool file
+ * into the queue directory, and a record with its recipients is
+ * appended to the current segment of the queue log, so the reply to
+ * the client only waits for these two writes (and the group commit
+ * covering them), not for the delivery to every mailbox. A pool of
+ * worker processes takes the messages in the order they were queued,
+ * a batch at a time, delivers them, and removes their files once the
+ * deliveries are on disk. Each segment of the log holds
+ * QUEUE_SEGMENT_SIZE messages, and is removed once all of them are
+ * delivered.
+ *
+ * The position of every message in the log is kept in an anonymous
+ * shared mapping created before the server starts, protected by a
+ * robust process-shared mutex, as in groupcommit.c. Idle workers
+ * sleep on an eventfd rather than a process-shared condition
+ * variable, which a worker killed while waiting on it would leave
+ * blocking every process signalling it. At most
+ * MAIL_QUEUE_HIGH_WATER messages are queued and not yet delivered;
+ * once that many are, new messages are refused, so clients retry
+ * later instead of the queue growing without bound.
+ *
+ * The workers are started and watched by a supervisor process, so
+ * they are reaped whatever the server mode, and never seen by the
+ * server itself. Every message taken by a worker records which one
+ * took it; when a worker dies, the messages it had not delivered are
+ * put on a retry list, taken before any other, and a new worker is
+ * started in its place. The supervisor is in turn watched, and
+ * reaped, by a thread of the server, through a pidfd (the server
+ * itself only reaps the children in its own process group, so the
+ * process id of the supervisor is never reused before the thread
+ * sees it exit); a new supervisor is started in its place, and puts
+ * the messages taken by the old workers (which stop with their
+ * supervisor) on the retry list. A message that cannot be delivered to some
+ * of its recipients (e.g., if a mailbox cannot be written), or whose
+ * deliveries cannot be synced, is also put on the retry list, and
+ * stays in the queue until it is delivered.
+ *
+ * Messages left in the queue by a previous run (e.g., if the server
+ * stopped or crashed, or if their deliveries could not be synced, see
+ * groupcommit.c) are delivered when the queue is initialized, before
+ * any worker starts; those that still cannot be delivered are kept
+ * for the next run. A message may be delivered twice if the server
+ * stopped between its delivery and its removal, or if it was only
+ * delivered to some recipients, but an accepted message is never
+ * lost.
+ *
+ * If the queue is not initialized, messages are never queued, and
+ * are expected to be delivered directly.
+ */
+
+#include "mailqueue.h"
+#include "metrics.h"
+#include "groupcommit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define QUEUE_DIRECTORY    "mail.queue"
+#define QUEUE_SEGMENT_SIZE 256 // messages logged in each segment of the log
+#define QUEUE_BATCH_SIZE   32  // messages taken by a worker at a time
+
+// Record appended to the log for every message, followed by the names
+// of its recipients, each null-terminated
+struct queue_record {
+  uint64_t seq;      // sequence number of the message
+  uint32_t rcpt_len; // bytes of recipient names
+  uint32_t reserved;
+};
+
+// Position of a queued message in the log
+struct queue_slot {
+  uint64_t queued; // time the message was queued, in microseconds
+  uint32_t offset; // offset of its record in the segment
+  uint32_t len;    // size of its record
+  pid_t    owner;  // worker that took the message, 0 if not taken
+  int      done;   // 1 once the message is delivered
+};
+
+struct queue_state {
+  pthread_mutex_t   lock;
+  uint64_t          tail;        // sequence number of the next message queued
+  uint64_t          head;        // next message to be taken by a worker
+  uint64_t          completed;   // all messages before this one are delivered
+  uint32_t          segment_len; // bytes written to the current segment
+  unsigned int      retry_count; // messages to be taken again
+  uint64_t          retry[MAIL_QUEUE_HIGH_WATER]; // their sequence numbers
+  struct queue_slot slots[MAIL_QUEUE_HIGH_WATER]; // by sequence number
+};
+
+static struct queue_state *queue = NULL;
+static int wake_fd = -1; // eventfd that idle workers wait on
+static int (*deliver_message)(const char *file, user_list_t users);
+
+// Segment of the log open in this process
+static int segment_fd = -1;
+static uint64_t segment_number;
+
+/** Locks the shared state, recovering it if its previous owner died.
+ */
+static void lock_queue(void) {
+  if (pthread_mutex_lock(&queue->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&queue->lock);
+}
+
+/** Internal function that wakes an idle worker, e.g., when a message
+ *  is queued.
+ */
+static void wake_worker(void) {
+  uint64_t n = 1;
+  if (write(wake_fd, &n, sizeof(n)) < 0)
+    perror("mail queue");
+}
+
+/** Internal function that builds the name of the file containing a
+ *  queued message.
+ */
+static void message_file(uint64_t seq, char *name, size_t size) {
+  snprintf(name, size, QUEUE_DIRECTORY "/%llu.msg", (unsigned long long) seq);
+}
+
+/** Internal function that builds the name of a segment of the log.
+ */
+static void segment_file(uint64_t number, char *name, size_t size) {
+  snprintf(name, size, QUEUE_DIRECTORY "/%llu.log", (unsigned long long) number);
+}
+
+/** Internal function that returns a file descriptor for a segment of
+ *  the log, creating it if needed. The last segment used is kept
+ *  open, so a file is only opened once per segment in each process.
+ *  Must not be called by several threads of a process at a time.
+ */
+static int open_segment(uint64_t number) {
+
+  char name[PATH_MAX];
+  if (segment_fd >= 0 && segment_number == number)
+    return segment_fd;
+  if (segment_fd >= 0)
+    close(segment_fd);
+  segment_file(number, name, sizeof(name));
+  segment_fd = open(name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  segment_number = number;
+  return segment_fd;
+}
+
+/** Internal function that delivers a message given its record, and
+ *  records how long it was queued.
+ *
+ *  Returns: 0 if the message was delivered to every recipient, -1
+ *           otherwise.
+ */
+static int deliver_record(const char *record, size_t len, uint64_t queued) {
+
+  struct queue_record header;
+  char name[PATH_MAX];
+  if (len < sizeof(header))
+    return -1;
+  memcpy(&header, record, sizeof(header));
+  if (header.rcpt_len > len - sizeof(header))
+    return -1;
+
+  user_list_t users = create_user_list();
+  const char *p = record + sizeof(header), *end = p + header.rcpt_len;
+  while (p < end) {
+    size_t n = strnlen(p, end - p);
+    if (n == end - p)
+      break;
+    add_user_to_list(&users, p);
+    p += n + 1;
+  }
+
+  message_file(header.seq, name, sizeof(name));
+  int rv = deliver_message(name, users);
+  destroy_user_list(users);
+  if (queued && rv == 0)
+    metrics_queue_delay(queued);
+  return rv;
+}
+
+/** Internal function that publishes the depth of the queue, and the
+ *  time the oldest message not yet delivered was queued. Must be
+ *  called with the lock held.
+ */
+static void update_metrics(void) {
+  uint64_t depth = queue->tail - queue->completed;
+  metrics_queue(depth, depth ? queue->slots[queue->completed % MAIL_QUEUE_HIGH_WATER].queued : 0);
+}
+
+/** Internal function that puts messages taken by a worker back on
+ *  the retry list, e.g., if they could not be delivered. Must be
+ *  called with the lock held.
+ */
+static void retry_message(uint64_t seq) {
+  queue->slots[seq % MAIL_QUEUE_HIGH_WATER].owner = 0;
+  queue->retry[queue->retry_count++] = seq;
+}
+
+/** Internal function run by every worker process: takes a batch of
+ *  queued messages, delivers them, waits for the deliveries to be on
+ *  disk, and removes the messages from the queue. Messages that could
+ *  not be delivered, or whose deliveries could not be synced, are
+ *  kept in the queue and put on the retry list. Never returns.
+ */
+static void run_worker(void) {
+
+  struct queue_slot batch[QUEUE_BATCH_SIZE];
+  uint64_t seqs[QUEUE_BATCH_SIZE];
+  int delivered[QUEUE_BATCH_SIZE];
+  char name[PATH_MAX];
+  char *record = NULL;
+  size_t capacity = 0;
+  pid_t self = getpid();
+
+  while (1) {
+    lock_queue();
+    while (queue->head == queue->tail && !queue->retry_count) {
+      uint64_t n;
+      pthread_mutex_unlock(&queue->lock);
+      if (read(wake_fd, &n, sizeof(n)) < 0 && errno != EINTR)
+	sleep(1);
+      lock_queue();
+    }
+    // messages left by a dead worker are older than any other
+    unsigned int count = 0;
+    while (count < QUEUE_BATCH_SIZE && queue->retry_count)
+      seqs[count++] = queue->retry[--queue->retry_count];
+    while (count < QUEUE_BATCH_SIZE && queue->head < queue->tail)
+      seqs[count++] = queue->head++;
+    for (unsigned int i = 0; i < count; i++) {
+      struct queue_slot *slot = &queue->slots[seqs[i] % MAIL_QUEUE_HIGH_WATER];
+      slot->owner = self;
+      batch[i] = *slot;
+    }
+    // a single wake-up may stand for several messages, so the next
+    // worker is woken if some are left
+    int left = queue->head < queue->tail || queue->retry_count;
+    pthread_mutex_unlock(&queue->lock);
+    if (left)
+      wake_worker();
+
+    for (unsigned int i = 0; i < count; i++) {
+      if (batch[i].len > capacity) {
+	capacity = batch[i].len;
+	record = realloc(record, capacity);
+      }
+      int fd = open_segment(seqs[i] / QUEUE_SEGMENT_SIZE);
+      delivered[i] = fd >= 0 &&
+	pread(fd, record, batch[i].len, batch[i].offset) == batch[i].len &&
+	deliver_record(record, batch[i].len, batch[i].queued) == 0;
+    }
+
+    // the messages are only removed once their copies in the
+    // mailboxes are safe; if the sync failed, none of them is
+    int synced = group_commit_wait(group_commit_request()) == 0;
+    unsigned int failed = 0;
+    for (unsigned int i = 0; i < count; i++) {
+      if (!synced || !delivered[i]) {
+	delivered[i] = 0;
+	failed++;
+	continue;
+      }
+      message_file(seqs[i], name, sizeof(name));
+      unlink(name);
+    }
+
+    lock_queue();
+    for (unsigned int i = 0; i < count; i++) {
+      if (delivered[i])
+	queue->slots[seqs[i] % MAIL_QUEUE_HIGH_WATER].done = 1;
+      else
+	retry_message(seqs[i]);
+    }
+    uint64_t before = queue->completed;
+    while (queue->completed < queue->tail &&
+	   queue->slots[queue->completed % MAIL_QUEUE_HIGH_WATER].done)
+      queue->completed++;
+    for (uint64_t n = before / QUEUE_SEGMENT_SIZE; n < queue->completed / QUEUE_SEGMENT_SIZE; n++) {
+      segment_file(n, name, sizeof(name));
+      unlink(name);
+    }
+    update_metrics();
+    pthread_mutex_unlock(&queue->lock);
+
+    // messages that failed are retried once a second at most
+    if (failed) {
+      fprintf(stderr, "mail queue: %u messages not delivered, retrying\n", failed);
+      sleep(1);
+    }
+  }
+}
+
+/** Internal function that starts a worker process.
+ *
+ *  Returns: The process id of the worker, or -1 if it was not started.
+ */
+static pid_t start_worker(void) {
+
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // workers stop with their supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+      _exit(0);
+    run_worker();
+  }
+  return pid;
+}
+
+/** Internal function that puts the messages taken by a dead worker
+ *  (or by any worker, if worker is 0), and not yet delivered, on the
+ *  retry list. They may have been partially delivered, in which case
+ *  some recipients get them twice.
+ */
+static void retry_messages(pid_t worker) {
+
+  lock_queue();
+  for (uint64_t seq = queue->completed; seq < queue->head; seq++) {
+    struct queue_slot *slot = &queue->slots[seq % MAIL_QUEUE_HIGH_WATER];
+    if (slot->owner && (!worker || slot->owner == worker) && !slot->done)
+      retry_message(seq);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  wake_worker();
+}
+
+/** Internal function run by the supervisor process: starts the
+ *  workers, and replaces every one that dies once its messages are
+ *  put back in the queue. Never returns.
+ */
+static void supervise_workers(unsigned int workers) {
+
+  // messages taken by the workers of a previous supervisor are left
+  // undelivered, since those workers stopped with it
+  retry_messages(0);
+  for (unsigned int i = 0; i < workers; i++) {
+    if (start_worker() < 0)
+      perror("mail queue");
+  }
+
+  while (1) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0 && errno == EINTR)
+      continue;
+    if (pid < 0) {
+      // no worker is left, e.g., none could be started
+      sleep(1);
+    } else {
+      fprintf(stderr, "mail queue: worker %d died, restarting it\n", (int) pid);
+      retry_messages(pid);
+      // a message that makes workers crash is retried once a second
+      // at most
+      sleep(1);
+    }
+    if (start_worker() < 0)
+      perror("mail queue");
+  }
+}
+
+/** Internal function that starts the supervisor process, in its own
+ *  process group, so the server does not count it among its sessions
+ *  (see sigchld_handler in server.c), nor wait for it or reap it.
+ *
+ *  Returns: The process id of the supervisor, or -1 if it was not
+ *           started.
+ */
+static pid_t start_supervisor(unsigned int workers) {
+
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the supervisor (and so the workers) stop with the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+      _exit(0);
+    setpgid(0, 0);
+    supervise_workers(workers);
+  }
+  if (pid > 0)
+    setpgid(pid, pid);
+  return pid;
+}
+
+struct supervisor_watch {
+  pid_t        pid;     // running supervisor
+  unsigned int workers; // number of workers it starts
+};
+
+/** Internal function run by a thread of the server: waits for the
+ *  supervisor to exit, reaps it, and starts a new one in its place.
+ *  Only this thread reaps the supervisor, so it stays a zombie until
+ *  it is watched, and its pidfd always refers to it. Never returns.
+ */
+static void *watch_supervisor(void *arg) {
+
+  struct supervisor_watch *watch = arg;
+  while (1) {
+    struct pollfd fds = { .events = POLLIN };
+    fds.fd = syscall(SYS_pidfd_open, watch->pid, 0);
+    if (fds.fd < 0 && errno != ESRCH) {
+      // the supervisor cannot be watched, e.g., on kernels older
+      // than 5.3, which have no pidfd_open
+      perror("mail queue: pidfd_open");
+      return NULL;
+    }
+    // if the supervisor is already gone, it is restarted right away
+    if (fds.fd >= 0) {
+      while (poll(&fds, 1, -1) < 0 && errno == EINTR);
+      close(fds.fd);
+    }
+    while (waitpid(watch->pid, NULL, 0) < 0 && errno == EINTR);
+
+    fprintf(stderr, "mail queue: supervisor %d died, restarting it\n", (int) watch->pid);
+    do {
+      // a supervisor that keeps dying is restarted once a second at
+      // most
+      sleep(1);
+      watch->pid = start_supervisor(watch->workers);
+    } while (watch->pid < 0);
+  }
+}
+
+/** Internal function that orders segment numbers.
+ */
+static int compare_segments(const void *a, const void *b) {
+  uint64_t n1 = *(const uint64_t *) a, n2 = *(const uint64_t *) b;
+  return n1 < n2 ? -1 : n1 > n2;
+}
+
+/** Internal function that delivers all messages left in the queue by
+ *  a previous run, in the order they were queued, and removes them.
+ *  Message files without a record in the log were never accepted, so
+ *  they are removed without being delivered.
+ *
+ *  Returns: The sequence number the new run starts from: the first
+ *           of a segment after every segment and message found, so
+ *           the files kept for the next run are never reused.
+ */
+static uint64_t recover_queue(void) {
+
+  struct dirent *dir_entry;
+  char name[PATH_MAX];
+  uint64_t *segments = NULL;
+  size_t count = 0, capacity = 0;
+  uint64_t next = 0;
+  int failed = 0;
+
+  DIR *dir = opendir(QUEUE_DIRECTORY);
+  if (!dir)
+    return 0;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    char *end;
+    unsigned long long n = strtoull(dir_entry->d_name, &end, 10);
+    if (end == dir_entry->d_name)
+      continue;
+    // segments are numbered by their first message divided by
+    // QUEUE_SEGMENT_SIZE
+    uint64_t after = !strcmp(end, ".log") ? n + 1 :
+      !strcmp(end, ".msg") ? n / QUEUE_SEGMENT_SIZE + 1 : 0;
+    if (after * QUEUE_SEGMENT_SIZE > next)
+      next = after * QUEUE_SEGMENT_SIZE;
+    if (strcmp(end, ".log"))
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      segments = realloc(segments, capacity * sizeof(uint64_t));
+    }
+    segments[count++] = n;
+  }
+  qsort(segments, count, sizeof(uint64_t), compare_segments);
+
+  for (size_t i = 0; i < count; i++) {
+    struct stat file_stat;
+    segment_file(segments[i], name, sizeof(name));
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    char *data = fstat(fd, &file_stat) == 0 ? malloc(file_stat.st_size + 1) : NULL;
+    ssize_t len = data ? read(fd, data, file_stat.st_size) : -1;
+    close(fd);
+
+    // only messages not yet removed are delivered; those that could
+    // not be are flagged in the reserved field of their record (in
+    // memory only), so their files are kept
+    size_t offset = 0;
+    int undelivered = 0;
+    while (len > 0 && offset + sizeof(struct queue_record) <= len) {
+      struct queue_record header;
+      memcpy(&header, data + offset, sizeof(header));
+      size_t record_len = sizeof(header) + header.rcpt_len;
+      if (offset + record_len > len)
+	break;
+      message_file(header.seq, name, sizeof(name));
+      header.reserved = access(name, F_OK) == 0 &&
+	deliver_record(data + offset, record_len, 0) < 0;
+      memcpy(data + offset, &header, sizeof(header));
+      undelivered += header.reserved;
+      offset += record_len;
+    }
+    // if the deliveries may not be on disk, the segment and all its
+    // messages are kept for the next run
+    if (group_commit_wait(group_commit_request()) < 0) {
+      failed = 1;
+      free(data);
+      continue;
+    }
+
+    size_t end = offset;
+    for (offset = 0; offset < end; ) {
+      struct queue_record header;
+      memcpy(&header, data + offset, sizeof(header));
+      message_file(header.seq, name, sizeof(name));
+      if (!header.reserved)
+	unlink(name);
+      offset += sizeof(header) + header.rcpt_len;
+    }
+    if (undelivered) {
+      fprintf(stderr, "mail queue: %d messages not delivered, kept for the next run\n",
+	      undelivered);
+      failed = 1;
+    } else {
+      segment_file(segments[i], name, sizeof(name));
+      unlink(name);
+    }
+    free(data);
+  }
+  free(segments);
+
+  rewinddir(dir);
+  while (!failed && (dir_entry = readdir(dir)) != NULL) {
+    size_t len = strlen(dir_entry->d_name);
+    if (len > 4 && !strcmp(dir_entry->d_name + len - 4, ".msg")) {
+      snprintf(name, sizeof(name), QUEUE_DIRECTORY "/%s", dir_entry->d_name);
+      unlink(name);
+    }
+  }
+  closedir(dir);
+  return next;
+}
+
+/** Initializes the queue, delivering any messages left by a previous
+ *  run, and starts the delivery workers. Must be called before the
+ *  server creates any process or thread, and after group commit is
+ *  initialized.
+ *
+ *  Parameters: workers: Number of worker processes, or 0 if messages
+ *                       are not queued (messages left by a previous
+ *                       run are still delivered).
+ *              deliver: Function that delivers a message, given the
+ *                       name of its file and its recipients, and
+ *                       returns 0 if it was delivered to all of them.
+ *
+ *  Returns: 0 if the queue is ready, or if no workers were requested,
+ *           -1 otherwise.
+ */
+int mail_queue_init(unsigned int workers, int (*deliver)(const char *file, user_list_t users)) {
+
+  pthread_mutexattr_t mutex_attr;
+
+  deliver_message = deliver;
+  mkdir(QUEUE_DIRECTORY, 0777);
+  uint64_t start = recover_queue();
+  if (!workers)
+    return 0;
+
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd < 0)
+    return -1;
+  queue = mmap(NULL, sizeof(struct queue_state), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (queue == MAP_FAILED) {
+    queue = NULL;
+    close(wake_fd);
+    return -1;
+  }
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&queue->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  queue->tail = queue->head = queue->completed = start;
+
+  static struct supervisor_watch watch;
+  pthread_t thread;
+  watch.workers = workers;
+  watch.pid = start_supervisor(workers);
+  if (watch.pid < 0) {
+    munmap(queue, sizeof(struct queue_state));
+    queue = NULL;
+    close(wake_fd);
+    return -1;
+  }
+  if (pthread_create(&thread, NULL, watch_supervisor, &watch) == 0)
+    pthread_detach(thread);
+  else
+    fprintf(stderr, "mail queue: cannot watch the supervisor\n");
+  return 0;
+}
+
+/** Adds a message to the queue, to be delivered by a worker. The file
+ *  is moved into the queue; the caller must wait for a group commit
+ *  (see groupcommit.c) before the message is safely queued.
+ *
+ *  Parameters: file: Name of the file containing the message, in the
+ *                    same file system as the queue.
+ *              users: Recipients of the message.
+ *
+ *  Returns: 0 if the message was queued, -1 otherwise, with errno set
+ *           to EAGAIN if the queue is full, in which case the message
+ *           should be refused until the queue is drained. In any other
+ *           case, the file is left in place, to be delivered directly.
+ */
+int mail_queue_add(const char *file, user_list_t users) {
+
+  char name[PATH_MAX];
+  if (!queue) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // the record is built before the lock is taken
+  size_t rcpt_len = 0;
+  for (user_list_t u = users; u; u = get_user_list_next(u))
+    rcpt_len += strlen(get_user_list_name(u)) + 1;
+  size_t len = sizeof(struct queue_record) + rcpt_len;
+  char *record = malloc(len);
+  char *p = record + sizeof(struct queue_record);
+  for (user_list_t u = users; u; u = get_user_list_next(u)) {
+    size_t n = strlen(get_user_list_name(u)) + 1;
+    memcpy(p, get_user_list_name(u), n);
+    p += n;
+  }
+
+  lock_queue();
+  if (queue->tail - queue->completed >= MAIL_QUEUE_HIGH_WATER) {
+    pthread_mutex_unlock(&queue->lock);
+    free(record);
+    metrics_queue_refused();
+    errno = EAGAIN;
+    return -1;
+  }
+
+  uint64_t seq = queue->tail;
+  struct queue_record header = { seq, rcpt_len, 0 };
+  memcpy(record, &header, sizeof(header));
+  if (seq % QUEUE_SEGMENT_SIZE == 0)
+    queue->segment_len = 0;
+
+  message_file(seq, name, sizeof(name));
+  int fd = open_segment(seq / QUEUE_SEGMENT_SIZE);
+  if (fd < 0 || rename(file, name) < 0) {
+    pthread_mutex_unlock(&queue->lock);
+    free(record);
+    errno = EIO;
+    return -1;
+  }
+  if (write(fd, record, len) != len) {
+    // a partial record is removed, so the log stays readable
+    if (ftruncate(fd, queue->segment_len) < 0)
+      perror("mail queue");
+    rename(name, file);
+    pthread_mutex_unlock(&queue->lock);
+    free(record);
+    errno = EIO;
+    return -1;
+  }
+
+  struct queue_slot *slot = &queue->slots[seq % MAIL_QUEUE_HIGH_WATER];
+  slot->queued = metrics_now();
+  slot->offset = queue->segment_len;
+  slot->len = len;
+  slot->done = 0;
+  queue->segment_len += len;
+  queue->tail++;
+  update_metrics();
+  pthread_mutex_unlock(&queue->lock);
+  wake_worker();
+  free(record);
+  return 0;
+}
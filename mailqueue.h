@@ -0,0 +1,17 @@
+/* mailqueue.h
+ * Durable queue of accepted messages, delivered to the mailboxes by a
+ * pool of worker processes.
+ */
+
+#ifndef _MAIL_QUEUE_H_
+#define _MAIL_QUEUE_H_
+
+#include "mailuser.h"
+
+#define MAIL_QUEUE_DEFAULT_WORKERS 2    // delivery worker processes
+#define MAIL_QUEUE_HIGH_WATER      1024 // messages queued before new ones are refused
+
+int mail_queue_init(unsigned int workers, int (*deliver)(const char *file, user_list_t users));
+int mail_queue_add(const char *file, user_list_t users);
+
+#endif
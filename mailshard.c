@@ -0,0 +1,67 @@
+/* mailshard.c
+ * Lists the mailboxes that are not in the shard of the mail storage
+ * their users are placed on (e.g., after a shard was added to
+ * MAIL_STORE_CONFIG, see mailstore.c), and optionally moves them
+ * there. Consistent hashing ensures only the users placed on a new
+ * shard are listed. Directories of shards removed from the list can
+ * be given as arguments, so their mailboxes are moved as well.
+ */
+
+#include "mailstore.h"
+#include "mailuser.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+int main(int argc, char *argv[]) {
+
+  int move = 0, opt;
+  while ((opt = getopt(argc, argv, "m")) != -1) {
+    if (opt != 'm') {
+      fprintf(stderr, "Invalid arguments. Expected: %s [-m] [removed shard ...]\n", argv[0]);
+      return 1;
+    }
+    move = 1;
+  }
+
+  mail_store_t store = mail_store_open(MAIL_STORE_CONFIG);
+  if (!store)
+    return 1;
+
+  int failed = 0;
+  unsigned int count = mail_store_count(store);
+  for (unsigned int shard = 0; shard < count + argc - optind; shard++) {
+    const char *root = shard < count ? mail_store_root(store, shard) : argv[optind + shard - count];
+    DIR *dir = opendir(root);
+    if (!dir)
+      continue;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      // entries starting with a dot are the shard's own directories
+      // (objects and locks)
+      if (entry->d_name[0] == '.')
+	continue;
+      unsigned int home = mail_store_locate(store, entry->d_name);
+      if (home == shard)
+	continue;
+      printf("%s: %s -> %s", entry->d_name, root, mail_store_root(store, home));
+      if (move) {
+	if (relocate_user_mail(entry->d_name, root) < 0) {
+	  printf(" (failed: %s)", strerror(errno));
+	  failed = 1;
+	} else {
+	  printf(" (moved)");
+	}
+      }
+      printf("\n");
+    }
+    closedir(dir);
+  }
+
+  mail_store_close(store);
+  return failed;
+}
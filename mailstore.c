@@ -0,0 +1,189 @@
+/* mailstore.c
+ * Placement of mailboxes on the shards of the mail storage.
+ *
+ * The storage is made of one or more shards, each a directory holding
+ * complete mailboxes, along with their object store and locks (see
+ * mailuser.c). A shard is typically the mount point of its own disk,
+ * or of a file system exported by another host, so every server
+ * listing the same shards can serve any user. The shards are listed
+ * in a configuration file, one per line, as a directory optionally
+ * followed by a weight (1 by default); blank lines and lines starting
+ * with '#' are ignored. Without the file, MAIL_STORE_DEFAULT_ROOT is
+ * the only shard.
+ *
+ * Users are placed by consistent hashing. Each shard owns a number
+ * of points on a 64-bit hash ring, proportional to its weight and
+ * derived from its directory name, and a user belongs to the shard
+ * owning the first point at or after the hash of the case-folded
+ * user name. A new shard only takes over the arcs of the ring ending
+ * at its own points, so the only users that move are those placed on
+ * it, and removing a shard only moves the users it held. Placement
+ * depends on the set of shards, not on the order they are listed in.
+ */
+
+#include "mailstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+struct ring_point {
+  uint64_t     hash;
+  unsigned int shard;
+};
+
+struct mail_store {
+  unsigned int       count;
+  char              *roots[MAIL_STORE_MAX_SHARDS];
+  struct ring_point *points; // sorted by hash, NULL if there is one shard
+  size_t             point_count;
+};
+
+/** Internal function that computes the hash of a string (64-bit
+ *  FNV-1a, optionally ignoring case), remixed so that similar strings
+ *  (e.g., numbered directories) land far apart on the ring.
+ */
+static uint64_t hash_string(const char *s, int fold, uint64_t seed) {
+
+  uint64_t h = 14695981039346656037ull;
+  for (; *s; s++) {
+    h ^= fold ? (unsigned char) tolower((unsigned char) *s) : (unsigned char) *s;
+    h *= 1099511628211ull;
+  }
+  h += seed * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+/** Internal function that orders ring points by hash (and by shard,
+ *  so even colliding points are placed the same way by every server).
+ */
+static int compare_points(const void *a, const void *b) {
+  const struct ring_point *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->shard < y->shard ? -1 : x->shard > y->shard;
+}
+
+/** Internal function that adds a shard, unless its directory is
+ *  already listed. Trailing slashes are removed, so the same
+ *  directory always gets the same points.
+ */
+static void add_shard(struct mail_store *store, const char *root, unsigned int weight,
+		      unsigned int *weights) {
+
+  size_t len = strlen(root);
+  while (len > 1 && root[len - 1] == '/')
+    len--;
+  for (unsigned int i = 0; i < store->count; i++) {
+    if (strlen(store->roots[i]) == len && !strncmp(store->roots[i], root, len))
+      return;
+  }
+  if (store->count == MAIL_STORE_MAX_SHARDS)
+    return;
+  weights[store->count] = weight;
+  store->roots[store->count++] = strndup(root, len);
+}
+
+/** Opens the list of shards of the mail storage, and builds the hash
+ *  ring placing users on them.
+ *
+ *  Parameters: path: Name of the file listing the shards. If it
+ *                    cannot be read or lists no shard, the storage
+ *                    has a single shard, MAIL_STORE_DEFAULT_ROOT.
+ *
+ *  Returns: The list of shards, or NULL if it cannot be allocated.
+ */
+mail_store_t mail_store_open(const char *path) {
+
+  struct mail_store *store = calloc(1, sizeof(struct mail_store));
+  unsigned int weights[MAIL_STORE_MAX_SHARDS];
+  if (!store)
+    return NULL;
+
+  FILE *file = fopen(path, "re");
+  if (file) {
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+      char *save, *root = strtok_r(line, " \t\r\n", &save);
+      if (!root || *root == '#')
+	continue;
+      char *weight = strtok_r(NULL, " \t\r\n", &save);
+      unsigned long w = weight ? strtoul(weight, NULL, 10) : 1;
+      add_shard(store, root, w < 1 ? 1 : w > MAIL_STORE_MAX_WEIGHT ? MAIL_STORE_MAX_WEIGHT : w,
+		weights);
+    }
+    fclose(file);
+  }
+  if (!store->count)
+    add_shard(store, MAIL_STORE_DEFAULT_ROOT, 1, weights);
+  if (store->count == 1)
+    return store;
+
+  for (unsigned int i = 0; i < store->count; i++)
+    store->point_count += weights[i] * MAIL_STORE_POINTS;
+  store->points = malloc(store->point_count * sizeof(struct ring_point));
+
+  size_t n = 0;
+  for (unsigned int i = 0; i < store->count; i++) {
+    for (unsigned int j = 0; j < weights[i] * MAIL_STORE_POINTS; j++) {
+      store->points[n].hash = hash_string(store->roots[i], 0, j + 1);
+      store->points[n++].shard = i;
+    }
+  }
+  qsort(store->points, n, sizeof(struct ring_point), compare_points);
+  return store;
+}
+
+/** Returns the number of shards of the mail storage.
+ */
+unsigned int mail_store_count(mail_store_t store) {
+  return store->count;
+}
+
+/** Returns the directory of a shard, given its number (from 0 to
+ *  mail_store_count - 1).
+ */
+const char *mail_store_root(mail_store_t store, unsigned int shard) {
+  return store->roots[shard];
+}
+
+/** Finds the shard holding the mailbox of a user. The user name is
+ *  compared ignoring case, like in the user directory.
+ *
+ *  Parameters: store: List of shards.
+ *              username: Name of the user.
+ *
+ *  Returns: The number of the shard.
+ */
+unsigned int mail_store_locate(mail_store_t store, const char *username) {
+
+  if (!store->points)
+    return 0;
+
+  uint64_t h = hash_string(username, 1, 0);
+  size_t low = 0, high = store->point_count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (store->points[mid].hash < h)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return store->points[low == store->point_count ? 0 : low].shard;
+}
+
+/** Frees a list of shards.
+ */
+void mail_store_close(mail_store_t store) {
+
+  if (!store)
+    return;
+  for (unsigned int i = 0; i < store->count; i++)
+    free(store->roots[i]);
+  free(store->points);
+  free(store);
+}
@@ -0,0 +1,23 @@
+/* mailstore.h
+ * Placement of mailboxes on the shards of the mail storage, by
+ * consistent hashing of user names.
+ */
+
+#ifndef _MAIL_STORE_H_
+#define _MAIL_STORE_H_
+
+#define MAIL_STORE_CONFIG       "mail.shards" // list of shards, one per line
+#define MAIL_STORE_DEFAULT_ROOT "mail.store"  // only shard if there is no list
+#define MAIL_STORE_MAX_SHARDS   64
+#define MAIL_STORE_MAX_WEIGHT   16
+#define MAIL_STORE_POINTS       128 // points on the ring per unit of weight
+
+typedef struct mail_store *mail_store_t;
+
+mail_store_t mail_store_open(const char *path);
+unsigned int mail_store_count(mail_store_t store);
+const char *mail_store_root(mail_store_t store, unsigned int shard);
+unsigned int mail_store_locate(mail_store_t store, const char *username);
+void mail_store_close(mail_store_t store);
+
+#endif
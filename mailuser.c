@@ -4,52 +4,158 @@
  * Modified: Nov 5, 2021
  */
 
+#define _GNU_SOURCE // for copy_file_range
+
 #include "mailuser.h"
+#include "userdir.h"
+#include "mailindex.h"
+#include "mailstore.h"
+#include "uring.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <limits.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_OBJECT_DIRECTORY ".objects" // in each shard of the mail storage
+#define MAIL_LOCK_DIRECTORY ".locks"     // same
 
 struct user_list {
   char *user;
   struct user_list *next;
 };
 
+#define INITIAL_MAIL_CAPACITY 16 // initial number of items in a mail list
+#define SCAN_CHUNK_SIZE 65536    // bytes read at a time when scanning a message
+#define SCAN_BATCH_SIZE 64       // files looked up together when scanning a mailbox
+#define MAIL_KEY_SIZE 54         // size of an object key, including null byte
+#define RECLAIM_BATCH_SIZE 64    // mailboxes taken together by the reclaimer
+
+// Flags stored in the mailbox index for each message
+#define MAIL_FLAG_CLEAN 0x1 // see scan_message
+
 struct mail_item {
-  char file_name[NAME_MAX];
+  struct mail_list *list; // list the item belongs to
   size_t file_size;
+  uint64_t header_size;   // bytes up to the start of the body, or MAIL_INDEX_NO_HEADER
+  unsigned int name;      // offset of the file name in list->names,
+                          // followed by the object key (see save_user_mail)
   unsigned int deleted:1;
+  unsigned int clean:1;   // file can be sent as is in a multi-line response
+  unsigned int header_found:1; // header size found after the list was loaded
 };
 
+// Items are stored in a contiguous array, in the order they are
+// loaded, so they can be retrieved by position in constant time. The
+// number and size of non-deleted messages are kept up to date as
+// items are deleted or recovered.
 struct mail_list {
-  struct mail_item item;
-  struct mail_list *next;
+  struct mail_item *items;
+  unsigned int count;      // number of items, including deleted ones
+  unsigned int capacity;   // number of items allocated
+  unsigned int live_count; // number of non-deleted items
+  size_t live_size;        // total size of non-deleted items
+  size_t total_size;       // total size of all items
+  unsigned int headers_found; // items whose header size is not yet in the index
+  char *directory;         // directory where the files are stored
+  char *names;             // null-terminated file names and keys of all items
+  size_t names_len;
+  size_t names_capacity;
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
+static user_directory_t directory = NULL;
+
+static void open_user_directory(void) {
+  directory = userdir_open(USER_FILE_NAME);
+}
+
+/** Internal function that returns the directory of users, loading
+ *  the users file the first time it is called. The directory is kept
+ *  in memory and reloaded when the file is modified.
  * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
+ *  Returns: directory of users (empty if the file cannot be opened).
+ */
+static user_directory_t user_directory(void) {
+
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, open_user_directory);
+  return directory;
+}
+
+static mail_store_t store = NULL;
+
+static void open_mail_store(void) {
+  store = mail_store_open(MAIL_STORE_CONFIG);
+}
+
+/** Internal function that returns the shards of the mail storage,
+ *  loading their list the first time it is called (see mailstore.c).
+ *  Unlike the users file, the list is not reloaded, since changing it
+ *  moves mailboxes between shards (see relocate_user_mail).
+ */
+static mail_store_t mail_store(void) {
+
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, open_mail_store);
+  return store;
+}
+
+/** Internal function that returns the directory of the shard holding
+ *  the mailbox of a user.
+ */
+static const char *user_mail_root(const char *username) {
+  mail_store_t shards = mail_store();
+  return mail_store_root(shards, mail_store_locate(shards, username));
+}
+
+/** Loads the users file, and the list of shards of the mail storage,
+ *  into memory. Calling this function before the server starts
+ *  accepting connections is optional, but allows forked processes to
+ *  share the loaded directory instead of loading the file on their
+ *  first lookup.
+ */
+void load_user_directory(void) {
+  user_directory();
+  mail_store();
+}
+
+/** Returns the directories of the shards of the mail storage,
+ *  creating them if they don't exist yet (errors ignored), so the
+ *  filesystems holding them can be synced (see groupcommit.c).
+ *
+ *  Parameters: roots: Array receiving the directories.
+ *              max: Size of the array.
+ *
+ *  Returns: The number of directories returned.
  */
-static FILE *user_file_list(void) {
+unsigned int get_mail_store_roots(const char **roots, unsigned int max) {
 
-  static FILE *file_ptr = NULL;
-  if (!file_ptr)
-    file_ptr = fopen(USER_FILE_NAME, "r+");
-  if (file_ptr)
-    rewind(file_ptr);
-  return file_ptr;
+  mail_store_t shards = mail_store();
+  unsigned int count = mail_store_count(shards);
+  if (count > max)
+    count = max;
+  for (unsigned int i = 0; i < count; i++) {
+    roots[i] = mail_store_root(shards, i);
+    mkdir(roots[i], 0777);
+  }
+  return count;
 }
 
 /** Checks if the user name is valid. If password is informed, also
@@ -71,19 +177,24 @@ static FILE *user_file_list(void) {
  *           password, and zero (false) otherwise.
  */
 int is_valid_user(const char *username, const char *password) {
-  
-  FILE *file_ptr = user_file_list();
-  if (!file_ptr) return 0;
-  
-  char user_file[MAX_USERNAME_SIZE+1];
-  char pw_file[MAX_PASSWORD_SIZE+1];
-  
-  while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-    if (!strcasecmp(username, user_file))
-      return password == NULL || !strcmp(password, pw_file);
-  }
+  uint64_t start = TRACE_START();
+  int rv = userdir_check(user_directory(), username, password);
+  TRACE_SPAN(TRACE_USER_LOOKUP, start);
+  return rv;
+}
 
-  return 0;
+/** Checks if each of several user names is valid, ignoring case, in
+ *  a single lookup (e.g., all recipients of pipelined RCPT commands).
+ *
+ *  Parameters: usernames: Names of the users to check.
+ *              count: Number of names.
+ *              results: Set, for each name, to non-zero (true) if the
+ *                       username exists, or zero (false) otherwise.
+ */
+void check_valid_users(const char *const *usernames, size_t count, int *results) {
+  uint64_t start = TRACE_START();
+  userdir_check_users(user_directory(), usernames, count, results);
+  TRACE_SPAN(TRACE_USER_LOOKUP, start);
 }
 
 /** Creates a new, empty, list of users.
@@ -109,6 +220,39 @@ void add_user_to_list(user_list_t *list, const char *username) {
   *list = new_list;
 }
 
+/** Adds a user name to a list of users, allocating the list node and
+ *  the copy of the name from an arena. A list built with this
+ *  function is freed with the arena (e.g., when a mail transaction
+ *  ends), and must not be passed to destroy_user_list.
+ *  
+ *  Parameters: list: address of the list of users to be modified.
+ *              username: Name of the user to be added (copied).
+ *              arena: Arena where the list is allocated.
+ */
+void add_user_to_arena_list(user_list_t *list, const char *username, arena_t arena) {
+  user_list_t new_list = arena_alloc(arena, sizeof(struct user_list));
+  new_list->user = arena_strdup(arena, username);
+  new_list->next = *list;
+  *list = new_list;
+}
+
+/** Returns the name of the first user in a list of users.
+ *
+ *  Parameters: list: Non-empty list of users.
+ */
+const char *get_user_list_name(user_list_t list) {
+  return list->user;
+}
+
+/** Returns the rest of a list of users, after its first user, or an
+ *  empty list (NULL) if there are no more users.
+ *
+ *  Parameters: list: Non-empty list of users.
+ */
+user_list_t get_user_list_next(user_list_t list) {
+  return list->next;
+}
+
 /** Frees all memory used by a list of users.
  *
  * Parameters: list: list of users to be freed.
@@ -122,39 +266,600 @@ void destroy_user_list(user_list_t list) {
   }
 }
 
+/** Internal function that generates a name for a new message file,
+ *  in the format time.pid.seq (similar to maildir), where seq is a
+ *  per-process counter. The name is unique among all processes and
+ *  threads delivering messages, so no directory needs to be searched
+ *  for a free name.
+ *
+ *  Parameters: name: Buffer where the name (without suffix) is stored.
+ *              size: Size of the buffer.
+ */
+static void unique_mail_name(char *name, size_t size) {
+
+  static unsigned int seq = 0;
+  unsigned int n = __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED);
+  snprintf(name, size, "%lld.%d.%u", (long long) time(NULL), (int) getpid(), n);
+}
+
+/** Internal function that reads a message, computing the key under
+ *  which it is kept in the object store, and checking if it can be
+ *  sent in a multi-line response (e.g., POP3 RETR) exactly as it is
+ *  stored. This is the case if every line ends in CRLF, no line
+ *  starts with a dot (which would need to be dot-stuffed), and the
+ *  message is either empty or ends in a line terminator.
+ *
+ *  The key is a 128-bit FNV-1a hash of the contents followed by the
+ *  size of the message. Both are computed, along with the size of the
+ *  header (see find_header_size), in a single pass over the message.
+ *
+ *  Parameters: fd: File descriptor of the message, read from its
+ *                  current position to the end.
+ *              key: Buffer of MAIL_KEY_SIZE bytes where the key is
+ *                   stored.
+ *              header_size: Where the size of the header is stored.
+ *
+ *  Returns: non-zero if the message is clean, zero otherwise, or -1
+ *           if the message cannot be read.
+ */
+static int scan_message(int fd, char *key, uint64_t *header_size) {
+
+  const __uint128_t prime = ((__uint128_t) 0x1000000 << 64) | 0x13b;
+  __uint128_t h = ((__uint128_t) 0x6c62272e07bb0142ull << 64) | 0x62b821756295c58dull;
+  unsigned long long size = 0;
+  char buf[SCAN_CHUNK_SIZE];
+  char prev = '\n';
+  int clean = 1;
+  ssize_t len;
+  unsigned long long line_start = 0;
+
+  *header_size = MAIL_INDEX_NO_HEADER;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < len; i++) {
+      if ((prev == '\n' && buf[i] == '.') || (buf[i] == '\n' && prev != '\r'))
+	clean = 0;
+      if (buf[i] == '\n' && *header_size == MAIL_INDEX_NO_HEADER) {
+	unsigned long long line_len = size + i - line_start;
+	if (line_len == 0 || (line_len == 1 && prev == '\r'))
+	  *header_size = size + i + 1;
+	line_start = size + i + 1;
+      }
+      prev = buf[i];
+      h = (h ^ (unsigned char) buf[i]) * prime;
+    }
+    size += len;
+  }
+  if (len < 0)
+    return -1;
+  if (*header_size == MAIL_INDEX_NO_HEADER)
+    *header_size = size;
+
+  snprintf(key, MAIL_KEY_SIZE, "%016llx%016llx-%llu", (unsigned long long) (h >> 64),
+	   (unsigned long long) h, size);
+  return clean && prev == '\n';
+}
+
+/** Internal function that checks if two files have the same contents.
+ */
+static int same_contents(int fd1, int fd2) {
+
+  char buf1[SCAN_CHUNK_SIZE / 2], buf2[SCAN_CHUNK_SIZE / 2];
+  ssize_t len1, len2;
+
+  if (lseek(fd1, 0, SEEK_SET) < 0 || lseek(fd2, 0, SEEK_SET) < 0)
+    return 0;
+  do {
+    len1 = read(fd1, buf1, sizeof(buf1));
+    len2 = read(fd2, buf2, sizeof(buf2));
+    if (len1 != len2 || len1 < 0 || memcmp(buf1, buf2, len1))
+      return 0;
+  } while (len1 > 0);
+  return 1;
+}
+
+/** Internal function that copies a file to a new file in the object
+ *  directory, under a temporary name, and then links it under its
+ *  key. Used when the message is in a different file system than the
+ *  object store (e.g., a shard on another disk).
+ *
+ *  Returns: 0 if the object was created, -1 otherwise (errno set to
+ *           EEXIST if an object with the same key already exists).
+ */
+static int copy_object(int objfd, int fd, const char *key) {
+
+  char tmp[MAIL_KEY_SIZE + 32];
+  static unsigned int seq = 0;
+  snprintf(tmp, sizeof(tmp), "%s.%d.%u.tmp", key, (int) getpid(),
+	   __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+
+  int out = openat(objfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (out < 0)
+    return -1;
+
+  // copy_file_range copies within the kernel, but not between all
+  // file systems, in which case the file is copied by reading it
+  off_t in_off = 0;
+  ssize_t len;
+  while ((len = copy_file_range(fd, &in_off, out, NULL, SCAN_CHUNK_SIZE, 0)) > 0);
+  if (len < 0 && in_off == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS)) {
+    char buf[SCAN_CHUNK_SIZE / 2];
+    len = 0;
+    while (len >= 0 && (len = pread(fd, buf, sizeof(buf), in_off)) > 0) {
+      in_off += len;
+      for (ssize_t done = 0, n; len > 0 && done < len; done += n) {
+	if ((n = write(out, buf + done, len - done)) < 0)
+	  len = -1;
+      }
+    }
+  }
+
+  int rv = len == 0 ? linkat(objfd, tmp, objfd, key, 0) : -1;
+  int saved_errno = errno;
+  close(out);
+  unlinkat(objfd, tmp, 0);
+  errno = saved_errno;
+  return rv;
+}
+
+/** Internal function that adds a message to the object store, under
+ *  its key. If an object with the same key already exists, it is
+ *  reused, as long as its contents are the same as the message's.
+ *  The object is a hard link to the message file if both are in the
+ *  same file system, or a copy otherwise.
+ *
+ *  Parameters: objfd: File descriptor of the object directory.
+ *              basefile: Name of the file containing the message.
+ *              fd: File descriptor of the same file.
+ *              key: Key of the message.
+ *
+ *  Returns: 0 if the object contains the message, -1 if the message
+ *           could not be stored.
+ */
+static int store_object(int objfd, const char *basefile, int fd, const char *key) {
+
+  if (linkat(AT_FDCWD, basefile, objfd, key, 0) == 0)
+    return 0;
+  if (errno == EXDEV && copy_object(objfd, fd, key) == 0)
+    return 0;
+  if (errno != EEXIST)
+    return -1;
+
+  int obj = openat(objfd, key, O_RDONLY | O_CLOEXEC);
+  if (obj < 0)
+    return -1;
+  int rv = same_contents(fd, obj) ? 0 : -1;
+  close(obj);
+  return rv;
+}
+
+/** Internal function that opens the object directory of the shard
+ *  holding a mailbox.
+ *
+ *  Parameters: dirfd: Mailbox directory.
+ *
+ *  Returns: The object directory, or -1 if it cannot be opened.
+ */
+static int open_object_directory(int dirfd) {
+  return openat(dirfd, "../" MAIL_OBJECT_DIRECTORY, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/** Internal function that removes an object from the object store
+ *  once no mailbox links to it. The number of mailboxes (plus the
+ *  store itself) containing an object is the link count of its file,
+ *  so no separate reference count is kept.
+ *
+ *  Parameters: objfd: File descriptor of the object directory.
+ *              key: Key of the object.
+ */
+static void release_object(int objfd, const char *key) {
+
+  struct stat file_stat;
+  if (fstatat(objfd, key, &file_stat, 0) == 0 && file_stat.st_nlink == 1)
+    unlinkat(objfd, key, 0);
+}
+
+/** Internal function that opens the directory of a mailbox, creating
+ *  it if it doesn't exist yet, and takes the mailbox lock. A new
+ *  mailbox starts with an empty index, so the index entries of its
+ *  messages keep their object keys (a directory scan cannot recover
+ *  them).
+ *
+ *  Returns: The mailbox directory, locked, or -1 if it cannot be
+ *           opened.
+ */
+static int open_mailbox(const char *directory) {
+
+  int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int created = 0;
+  if (dirfd < 0 && errno == ENOENT) {
+    created = mkdir(directory, 0777) == 0;
+    dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if (dirfd < 0)
+    return -1;
+  mail_index_lock(dirfd);
+  if (created) {
+    mail_index_writer_t writer = mail_index_create(dirfd);
+    if (writer)
+      mail_index_commit(writer);
+  }
+  return dirfd;
+}
+
 /** Saves a new email message into the mail storage for a list of
  *  users.
  *
- *  This function uses hard links to create the files based on an
- *  existing temporary file. It assumes the temporary file is in the
- *  same file system as the newly created files. Typically, saving the
- *  temporary file in a local directory (where the executable is
- *  running) is enough for this to work.
+ *  The message is kept once in an object store, shared by all
+ *  mailboxes, under a key computed from its contents. Each mailbox
+ *  gets a hard link to the object, and an index entry pointing to
+ *  it, so the cost of a delivery depends on the number of recipients,
+ *  not on the size of the message, and identical messages (e.g.,
+ *  sent to a mailing list in separate transactions) are only stored
+ *  once. The object is removed once the message is deleted from all
+ *  mailboxes.
+ *
+ *  Each mailbox is in the shard of the mail storage its user is
+ *  placed on (see mailstore.c), and each shard has its own object
+ *  store, so the message is stored once in every shard holding one of
+ *  its recipients. The object is a hard link to the temporary file if
+ *  they are in the same file system, or a copy otherwise.
+ *
+ *  Each message is stored under a unique name (see
+ *  unique_mail_name), so concurrent deliveries never compete for the
+ *  same file, and no existing message has to be probed. The index
+ *  entry also records whether the message needs to be transformed
+ *  when retrieved (see scan_message).
  *
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
  *              users: List of recipient users to the message.
+ *
+ *  Returns: 0 if the message was added to every mailbox, -1 if it
+ *           could not be read, or could not be added to some of them
+ *           (the mailboxes it was added to keep it).
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+int save_user_mail(const char *basefile, user_list_t users) {
   
-  char mail_file[NAME_MAX + 1];
+  char mail_file[PATH_MAX];
+  char name[64];
+  char key[MAIL_KEY_SIZE];
+  struct stat file_stat;
+  struct mail_index_entry entry;
+  uint64_t header_size;
+  uint64_t start = TRACE_START();
+  int rv = 0;
+  
+  int fd = open(basefile, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int clean = scan_message(fd, key, &header_size);
+  if (clean < 0 || fstat(fd, &file_stat) < 0) {
+    close(fd);
+    return -1;
+  }
   
-  // Create base directory if it doesn't exist yet (error ignored)
-  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  // Object directory of each shard, opened (and the message stored
+  // in it) when the first recipient placed on the shard is found
+  mail_store_t shards = mail_store();
+  int objfds[MAIL_STORE_MAX_SHARDS];
+  char stored[MAIL_STORE_MAX_SHARDS];
+  for (unsigned int i = 0; i < mail_store_count(shards); i++)
+    objfds[i] = -2;
   
+  entry.name = name;
+  entry.size = file_stat.st_size;
+  entry.header_size = header_size;
+  entry.flags = clean ? MAIL_FLAG_CLEAN : 0;
+  
+  unique_mail_name(name, sizeof(name));
   for (; users; users = users->next) {
     
-    // Create a directory for the user if it doesn't exist yet. If it
-    // exists mkdir will return an error, which is ignored.
-    int i = 0;
-    sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s", users->user);
-    mkdir(mail_file, 0777);
+    unsigned int shard = mail_store_locate(shards, users->user);
+    const char *root = mail_store_root(shards, shard);
+    if (objfds[shard] == -2) {
+      // Create base directories if they don't exist yet (errors
+      // ignored). If the message cannot be added to the object store,
+      // each mailbox links to the temporary file instead.
+      snprintf(mail_file, sizeof(mail_file), "%s/" MAIL_OBJECT_DIRECTORY, root);
+      mkdir(root, 0777);
+      mkdir(mail_file, 0777);
+      objfds[shard] = open(mail_file, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      stored[shard] = objfds[shard] >= 0 && store_object(objfds[shard], basefile, fd, key) == 0;
+    }
+    int objfd = objfds[shard];
+    entry.key = stored[shard] ? key : NULL;
+    entry.key_len = stored[shard] ? strlen(key) : 0;
+    
+    snprintf(mail_file, sizeof(mail_file), "%s/%s", root, users->user);
+    int dirfd = open_mailbox(mail_file);
+    if (dirfd < 0) {
+      rv = -1;
+      continue;
+    }
+    
+    // The same name is used for all recipients. A name can only
+    // exist already if a process with the same pid delivered a
+    // message in the same second, in which case a new name is used.
+    while (1) {
+      snprintf(mail_file, sizeof(mail_file), "%s" MAIL_FILE_SUFFIX, name);
+      int linked = stored[shard] ? linkat(objfd, key, dirfd, mail_file, 0) :
+	linkat(AT_FDCWD, basefile, dirfd, mail_file, 0);
+      if (linked == 0) {
+	entry.name_len = strlen(name);
+	// without its index entry, the message is still found once
+	// the index is rebuilt from the directory
+	mail_index_append(dirfd, &entry);
+	break;
+      }
+      if (errno == ENOENT && stored[shard]) {
+	// the object was released by a concurrent deletion, so it is
+	// stored again
+	if (store_object(objfd, basefile, fd, key) == 0)
+	  continue;
+	stored[shard] = 0;
+	entry.key = NULL;
+	entry.key_len = 0;
+	continue;
+      }
+      if (errno != EEXIST) {
+	rv = -1;
+	break;
+      }
+      unique_mail_name(name, sizeof(name));
+    }
+    
+    mail_index_unlock(dirfd);
+    close(dirfd);
+  }
+  
+  for (unsigned int i = 0; i < mail_store_count(shards); i++) {
+    if (objfds[i] >= 0)
+      close(objfds[i]);
+  }
+  close(fd);
+  TRACE_SPAN(TRACE_SAVE_MAIL, start);
+  return rv;
+}
+
+/** Internal function that creates an empty list of emails for the
+ *  mailbox in the specified directory.
+ */
+static struct mail_list *create_mail_list(const char *directory) {
+
+  struct mail_list *list = calloc(1, sizeof(struct mail_list));
+  list->capacity = INITIAL_MAIL_CAPACITY;
+  list->items = malloc(list->capacity * sizeof(struct mail_item));
+  list->names_capacity = INITIAL_MAIL_CAPACITY * 32;
+  list->names = malloc(list->names_capacity);
+  list->directory = strdup(directory);
+  return list;
+}
+
+/** Internal function that adds a message to a list of emails. The
+ *  name is the unique name of the message, without the file suffix,
+ *  and the key is the key of its object in the object store (empty
+ *  if the message is not in the store, or if the key is unknown).
+ */
+static void append_mail_item(struct mail_list *list, const char *name, size_t name_len,
+			     const char *key, size_t key_len, size_t size,
+			     uint64_t header_size, uint32_t flags) {
+
+  if (list->count == list->capacity) {
+    list->capacity *= 2;
+    list->items = realloc(list->items, list->capacity * sizeof(struct mail_item));
+  }
+  while (list->names_len + name_len + key_len + 2 > list->names_capacity) {
+    list->names_capacity *= 2;
+    list->names = realloc(list->names, list->names_capacity);
+  }
+
+  struct mail_item *item = &list->items[list->count++];
+  item->list = list;
+  item->file_size = size;
+  item->header_size = header_size;
+  item->name = list->names_len;
+  item->deleted = 0;
+  item->clean = (flags & MAIL_FLAG_CLEAN) != 0;
+  item->header_found = 0;
+  memcpy(list->names + list->names_len, name, name_len);
+  list->names[list->names_len + name_len] = 0;
+  list->names_len += name_len + 1;
+  if (key_len)
+    memcpy(list->names + list->names_len, key, key_len);
+  list->names[list->names_len + key_len] = 0;
+  list->names_len += key_len + 1;
+
+  list->live_count++;
+  list->live_size += size;
+  list->total_size += size;
+}
+
+/** Internal callback that adds a message read from a mailbox index
+ *  to a list of emails.
+ */
+static void add_indexed_item(void *arg, unsigned int pos, const struct mail_index_entry *entry) {
+  append_mail_item(arg, entry->name, entry->name_len, entry->key, entry->key_len,
+		   entry->size, entry->header_size, entry->flags);
+}
+
+/** Internal function that returns the key of the object containing a
+ *  message, or an empty string if it is unknown.
+ */
+static const char *mail_item_key(mail_item_t item) {
+  const char *name = item->list->names + item->name;
+  return name + strlen(name) + 1;
+}
+
+/** Internal function that builds the name of the file containing a
+ *  message, relative to the mailbox directory.
+ */
+static void mail_item_file(mail_item_t item, char *file, size_t size) {
+  snprintf(file, size, "%s" MAIL_FILE_SUFFIX, item->list->names + item->name);
+}
+
+/** Internal function that builds the full path of the file
+ *  containing a message.
+ */
+static void mail_item_path(mail_item_t item, char *path, size_t size) {
+  snprintf(path, size, "%s/%s" MAIL_FILE_SUFFIX, item->list->directory,
+	   item->list->names + item->name);
+}
+
+/** Internal function that looks up the size of a batch of message
+ *  files found in a mailbox scan, and adds them to the list. With
+ *  io_uring, all lookups in the batch are submitted together.
+ *
+ *  Parameters: list: List the messages are added to.
+ *              dirfd: Mailbox directory.
+ *              names: File names, including the mail suffix.
+ *              count: Number of file names.
+ */
+static void append_scanned_files(struct mail_list *list, int dirfd,
+				 char (*names)[NAME_MAX + 1], unsigned int count) {
+
+  struct uring_stat lookups[SCAN_BATCH_SIZE];
+  int queued[SCAN_BATCH_SIZE];
+  struct stat file_stat;
+  const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+
+  for (unsigned int i = 0; i < count; i++)
+    queued[i] = uring_statx(dirfd, names[i], &lookups[i]) == 0;
+
+  for (unsigned int i = 0; i < count; i++) {
+    size_t size;
+    if (queued[i] && uring_wait(&lookups[i].op) == 0)
+      size = lookups[i].stx.stx_size;
+    else if (fstatat(dirfd, names[i], &file_stat, 0) == 0)
+      size = file_stat.st_size;
+    else
+      continue;
+
+    // messages found in a scan are not checked for transparency,
+    // and their objects are unknown
+    append_mail_item(list, names[i], strlen(names[i]) - suflen, NULL, 0, size,
+		     MAIL_INDEX_NO_HEADER, 0);
+  }
+}
+
+/** Internal function that loads a list of emails by scanning the
+ *  mailbox directory for email files, and rebuilds the mailbox index
+ *  with the messages found. The caller must hold the mailbox lock.
+ */
+static void scan_mail_directory(struct mail_list *list, int dirfd) {
+
+  struct dirent *dir_entry;
+  const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+  struct mail_index_entry entry;
+  unsigned int batch_count = 0;
+  
+  char (*batch)[NAME_MAX + 1] = malloc(SCAN_BATCH_SIZE * sizeof(*batch));
+  if (!batch) return;
+  DIR *dir = fdopendir(dup(dirfd));
+  if (!dir) {
+    free(batch);
+    return;
+  }
+  
+  while ((dir_entry = readdir(dir)) != NULL) {
     
-    // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-    do {
-      sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
-    } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+    size_t len = strlen(dir_entry->d_name);
+    if (// Check if it's a regular file (not a directory)
+        dir_entry->d_type == DT_REG &&
+        // Check if the filename is big enough to contain the suffix
+	len > suflen &&
+        // Check if the filename ends with the mail suffix
+	!strcmp(dir_entry->d_name + len - suflen, MAIL_FILE_SUFFIX)) {
+      
+      memcpy(batch[batch_count++], dir_entry->d_name, len + 1);
+      if (batch_count == SCAN_BATCH_SIZE) {
+	append_scanned_files(list, dirfd, batch, batch_count);
+	batch_count = 0;
+      }
+    }
+  }
+  append_scanned_files(list, dirfd, batch, batch_count);
+  closedir(dir);
+  free(batch);
+  
+  mail_index_writer_t writer = mail_index_create(dirfd);
+  if (!writer) return;
+  for (unsigned int i = 0; i < list->count; i++) {
+    entry.name = list->names + list->items[i].name;
+    entry.name_len = strlen(entry.name);
+    entry.size = list->items[i].file_size;
+    entry.header_size = list->items[i].header_size;
+    entry.flags = list->items[i].clean ? MAIL_FLAG_CLEAN : 0;
+    entry.key = NULL;
+    entry.key_len = 0;
+    mail_index_add(writer, &entry);
+  }
+  mail_index_commit(writer);
+}
+
+/** Internal function that reads the list of emails of a mailbox from
+ *  its index, or by scanning the directory if the index is missing
+ *  or out of date. The caller must hold the mailbox lock.
+ */
+static struct mail_list *read_mailbox(const char *directory, int dirfd) {
+
+  struct mail_list *list = create_mail_list(directory);
+  if (mail_index_read(dirfd, add_indexed_item, list) < 0) {
+    // discard any messages read before the index was found to be invalid
+    list->count = list->live_count = 0;
+    list->live_size = list->total_size = 0;
+    list->names_len = 0;
+    scan_mail_directory(list, dirfd);
+  }
+  return list;
+}
+
+/** Acquires exclusive access to the maildrop of a user, as required
+ *  by POP3 for the duration of a session, without waiting for it. The
+ *  lock only excludes other sessions: deliveries (save_user_mail) do
+ *  not take it, and only wait for the short-lived mailbox index lock,
+ *  so a user's open session never delays mail for that user.
+ *
+ *  The lock is a flock on a file named after the user, in the lock
+ *  directory of the user's shard, so it does not depend on the
+ *  mailbox existing, works between threads as well as processes, and
+ *  is released by the system if the process holding it dies.
+ *
+ *  Parameters: username: Name of the user whose maildrop is locked.
+ *
+ *  Returns: A lock to be passed to unlock_user_maildrop, or -1 if the
+ *           maildrop is locked by another session (errno set to
+ *           EWOULDBLOCK) or the lock cannot be created.
+ */
+int lock_user_maildrop(const char *username) {
+
+  char filename[PATH_MAX];
+  int rv;
+
+  const char *root = user_mail_root(username);
+  mkdir(root, 0777);
+  snprintf(filename, sizeof(filename), "%s/" MAIL_LOCK_DIRECTORY, root);
+  mkdir(filename, 0777);
+  snprintf(filename, sizeof(filename), "%s/" MAIL_LOCK_DIRECTORY "/%s", root, username);
+  int fd = open(filename, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return -1;
+  while ((rv = flock(fd, LOCK_EX | LOCK_NB)) < 0 && errno == EINTR);
+  if (rv < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
   }
+  return fd;
+}
+
+/** Releases a maildrop lock acquired with lock_user_maildrop. Should
+ *  be called after the user's mail list is destroyed, so its changes
+ *  are complete before another session can load the mailbox.
+ */
+void unlock_user_maildrop(int lock) {
+  if (lock >= 0)
+    close(lock);
 }
 
 /** Reads the list of available email messages for a username, based
@@ -163,6 +868,10 @@ void save_user_mail(const char *basefile, user_list_t users) {
  *  messages themselves are not kept in memory. If the user does not
  *  exist or does not have any messages, an empty list is returned.
  *
+ *  The list is read from the mailbox index. If the index is missing
+ *  or out of date, the mailbox directory is scanned instead, and the
+ *  index is rebuilt.
+ *
  *  Parameters: username: Name of the user whose email messages should
  *                        be retrieved.
  *
@@ -171,60 +880,406 @@ void save_user_mail(const char *basefile, user_list_t users) {
  */
 mail_list_t load_user_mail(const char *username) {
   
-  char filename[NAME_MAX + 1];
-  sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
+  char filename[PATH_MAX];
+  uint64_t start = TRACE_START();
+  snprintf(filename, sizeof(filename), "%s/%s", user_mail_root(username), username);
   
-  DIR *dir = opendir(filename);
-  if (!dir) return NULL;
+  int dirfd = open(filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0) return NULL;
   
+  mail_index_lock(dirfd);
+  struct mail_list *list = read_mailbox(filename, dirfd);
+  mail_index_unlock(dirfd);
+  close(dirfd);
+  TRACE_SPAN(TRACE_LOAD_MAIL, start);
+  return list;
+}
+
+struct compact_state {
+  struct mail_list   *list;    // list loaded from the mailbox, or NULL
+  mail_index_writer_t writer;
+  int                 dirfd;
+  unsigned int        next;    // next item of the list to be matched
+};
+
+/** Internal callback that copies a message from the current mailbox
+ *  index to the compacted index, unless it was deleted, adding its
+ *  header size if it was found after the list was loaded. Entries are
+ *  expected in the same order they were loaded into the list, except
+ *  for deleted items, which may have been removed from the index
+ *  already; any other entry (e.g., a message delivered after the list
+ *  was loaded) is kept as long as its file still exists.
+ */
+static void compact_indexed_item(void *arg, unsigned int pos,
+				 const struct mail_index_entry *entry) {
+
+  struct compact_state *state = arg;
+  struct mail_list *list = state->list;
+  char file[NAME_MAX + 1];
   struct stat file_stat;
-  struct dirent *dir_entry;
-  const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-  struct mail_list *list = NULL;
-  
-  while ((dir_entry = readdir(dir)) != NULL) {
-    
-    if (// Check if it's a regular file (not a directory)
-        dir_entry->d_type == DT_REG &&
-        // Check if the filename is big enough to contain the suffix
-	strlen(dir_entry->d_name) > suflen &&
-        // Check if the filename ends with the mail suffix
-	!strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
-      
-      struct mail_list *node = malloc(sizeof(struct mail_list));
-      sprintf(node->item.file_name, MAIL_BASE_DIRECTORY "/%s/%s",
-              username, dir_entry->d_name);
-      
-      if (stat(node->item.file_name, &file_stat) < 0) {
-	free(node);
+
+  if (!list) {
+    mail_index_add(state->writer, entry);
+    return;
+  }
+
+  while (state->next < list->count) {
+    struct mail_item *item = &list->items[state->next];
+    const char *name = list->names + item->name;
+    if (strlen(name) == entry->name_len && !memcmp(name, entry->name, entry->name_len)) {
+      state->next++;
+      if (item->deleted)
+	return;
+      struct mail_index_entry updated = *entry;
+      if (item->header_found)
+	updated.header_size = item->header_size;
+      mail_index_add(state->writer, &updated);
+      return;
+    }
+    if (!item->deleted)
+      break;
+    state->next++;
+  }
+
+  snprintf(file, sizeof(file), "%.*s" MAIL_FILE_SUFFIX, (int) entry->name_len, entry->name);
+  if (fstatat(state->dirfd, file, &file_stat, 0) == 0)
+    mail_index_add(state->writer, entry);
+}
+
+/** Internal callback that deletes the file of a message removed from
+ *  the mailbox index, and releases its object.
+ */
+static void reclaim_indexed_item(void *arg, unsigned int pos,
+				 const struct mail_index_entry *entry) {
+
+  int *fds = arg; // mailbox and object directories
+  char file[NAME_MAX + 1];
+  char key[MAIL_KEY_SIZE];
+
+  snprintf(file, sizeof(file), "%.*s" MAIL_FILE_SUFFIX, (int) entry->name_len, entry->name);
+  unlinkat(fds[0], file, 0);
+  if (entry->key_len && entry->key_len < sizeof(key) && fds[1] >= 0) {
+    memcpy(key, entry->key, entry->key_len);
+    key[entry->key_len] = 0;
+    release_object(fds[1], key);
+  }
+}
+
+/** Internal function that deletes the files of all messages removed
+ *  from a mailbox index, releasing their objects, and then rewrites
+ *  the index without them. If a list is informed, header sizes found
+ *  while it was in use are added to the index. The caller must hold
+ *  the mailbox lock.
+ *
+ *  Parameters: dirfd: Mailbox directory.
+ *              list: List of emails loaded from the mailbox, or NULL.
+ */
+static void reclaim_mailbox(int dirfd, struct mail_list *list) {
+
+  int fds[2] = { dirfd, open_object_directory(dirfd) };
+  mail_index_read_removed(dirfd, reclaim_indexed_item, fds);
+  if (fds[1] >= 0)
+    close(fds[1]);
+
+  // if the index is missing or stale, it will be rebuilt on the
+  // next load, so only a valid index is compacted
+  struct compact_state state = { list, mail_index_create(dirfd), dirfd, 0 };
+  if (state.writer) {
+    if (mail_index_read(dirfd, compact_indexed_item, &state) < 0)
+      mail_index_discard(state.writer);
+    else
+      mail_index_commit(state.writer);
+  }
+}
+
+/** Internal function that records the messages marked to be deleted
+ *  in a list as tombstones in the mailbox index (see
+ *  mail_index_remove). The caller must hold the mailbox lock.
+ *
+ *  Returns: 0 if the deletions were recorded, -1 otherwise.
+ */
+static int record_deletions(struct mail_list *list, int dirfd) {
+
+  unsigned int count = 0;
+  const char **names = malloc((list->count - list->live_count) * sizeof(char *));
+  for (unsigned int i = 0; i < list->count; i++) {
+    if (list->items[i].deleted)
+      names[count++] = list->names + list->items[i].name;
+  }
+  int rv = mail_index_remove(dirfd, names, count);
+  free(names);
+  return rv;
+}
+
+// Socket used to send mailboxes to the reclaimer, -1 if not running
+static int reclaimer_fd = -1;
+
+/** Internal function that reclaims the deleted messages of a mailbox,
+ *  given its directory, locking the mailbox.
+ */
+static void reclaim_directory(const char *directory) {
+
+  int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+    return;
+  mail_index_lock(dirfd);
+  reclaim_mailbox(dirfd, NULL);
+  mail_index_unlock(dirfd);
+  close(dirfd);
+}
+
+/** Internal function run by the reclaimer process. Mailbox
+ *  directories are received one per message; all messages already
+ *  queued are taken as a batch, and a mailbox named several times in
+ *  a batch is reclaimed only once. Returns once every process that
+ *  could send a mailbox is gone.
+ */
+static void run_mail_reclaimer(int fd) {
+
+  char (*batch)[PATH_MAX] = malloc(RECLAIM_BATCH_SIZE * sizeof(*batch));
+  while (1) {
+    unsigned int count = 0;
+    int flags = 0;
+    while (count < RECLAIM_BATCH_SIZE) {
+      ssize_t len = recv(fd, batch[count], PATH_MAX - 1, flags);
+      if (len < 0 && errno == EINTR)
 	continue;
+      if (len <= 0 && !flags) {
+	free(batch);
+	return;
       }
-      
-      node->item.file_size = file_stat.st_size;
-      node->item.deleted = 0;
-      node->next = list;
-      list = node;
+      if (len <= 0)
+	break;
+      batch[count][len] = 0;
+      unsigned int i;
+      for (i = 0; i < count && strcmp(batch[i], batch[count]); i++);
+      if (i == count)
+	count++;
+      flags = MSG_DONTWAIT;
     }
+    for (unsigned int i = 0; i < count; i++)
+      reclaim_directory(batch[i]);
   }
-  
-  closedir(dir);
-  return list;
 }
 
-/** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+/** Starts the background reclaimer, which deletes the files of
+ *  messages deleted in POP3 sessions after the sessions end (see
+ *  destroy_mail_list). The reclaimer is a separate process, detached
+ *  from the caller so it is not seen as one of its children, shared
+ *  by every process and thread the caller creates afterwards. It
+ *  exits once they are all gone.
+ *
+ *  Returns: 0 if the reclaimer was started, -1 otherwise (in which
+ *           case messages are deleted when the session ends).
+ */
+int start_mail_reclaimer(void) {
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+    return -1;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    // the intermediate process exits right away, so the reclaimer is
+    // adopted by init
+    close(fds[1]);
+    if (fork() == 0)
+      run_mail_reclaimer(fds[0]);
+    _exit(0);
+  }
+
+  close(fds[0]);
+  while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+  reclaimer_fd = fds[1];
+  return 0;
+}
+
+/** Frees all memory used by a list of emails. Messages marked to be
+ *  deleted are removed from the mailbox index, as tombstones; their
+ *  files are deleted later by the reclaimer (see
+ *  start_mail_reclaimer), which also removes their objects from the
+ *  object store if no other mailbox contains them, so bulk deletions
+ *  do not delay the end of the session. If the reclaimer is not
+ *  running or cannot take the mailbox, or the index cannot record
+ *  the deletions, the files are deleted before returning. Header
+ *  sizes found while the list was in use are added to the index,
+ *  unless the deletions are left to the reclaimer.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
-  while (list) {
-    
-    if (list->item.deleted) unlink(list->item.file_name);
-    
-    mail_list_t next = list->next;
-    free(list);
-    list = next;
+
+  char file[NAME_MAX + 1];
+  if (!list) return;
+
+  int dirfd = list->live_count < list->count || list->headers_found ?
+    open(list->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  if (dirfd >= 0) {
+    mail_index_lock(dirfd);
+
+    int recorded = list->live_count < list->count && record_deletions(list, dirfd) == 0;
+    int deferred = recorded && reclaimer_fd >= 0 &&
+      send(reclaimer_fd, list->directory, strlen(list->directory),
+	   MSG_DONTWAIT | MSG_NOSIGNAL) >= 0;
+
+    if (!deferred) {
+      if (!recorded && list->live_count < list->count) {
+	int objfd = open_object_directory(dirfd);
+	for (unsigned int i = 0; i < list->count; i++) {
+	  if (list->items[i].deleted) {
+	    mail_item_file(&list->items[i], file, sizeof(file));
+	    const char *key = mail_item_key(&list->items[i]);
+	    if (unlinkat(dirfd, file, 0) == 0 && *key && objfd >= 0)
+	      release_object(objfd, key);
+	  }
+	}
+	if (objfd >= 0)
+	  close(objfd);
+      }
+      reclaim_mailbox(dirfd, list);
+    }
+
+    mail_index_unlock(dirfd);
+    close(dirfd);
+  }
+
+  free(list->items);
+  free(list->names);
+  free(list->directory);
+  free(list);
+}
+
+/** Internal function that copies a message from a mailbox to a
+ *  mailbox in another shard, under the same name, adding it to the
+ *  object store of that shard. A message already in the target
+ *  mailbox (e.g., copied by a move that was interrupted) is left as
+ *  it is. Both mailbox locks must be held.
+ *
+ *  Returns: 0 if the message is in the target mailbox, -1 otherwise.
+ */
+static int copy_message(const char *source, int srcfd, int objfd, int dstfd,
+			mail_item_t item) {
+
+  char path[PATH_MAX], file[NAME_MAX + 1], key[MAIL_KEY_SIZE];
+  struct mail_index_entry entry;
+  uint64_t header_size;
+
+  mail_item_file(item, file, sizeof(file));
+  snprintf(path, sizeof(path), "%s/%s", source, file);
+  int fd = openat(srcfd, file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int clean = scan_message(fd, key, &header_size);
+  int rv = clean < 0 || store_object(objfd, path, fd, key) < 0 ? -1 : 0;
+  close(fd);
+  if (rv < 0)
+    return -1;
+
+  if (linkat(objfd, key, dstfd, file, 0) < 0) {
+    int saved_errno = errno;
+    release_object(objfd, key);
+    return saved_errno == EEXIST ? 0 : -1;
   }
+
+  entry.name = item->list->names + item->name;
+  entry.name_len = strlen(entry.name);
+  entry.size = item->file_size;
+  entry.header_size = header_size;
+  entry.flags = clean ? MAIL_FLAG_CLEAN : 0;
+  entry.key = key;
+  entry.key_len = strlen(key);
+  mail_index_append(dstfd, &entry);
+  return 0;
+}
+
+/** Moves the mailbox of a user from a shard of the mail storage to
+ *  the shard the user is placed on, after the list of shards has
+ *  changed (see mailstore.c). Messages keep their names, so their
+ *  unique ids (e.g., in POP3 UIDL) don't change, and are merged with
+ *  any messages already delivered to the new shard. The mailbox is
+ *  only removed from the old shard once all its messages are in the
+ *  new one, so an interrupted move can simply be run again.
+ *
+ *  The maildrop lock is held during the move, so sessions of servers
+ *  already using the new list of shards wait for it. Servers still
+ *  using the old list may deliver to the old shard, so moves should be
+ *  run again once all servers use the new list.
+ *
+ *  Parameters: username: Name of the user whose mailbox is moved.
+ *              root: Directory of the shard the mailbox is in.
+ *
+ *  Returns: 0 if the mailbox was moved (or there was nothing to
+ *           move), -1 otherwise (errno set to EWOULDBLOCK if the
+ *           maildrop is locked by a session).
+ */
+int relocate_user_mail(const char *username, const char *root) {
+
+  char source[PATH_MAX], target[PATH_MAX], file[NAME_MAX + 1];
+
+  const char *home = user_mail_root(username);
+  if (!strcmp(home, root))
+    return 0;
+  snprintf(source, sizeof(source), "%s/%s", root, username);
+  int srcfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (srcfd < 0)
+    return errno == ENOENT ? 0 : -1;
+  int lock = lock_user_maildrop(username);
+  if (lock < 0) {
+    int saved_errno = errno;
+    close(srcfd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  snprintf(target, sizeof(target), "%s/" MAIL_OBJECT_DIRECTORY, home);
+  mkdir(target, 0777);
+  int objfd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  snprintf(target, sizeof(target), "%s/%s", home, username);
+  int dstfd = objfd >= 0 ? open_mailbox(target) : -1;
+
+  mail_index_lock(srcfd);
+  struct mail_list *list = read_mailbox(source, srcfd);
+  int rv = dstfd < 0 ? -1 : 0;
+  for (unsigned int i = 0; rv == 0 && i < list->count; i++)
+    rv = copy_message(source, srcfd, objfd, dstfd, &list->items[i]);
+
+  // messages removed from the index (but not yet reclaimed) are
+  // deleted first, while the index is still up to date
+  if (rv == 0) {
+    int fds[2] = { srcfd, open_object_directory(srcfd) };
+    int srcobjfd = fds[1];
+    mail_index_read_removed(srcfd, reclaim_indexed_item, fds);
+    for (unsigned int i = 0; i < list->count; i++) {
+      mail_item_file(&list->items[i], file, sizeof(file));
+      const char *key = mail_item_key(&list->items[i]);
+      if (unlinkat(srcfd, file, 0) == 0 && *key && srcobjfd >= 0)
+	release_object(srcobjfd, key);
+    }
+    if (srcobjfd >= 0)
+      close(srcobjfd);
+    unlinkat(srcfd, MAIL_INDEX_FILE_NAME, 0);
+    rmdir(source);
+  }
+
+  mail_index_unlock(srcfd);
+  close(srcfd);
+  if (dstfd >= 0) {
+    mail_index_unlock(dstfd);
+    close(dstfd);
+  }
+  if (objfd >= 0)
+    close(objfd);
+  unlock_user_maildrop(lock);
+  free(list->items);
+  free(list->names);
+  free(list->directory);
+  free(list);
+  return rv;
 }
 
 /** Returns the number of email messages available in a list of
@@ -237,12 +1292,7 @@ void destroy_mail_list(mail_list_t list) {
  *  Returns: Number of non-deleted messages in list.
  */
 unsigned int get_mail_count(mail_list_t list) {
-  unsigned int rv = 0;
-  while (list) {
-    if (!list->item.deleted) rv++;
-    list = list->next;
-  }
-  return rv;
+  return list ? list->live_count : 0;
 }
 
 /** Returns the email message object at a specific position in a list
@@ -263,13 +1313,9 @@ unsigned int get_mail_count(mail_list_t list) {
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
   
-  while (list) {
-    if (!pos--)
-      return list->item.deleted ? NULL : &list->item;
-    list = list->next;
-  }
-  
-  return NULL;
+  if (!list || pos >= list->count || list->items[pos].deleted)
+    return NULL;
+  return &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -280,12 +1326,21 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  *  Returns: Total size for all non-deleted messages in list.
  */
 size_t get_mail_list_size(mail_list_t list) {
-  size_t rv = 0;
-  while (list) {
-    rv += list->item.deleted ? 0 : list->item.file_size;
-    list = list->next;
-  }
-  return rv;
+  return list ? list->live_size : 0;
+}
+
+/** Returns the unique id of an email message (e.g., for POP3 UIDL):
+ *  the name it was stored under by save_user_mail, which is kept in
+ *  the mailbox index, so it is known without reading the message and
+ *  stays the same across sessions, whatever the message's number.
+ *  Names only contain digits and dots, as required of unique ids.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Null-terminated unique id, valid while the list exists.
+ */
+const char *get_mail_item_uid(mail_item_t item) {
+  return item->list->names + item->name;
 }
 
 /** Returns the total amount of bytes in an email message.
@@ -308,7 +1363,138 @@ size_t get_mail_item_size(mail_item_t item) {
  *           contents.
  */
 FILE *get_mail_item_contents(mail_item_t item) {
-  return fopen(item->file_name, "r");
+  char path[PATH_MAX];
+  mail_item_path(item, path, sizeof(path));
+  return fopen(path, "r");
+}
+
+/** Returns a file descriptor that can be used to read the contents of
+ *  an email message, e.g., to send it with sendfile. The caller is
+ *  responsible for closing the file descriptor once the data is no
+ *  longer needed.
+ *
+ *  Parameters: item: Email message to be retrieved.
+ *
+ *  Returns: File descriptor, or -1 in case of error retrieving the
+ *           contents.
+ */
+int get_mail_item_fd(mail_item_t item) {
+  char path[PATH_MAX];
+  mail_item_path(item, path, sizeof(path));
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/** Maps the contents of an email message into memory, as an
+ *  alternative to get_mail_item_contents when parts of the message
+ *  are sent directly from memory (e.g., with send_multiline_data).
+ *  The mapping must be released with unmap_mail_item.
+ *
+ *  Parameters: item: Email message to be retrieved.
+ *              contents: Where the address and size of the mapped
+ *                        contents are stored (NULL and 0 if the
+ *                        message is empty).
+ *
+ *  Returns: 0 on success, or -1 in case of error retrieving the
+ *           contents.
+ */
+int map_mail_item(mail_item_t item, struct mail_contents *contents) {
+
+  struct stat file_stat;
+  int fd = get_mail_item_fd(item);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &file_stat) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  contents->data = NULL;
+  contents->size = file_stat.st_size;
+  if (contents->size > 0) {
+    void *data = mmap(NULL, contents->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    contents->data = data;
+  }
+  close(fd);
+  return 0;
+}
+
+/** Releases the contents of a message mapped with map_mail_item.
+ */
+void unmap_mail_item(struct mail_contents *contents) {
+  if (contents->data)
+    munmap((void *) contents->data, contents->size);
+  contents->data = NULL;
+  contents->size = 0;
+}
+
+/** Internal function that finds the size of the header of a message,
+ *  i.e., the number of bytes up to and including the first empty
+ *  line, or the whole message if it has no empty line.
+ */
+static size_t find_header_size(const char *data, size_t size) {
+
+  const char *p = data, *end = data + size;
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      break;
+    if (eol == p || (eol == p + 1 && *p == '\r'))
+      return eol + 1 - data;
+    p = eol + 1;
+  }
+  return size;
+}
+
+/** Returns the number of bytes at the start of a message that contain
+ *  its header, the empty line following it, and a number of lines of
+ *  its body (e.g., for POP3 TOP). The size of the header is kept in
+ *  the mailbox index, so only the requested lines of the body are
+ *  scanned; for messages whose header size is not yet known, it is
+ *  found once and added to the index when the list is destroyed.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              contents: Contents of the message (see map_mail_item).
+ *              lines: Number of lines of the body to be included.
+ *
+ *  Returns: Number of bytes to be sent, at most contents->size.
+ */
+size_t get_mail_item_top(mail_item_t item, const struct mail_contents *contents,
+			 unsigned int lines) {
+
+  if (!contents->size)
+    return 0;
+  if (item->header_size == MAIL_INDEX_NO_HEADER || item->header_size > contents->size) {
+    item->header_size = find_header_size(contents->data, contents->size);
+    if (!item->header_found) {
+      item->header_found = 1;
+      item->list->headers_found++;
+    }
+  }
+
+  const char *p = contents->data + item->header_size, *end = contents->data + contents->size;
+  for (; lines > 0 && p < end; lines--) {
+    const char *eol = memchr(p, '\n', end - p);
+    p = eol ? eol + 1 : end;
+  }
+  return p - contents->data;
+}
+
+/** Checks if an email message is known to be stored in a form that
+ *  can be sent unmodified as a multi-line response, i.e., with CRLF
+ *  line terminators and no lines starting with a dot. Messages that
+ *  are not clean (or were not checked) must be dot-stuffed and have
+ *  their line terminators normalized when sent.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: non-zero if the message is clean, zero otherwise.
+ */
+int is_mail_item_clean(mail_item_t item) {
+  return item->clean;
 }
 
 /** Marks a message for deletion in the internal email list. Does not
@@ -319,7 +1505,10 @@ FILE *get_mail_item_contents(mail_item_t item) {
  *  Parameters: item: Email message to be marked for deletion.
  */
 void mark_mail_item_deleted(mail_item_t item) {
+  if (item->deleted) return;
   item->deleted = 1;
+  item->list->live_count--;
+  item->list->live_size -= item->file_size;
 }
 
 /** Marks all deleted messages in a list as no longer deleted.
@@ -330,13 +1519,14 @@ void mark_mail_item_deleted(mail_item_t item) {
  */
 unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
   
-  unsigned int rv = 0;
+  if (!list) return 0;
   
-  while (list) {
-    rv += list->item.deleted;
-    list->item.deleted = 0;
-    list = list->next;
-  }
+  unsigned int rv = list->count - list->live_count;
+  
+  for (unsigned int i = 0; rv && i < list->count; i++)
+    list->items[i].deleted = 0;
   
+  list->live_count = list->count;
+  list->live_size = list->total_size;
   return rv;
 }
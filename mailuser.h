@@ -7,6 +7,8 @@
 #ifndef _MAILUSER_H_
 #define _MAILUSER_H_
 
+#include "arena.h"
+
 #include <stdio.h>
 
 #define MAX_USERNAME_SIZE 255
@@ -16,23 +18,46 @@ typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
 
+// Contents of an email message mapped into memory (see map_mail_item)
+struct mail_contents {
+  const char *data;
+  size_t      size;
+};
+
+void load_user_directory(void);
+unsigned int get_mail_store_roots(const char **roots, unsigned int max);
 int is_valid_user(const char *username, const char *password);
+void check_valid_users(const char *const *usernames, size_t count, int *results);
 
 user_list_t create_user_list(void);
 void add_user_to_list(user_list_t *list, const char *username);
+void add_user_to_arena_list(user_list_t *list, const char *username, arena_t arena);
+const char *get_user_list_name(user_list_t list);
+user_list_t get_user_list_next(user_list_t list);
 void destroy_user_list(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
+int save_user_mail(const char *basefile, user_list_t users);
 
+int lock_user_maildrop(const char *username);
+void unlock_user_maildrop(int lock);
 mail_list_t load_user_mail(const char *username);
+int start_mail_reclaimer(void);
 void destroy_mail_list(mail_list_t list);
+int relocate_user_mail(const char *username, const char *root);
 unsigned int get_mail_count(mail_list_t list);
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos);
 size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
+const char *get_mail_item_uid(mail_item_t item);
 FILE *get_mail_item_contents(mail_item_t item);
+int get_mail_item_fd(mail_item_t item);
+int map_mail_item(mail_item_t item, struct mail_contents *contents);
+void unmap_mail_item(struct mail_contents *contents);
+size_t get_mail_item_top(mail_item_t item, const struct mail_contents *contents,
+			 unsigned int lines);
+int is_mail_item_clean(mail_item_t item);
 void mark_mail_item_deleted(mail_item_t item);
 
 #endif
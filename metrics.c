@@ -0,0 +1,269 @@
+/* metrics.c
+ * Counters and latency histograms kept in a shared-memory segment.
+ *
+ * The segment is a file mapped into memory with MAP_SHARED, created
+ * by the server before it starts accepting connections, so it is
+ * inherited by every forked process and shared by all threads.
+ * Counters are updated with atomic operations and never locked, so
+ * an exporter (see metricsdump.c) can map the same file and read
+ * them at any time. Readers may see a histogram whose count is
+ * slightly out of step with its buckets, but never a torn counter.
+ *
+ * If the segment cannot be created, metrics are not recorded, and
+ * all update functions do nothing.
+ */
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct metrics_segment *segment = NULL;
+
+/** Creates the shared segment in a file, replacing any existing
+ *  metrics, and registers the names of the operations that will be
+ *  measured with metrics_op.
+ *
+ *  Parameters: path: Name of the file backing the segment.
+ *              op_names: Names of the operations; an operation is
+ *                        identified by its position in this array.
+ *              op_count: Number of operations (at most
+ *                        METRICS_MAX_OPS).
+ *
+ *  Returns: 0 if the segment was created, -1 otherwise.
+ */
+int metrics_open(const char *path, const char *const op_names[], int op_count) {
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  // truncating the file first clears all counters
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct metrics_segment)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  struct metrics_segment *s = mmap(NULL, sizeof(struct metrics_segment),
+				   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED)
+    return -1;
+
+  if (op_count > METRICS_MAX_OPS)
+    op_count = METRICS_MAX_OPS;
+  for (int i = 0; i < op_count; i++)
+    snprintf(s->op_names[i], METRICS_NAME_SIZE, "%s", op_names[i]);
+  s->op_count = op_count;
+  s->version = METRICS_VERSION;
+  s->started = time(NULL);
+  __atomic_store_n(&s->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+  segment = s;
+  return 0;
+}
+
+/** Maps an existing segment for reading, e.g., by an exporter.
+ *
+ *  Parameters: path: Name of the file backing the segment.
+ *
+ *  Returns: The mapped segment, or NULL if the file cannot be mapped
+ *           or does not contain a valid segment.
+ */
+struct metrics_segment *metrics_map(const char *path) {
+
+  struct stat file_stat;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size < sizeof(struct metrics_segment)) {
+    close(fd);
+    return NULL;
+  }
+
+  struct metrics_segment *s = mmap(NULL, sizeof(struct metrics_segment),
+				   PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED)
+    return NULL;
+  if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+      s->version != METRICS_VERSION) {
+    munmap(s, sizeof(struct metrics_segment));
+    return NULL;
+  }
+  return s;
+}
+
+/** Returns the current time, in microseconds, to be used as the
+ *  start time of an operation.
+ */
+uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Returns the histogram bucket where a value is recorded.
+ */
+int metrics_bucket(uint64_t value) {
+
+  if (value < METRICS_SUB_BUCKETS)
+    return value;
+
+  int e = 63 - __builtin_clzll(value);
+  int bucket = (e - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+    ((value >> (e - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+  return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/** Returns the largest value recorded in a histogram bucket.
+ */
+uint64_t metrics_bucket_limit(int bucket) {
+
+  if (bucket < METRICS_SUB_BUCKETS)
+    return bucket;
+
+  int e = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+  uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+  return ((METRICS_SUB_BUCKETS + sub + 1) << (e - METRICS_SUB_BITS)) - 1;
+}
+
+/** Records a value in a histogram. Histograms outside the segment
+ *  (e.g., in a benchmark) can also be updated with this function.
+ *
+ *  Parameters: h: Histogram to be updated.
+ *              value: Value to be recorded, usually in microseconds.
+ */
+void metrics_record(struct metrics_histogram *h, uint64_t value) {
+
+  __atomic_add_fetch(&h->buckets[metrics_bucket(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (value > max &&
+	 !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** Returns an upper bound of the value at a quantile of a histogram
+ *  (never more than the largest value recorded).
+ *
+ *  Parameters: h: Histogram to be assessed.
+ *              q: Quantile, between 0 and 1 (e.g., 0.99).
+ *
+ *  Returns: The value at the quantile, or 0 if the histogram is empty.
+ */
+uint64_t metrics_quantile(const struct metrics_histogram *h, double q) {
+
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  uint64_t target = q * count, seen = 0;
+
+  if (count == 0)
+    return 0;
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (seen > target)
+      return metrics_bucket_limit(i) < max ? metrics_bucket_limit(i) : max;
+  }
+  return max;
+}
+
+/** Adds all values recorded in a histogram to another histogram.
+ *
+ *  Parameters: to: Histogram to be updated.
+ *              from: Histogram whose values are added.
+ */
+void metrics_merge(struct metrics_histogram *to, const struct metrics_histogram *from) {
+
+  for (int i = 0; i < METRICS_BUCKETS; i++)
+    __atomic_add_fetch(&to->buckets[i], from->buckets[i], __ATOMIC_RELAXED);
+  __atomic_add_fetch(&to->sum, from->sum, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&to->count, from->count, __ATOMIC_RELAXED);
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+/** Records the completion of an operation.
+ *
+ *  Parameters: op: Position of the operation's name in metrics_open.
+ *              start: Time the operation started (from metrics_now).
+ */
+void metrics_op(int op, uint64_t start) {
+  if (segment && op >= 0 && op < segment->op_count)
+    metrics_record(&segment->ops[op], metrics_now() - start);
+}
+
+/** Records a newly accepted connection.
+ */
+void metrics_connection(void) {
+  if (segment)
+    __atomic_add_fetch(&segment->connections, 1, __ATOMIC_RELAXED);
+}
+
+/** Records the start of a session.
+ */
+void metrics_session_start(void) {
+  if (segment)
+    __atomic_add_fetch(&segment->sessions_active, 1, __ATOMIC_RELAXED);
+}
+
+/** Records the end of a session.
+ *
+ *  Parameters: start: Time the session started (from metrics_now).
+ */
+void metrics_session_end(uint64_t start) {
+  if (segment) {
+    __atomic_sub_fetch(&segment->sessions_active, 1, __ATOMIC_RELAXED);
+    metrics_record(&segment->sessions, metrics_now() - start);
+  }
+}
+
+/** Records bytes received from a client.
+ */
+void metrics_bytes_in(size_t bytes) {
+  if (segment)
+    __atomic_add_fetch(&segment->bytes_in, bytes, __ATOMIC_RELAXED);
+}
+
+/** Records bytes sent to a client.
+ */
+void metrics_bytes_out(size_t bytes) {
+  if (segment)
+    __atomic_add_fetch(&segment->bytes_out, bytes, __ATOMIC_RELAXED);
+}
+
+/** Records the state of the delivery queue (see mailqueue.c).
+ *
+ *  Parameters: depth: Messages queued and not yet delivered.
+ *              oldest: Time the oldest of them was queued (from
+ *                      metrics_now), or 0 if there are none.
+ */
+void metrics_queue(uint64_t depth, uint64_t oldest) {
+  if (segment) {
+    __atomic_store_n(&segment->queue_depth, depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->queue_oldest, oldest, __ATOMIC_RELAXED);
+  }
+}
+
+/** Records a message refused because the delivery queue was full.
+ */
+void metrics_queue_refused(void) {
+  if (segment)
+    __atomic_add_fetch(&segment->queue_refused, 1, __ATOMIC_RELAXED);
+}
+
+/** Records the delivery of a queued message.
+ *
+ *  Parameters: queued: Time the message was queued (from metrics_now).
+ */
+void metrics_queue_delay(uint64_t queued) {
+  if (segment)
+    metrics_record(&segment->queue_delays, metrics_now() - queued);
+}
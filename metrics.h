@@ -0,0 +1,73 @@
+/* metrics.h
+ * Counters and latency histograms kept in a shared-memory segment,
+ * updated by all processes and threads of a server.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAGIC     0x5254454d // "METR"
+#define METRICS_VERSION   2
+#define METRICS_MAX_OPS   32  // maximum number of operations measured
+#define METRICS_NAME_SIZE 16  // size of an operation name, including null byte
+
+// Latency histograms are log-linear: values (in microseconds) below
+// METRICS_SUB_BUCKETS have their own bucket, and every power of two
+// above is split in METRICS_SUB_BUCKETS buckets, so any value is
+// recorded with a relative error of at most 1/METRICS_SUB_BUCKETS.
+#define METRICS_SUB_BITS    3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS     (METRICS_SUB_BUCKETS * (40 - METRICS_SUB_BITS + 1))
+
+struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum;     // sum of all values, in microseconds
+  uint64_t max;
+  uint64_t buckets[METRICS_BUCKETS];
+};
+
+// Layout of the shared segment. All counters are only updated with
+// atomic operations, so readers never need a lock.
+struct metrics_segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t op_count;
+  uint32_t reserved;
+  uint64_t started;          // time the segment was created (seconds since epoch)
+  uint64_t connections;      // connections accepted
+  uint64_t sessions_active;  // sessions currently open
+  uint64_t bytes_in;         // bytes received from clients
+  uint64_t bytes_out;        // bytes sent to clients
+  struct metrics_histogram sessions; // session durations
+  char     op_names[METRICS_MAX_OPS][METRICS_NAME_SIZE];
+  struct metrics_histogram ops[METRICS_MAX_OPS]; // per-operation latencies
+  uint64_t queue_depth;      // messages queued and not yet delivered
+  uint64_t queue_oldest;     // time the oldest of them was queued (metrics_now), 0 if none
+  uint64_t queue_refused;    // messages refused because the queue was full
+  struct metrics_histogram queue_delays; // time from queueing to delivery
+};
+
+int metrics_open(const char *path, const char *const op_names[], int op_count);
+struct metrics_segment *metrics_map(const char *path);
+
+uint64_t metrics_now(void);
+void metrics_op(int op, uint64_t start);
+void metrics_connection(void);
+void metrics_session_start(void);
+void metrics_session_end(uint64_t start);
+void metrics_bytes_in(size_t bytes);
+void metrics_bytes_out(size_t bytes);
+void metrics_queue(uint64_t depth, uint64_t oldest);
+void metrics_queue_refused(void);
+void metrics_queue_delay(uint64_t queued);
+
+void metrics_record(struct metrics_histogram *h, uint64_t value);
+uint64_t metrics_quantile(const struct metrics_histogram *h, double q);
+void metrics_merge(struct metrics_histogram *to, const struct metrics_histogram *from);
+int metrics_bucket(uint64_t value);
+uint64_t metrics_bucket_limit(int bucket);
+
+#endif
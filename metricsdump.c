@@ -0,0 +1,86 @@
+/* metricsdump.c
+ * Prints the metrics of a running server (see metrics.c) in the
+ * Prometheus text exposition format, so they can be scraped without
+ * stopping or locking the server.
+ */
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/** Prints a histogram as a summary metric, in seconds.
+ */
+static void print_summary(const char *name, const char *labels,
+			  const struct metrics_histogram *h) {
+
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  const char *sep = *labels ? "," : "";
+
+  for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    printf("%s{%s%squantile=\"%g\"} %.6f\n", name, labels, sep, quantiles[i],
+	   metrics_quantile(h, quantiles[i]) / 1e6);
+  printf("%s_max{%s} %.6f\n", name, labels,
+	 __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e6);
+  printf("%s_sum{%s} %.6f\n", name, labels,
+	 __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6);
+  printf("%s_count{%s} %llu\n", name, labels, (unsigned long long) count);
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc != 2) {
+    fprintf(stderr, "Invalid arguments. Expected: %s <metrics file>\n", argv[0]);
+    return 1;
+  }
+
+  struct metrics_segment *s = metrics_map(argv[1]);
+  if (!s) {
+    fprintf(stderr, "%s: not a valid metrics file\n", argv[1]);
+    return 1;
+  }
+
+  printf("# TYPE mail_uptime_seconds gauge\n");
+  printf("mail_uptime_seconds %lld\n", (long long) (time(NULL) - s->started));
+  printf("# TYPE mail_connections_total counter\n");
+  printf("mail_connections_total %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->connections, __ATOMIC_RELAXED));
+  printf("# TYPE mail_sessions_active gauge\n");
+  printf("mail_sessions_active %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->sessions_active, __ATOMIC_RELAXED));
+  printf("# TYPE mail_bytes_in_total counter\n");
+  printf("mail_bytes_in_total %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->bytes_in, __ATOMIC_RELAXED));
+  printf("# TYPE mail_bytes_out_total counter\n");
+  printf("mail_bytes_out_total %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->bytes_out, __ATOMIC_RELAXED));
+
+  uint64_t oldest = __atomic_load_n(&s->queue_oldest, __ATOMIC_RELAXED);
+  uint64_t now = metrics_now();
+  printf("# TYPE mail_queue_depth gauge\n");
+  printf("mail_queue_depth %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->queue_depth, __ATOMIC_RELAXED));
+  printf("# TYPE mail_queue_age_seconds gauge\n");
+  printf("mail_queue_age_seconds %.6f\n", oldest && now > oldest ? (now - oldest) / 1e6 : 0.0);
+  printf("# TYPE mail_queue_refused_total counter\n");
+  printf("mail_queue_refused_total %llu\n",
+	 (unsigned long long) __atomic_load_n(&s->queue_refused, __ATOMIC_RELAXED));
+
+  printf("# TYPE mail_session_duration_seconds summary\n");
+  print_summary("mail_session_duration_seconds", "", &s->sessions);
+
+  printf("# TYPE mail_operation_duration_seconds summary\n");
+  for (int i = 0; i < s->op_count && i < METRICS_MAX_OPS; i++) {
+    char labels[METRICS_NAME_SIZE + 16];
+    snprintf(labels, sizeof(labels), "op=\"%.*s\"", METRICS_NAME_SIZE, s->op_names[i]);
+    print_summary("mail_operation_duration_seconds", labels, &s->ops[i]);
+  }
+
+  printf("# TYPE mail_queue_delay_seconds summary\n");
+  print_summary("mail_queue_delay_seconds", "", &s->queue_delays);
+
+  return 0;
+}
@@ -1,11 +1,17 @@
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "metrics.h"
+#include "trace.h"
+#include "command.h"
+#include "arena.h"
+#include "auth.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <ctype.h>
+#include <errno.h>
 
 #define MAX_LINE_LENGTH 1024
 #define POSITIVE "+OK"
@@ -20,86 +26,156 @@
 #define RSET "RSET"
 #define NOOP "NOOP"
 #define QUIT "QUIT"
+#define TOP  "TOP"
+#define UIDL "UIDL"
 
 #define CRLF "\r\n"
 #define SP " "
 
+// Writes text known at compile time, such as the fixed parts of a
+// reply around its numbers
+#define SEND_TEXT(out, text) ob_write(out, text, sizeof(text) - 1)
+
+#define METRICS_FILE "mypopd.metrics"
+#define TRACE_FILE "mypopd.trace"
+#define SESSION_ARENA_SIZE 1024 // bytes allocated at once for a session
+
+// Inactivity autologout timer (RFC 1939, section 3)
+#define AUTOLOGOUT_TIMEOUT (10 * 60 * 1000)
+
+// Operations measured in the metrics segment: one per command (in the
+// same order as in the command table, pop3_commands), plus
+// unknown commands, password checks, mailbox loading and the update
+// of the mailbox once the session ends
+enum { OP_USER, OP_PASS, OP_STAT, OP_LIST, OP_RETR, OP_DELE, OP_RSET, OP_NOOP, OP_QUIT,
+       OP_TOP, OP_UIDL, OP_UNKNOWN, OP_AUTH, OP_LOAD, OP_UPDATE, OP_COUNT };
+static const char *const op_names[OP_COUNT] = {
+  USER, PASS, STAT, LIST, RETR, DELE, RSET, NOOP, QUIT, TOP, UIDL,
+  "unknown", "auth", "load", "update"
+};
+
+struct pop3_session {
+  arena_t arena; // memory freed when the session ends
+  out_buffer_t out;
+  int auth_state; // 1 - AUTHORIZATION 2 - USER ACCEPTED
+  int transaction_state;
+  char* user_name; // allocated from the arena
+  mail_list_t mail_list;
+  int maildrop_lock; // exclusive lock of the maildrop, -1 if not held
+  int quit_received; // 1 once QUIT is received, entering the UPDATE state
+  uint64_t client; // client address, for throttling failed attempts
+};
+
+// Replies sent as they are
+enum { REPLY_READY, REPLY_GOOD, REPLY_BAD, REPLY_THROTTLED, REPLY_LOCKED, REPLY_TOP,
+       REPLY_UIDL, REPLY_END, REPLY_COUNT };
+static const struct static_reply replies[REPLY_COUNT] = {
+  [REPLY_READY]     = STATIC_REPLY(POSITIVE " POP3 server ready" CRLF),
+  [REPLY_GOOD]      = STATIC_REPLY(POSITIVE " Good" CRLF),
+  [REPLY_BAD]       = STATIC_REPLY(NEGATIVE " Bad" CRLF),
+  [REPLY_THROTTLED] = STATIC_REPLY(NEGATIVE " Too many failed attempts, try again later" CRLF),
+  [REPLY_LOCKED]    = STATIC_REPLY(NEGATIVE " Maildrop already locked" CRLF),
+  [REPLY_TOP]       = STATIC_REPLY(POSITIVE " top of message follows" CRLF),
+  [REPLY_UIDL]      = STATIC_REPLY(POSITIVE " unique-id listing follows" CRLF),
+  [REPLY_END]       = STATIC_REPLY("." CRLF),
+};
+
 static void handle_client(int fd);
+static void *pop3_session_open(out_buffer_t out);
+static int pop3_session_line(void *session, char *line, int len);
+static void pop3_session_close(void *session);
+static unsigned int pop3_session_timeout(void *session);
+
+static const struct session_handler pop3_handler = {
+  pop3_session_open, pop3_session_line, pop3_session_close, NULL, NULL,
+  pop3_session_timeout, NULL
+};
 
 int main(int argc, char *argv[]) {
   
-  if (argc != 2) {
-    fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+  struct server_config config;
+  int opt;
+  
+  server_config_init(&config);
+  while ((opt = getopt(argc, argv, SERVER_OPTIONS)) != -1) {
+    if (server_config_option(&config, opt, optarg) != 1) {
+      fprintf(stderr, "Invalid arguments. Expected: %s " SERVER_USAGE " <port>\n", argv[0]);
+      return 1;
+    }
+  }
+  
+  if (argc != optind + 1) {
+    fprintf(stderr, "Invalid arguments. Expected: %s " SERVER_USAGE " <port>\n", argv[0]);
     return 1;
   }
   
-  run_server(argv[1], handle_client);
+  config.port = argv[optind];
+  if (metrics_open(METRICS_FILE, op_names, OP_COUNT) < 0)
+    perror(METRICS_FILE);
+  if (config.trace_sample && trace_open(TRACE_FILE, config.trace_sample) < 0)
+    perror(TRACE_FILE);
+  if (auth_init() < 0)
+    perror("auth_init");
+  if (start_mail_reclaimer() < 0)
+    perror("start_mail_reclaimer");
+  load_user_directory();
+  run_configured_server(&config, handle_client, &pop3_handler, MAX_LINE_LENGTH);
   
   return 0;
 }
 
-int is_prefix(char* prefix, char* s) {
-  return strncasecmp(prefix, s, strlen(prefix)) == 0;
+void send_OK(out_buffer_t out) {
+  send_static(out, &replies[REPLY_GOOD]);
 }
 
-int compare(char* s1, char* s2) {
-  return strcasecmp(s1, s2) == 0;
+void send_ERR(out_buffer_t out) {
+  send_static(out, &replies[REPLY_BAD]);
 }
 
-int is_command_supported(char* command) {
-  return 
-    is_prefix(USER, command) ||
-    is_prefix(PASS, command) ||
-    compare(STAT, command) ||
-    is_prefix(LIST, command) ||
-    is_prefix(RETR, command) ||
-    is_prefix(DELE, command) ||
-    compare(RSET, command) ||
-    compare(NOOP, command) ||
-    compare(QUIT, command) ||
-    compare("\n", command);
+void send_THROTTLED(out_buffer_t out) {
+  send_static(out, &replies[REPLY_THROTTLED]);
 }
 
-void send_OK(int fd) {
-  send_formatted(fd, "%s %s\r\n", POSITIVE, "Good");
+void send_ready_message(out_buffer_t out) {
+  send_static(out, &replies[REPLY_READY]);
 }
 
-void send_ERR(int fd) {
-  send_formatted(fd, "%s %s\r\n", NEGATIVE, "Bad");
+/** Writes two numbers separated by a space, ending the line (e.g.,
+ *  the message number and size in a scan listing), without printf.
+ */
+static void send_number_pair(out_buffer_t out, uint64_t a, uint64_t b) {
+  ob_write_uint(out, a);
+  SEND_TEXT(out, SP);
+  ob_write_uint(out, b);
+  SEND_TEXT(out, CRLF);
 }
 
-void send_ready_message(int fd) {
-  send_formatted(fd, "+OK POP3 server ready\r\n");
-}
-
-int check_transactions_state(int fd, int transaction_state) {
+int check_transactions_state(out_buffer_t out, int transaction_state) {
   if (transaction_state != 1) {
-    send_ERR(fd);
+    send_ERR(out);
     return 0;
   }
 
   return 1;
 }
 
-char* get_argument(char* command) {
-  if (strchr(command, ' ') == NULL) {
-    return NULL;
-  }
+/** Returns the message numbered in the first argument of a command
+ *  (setting position to its number), or NULL (after replying with an
+ *  error) if there is no such message.
+ */
+static mail_item_t get_message_argument(struct pop3_session *s, const struct command *cmd,
+					unsigned int *position) {
 
-  char* token = strtok(command, " ");
-  token = strtok(NULL, " ");
+  mail_item_t mail_item = NULL;
 
-  if (token == NULL) {
-    return NULL;
-  }
-
-  char* newToken = malloc(strlen(token));
-  
-  strcpy(newToken, token);
-  return newToken;
+  if (command_number(&cmd->args[0], position) == 0 && *position > 0)
+    mail_item = get_mail_item(s->mail_list, *position - 1);
+  if (mail_item == NULL)
+    send_ERR(s->out);
+  return mail_item;
 }
 
-void list_mail_items(int fd, mail_list_t list) {
+void list_mail_items(out_buffer_t out, mail_list_t list) {
   int mail_count = get_mail_count(list);
   int count = 0;
   int i = 0;
@@ -109,195 +185,392 @@ void list_mail_items(int fd, mail_list_t list) {
     if (item != NULL) {
       int size = get_mail_item_size(item);
       count += 1;
-      send_formatted(fd, "%d %d\r\n", i + 1, size);
+      send_number_pair(out, i + 1, size);
     }
     
     i += 1;
   }
 
-  send_formatted(fd, ".\r\n");
+  send_static(out, &replies[REPLY_END]);
 }
 
-void handle_client(int fd) {
-  
-  char recvbuf[MAX_LINE_LENGTH + 1];
-  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+static int handle_USER(void *session, const struct command *cmd) {
 
-  int auth_state = 0; // 1 - AUTHORIZATION 2 - USER ACCEPTED
-  int transaction_state = 0;
-  char* user_name;
-  mail_list_t mail_list;
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  send_ready_message(fd);
+  struct pop3_session *s = session;
+  if (s->auth_state != 1) {
+    send_ERR(s->out);
+    return 0;
+  }
 
-  // Transitioning into AUTHORIZATION state
-  auth_state = 1;
-  
-  while (1) {
-    char* command;
-    int result = nb_read_line(nb, recvbuf);
+  // clients probing for user names are throttled like those guessing
+  // passwords
+  if (!auth_allowed(s->client, NULL)) {
+    send_THROTTLED(s->out);
+    return 0;
+  }
 
-    if (result <= 0) {
-      nb_destroy(nb);
-      return;
-    }
+  // check if user exists; the name is only kept once it is accepted,
+  // so it is allocated at most once per session
+  if (is_valid_user(cmd->args[0].ptr, NULL)) {
+    s->user_name = arena_strdup(s->arena, cmd->args[0].ptr);
+    send_OK(s->out);
+    s->auth_state = 2;
+  } else {
+    auth_failed(s->client, cmd->args[0].ptr);
+    send_ERR(s->out);
+  }
+  return 0;
+}
+
+static int handle_PASS(void *session, const struct command *cmd) {
+
+  struct pop3_session *s = session;
+  if (s->auth_state != 2 || s->user_name == NULL) {
+    send_ERR(s->out);
+    return 0;
+  }
+
+  // attempts over the limit are refused without checking the password
+  if (!auth_allowed(s->client, s->user_name)) {
+    send_THROTTLED(s->out);
+    return 0;
+  }
+
+  uint64_t start = metrics_now();
+  int valid = is_valid_user(s->user_name, cmd->args[0].ptr);
+  metrics_op(OP_AUTH, start);
+
+  // the maildrop is locked for the whole session (RFC 1939), so two
+  // sessions never see or delete the same messages
+  if (valid && (s->maildrop_lock = lock_user_maildrop(s->user_name)) < 0) {
+    send_static(s->out, &replies[REPLY_LOCKED]);
+    return 0;
+  }
+
+  if (valid) {
+    s->transaction_state = 1;
+    start = metrics_now();
+    s->mail_list = load_user_mail(s->user_name);
+    metrics_op(OP_LOAD, start);
+    send_OK(s->out);
+  } else {
+    auth_failed(s->client, s->user_name);
+    send_ERR(s->out);
+  }
+  return 0;
+}
+
+static int handle_STAT(void *session, const struct command *cmd) {
+
+  struct pop3_session *s = session;
+  if (check_transactions_state(s->out, s->transaction_state)) {
+    int mail_count = get_mail_count(s->mail_list);
+    int mail_list_size = get_mail_list_size(s->mail_list);
+
+    SEND_TEXT(s->out, POSITIVE SP);
+    send_number_pair(s->out, mail_count, mail_list_size);
+  }
+  return 0;
+}
+
+static int handle_LIST(void *session, const struct command *cmd) {
+
+  struct pop3_session *s = session;
+  if (!check_transactions_state(s->out, s->transaction_state))
+    return 0;
 
-    command = recvbuf;
-    if (strlen(command) >= 4) {
-      command = strtok(command, CRLF);
+  if (cmd->arg_count == 0) {
+    int mail_count = get_mail_count(s->mail_list);
+    int mail_list_size = get_mail_list_size(s->mail_list);
+
+    SEND_TEXT(s->out, POSITIVE SP);
+    ob_write_uint(s->out, mail_count);
+    SEND_TEXT(s->out, " messages (");
+    ob_write_uint(s->out, mail_list_size);
+    SEND_TEXT(s->out, " octets)" CRLF);
+    list_mail_items(s->out, s->mail_list);
+  } else {
+    unsigned int position;
+    mail_item_t mail_item = get_message_argument(s, cmd, &position);
+    if (mail_item != NULL) {
+      SEND_TEXT(s->out, POSITIVE SP);
+      send_number_pair(s->out, position, get_mail_item_size(mail_item));
     }
+  }
+  return 0;
+}
 
-    if (is_prefix(USER, command)) {
-
-      if (auth_state == 1) {
-        user_name = get_argument(command);
-        if (user_name == NULL) {
-          send_ERR(fd);
-        } else {
-          // check if user exists
-          if (is_valid_user(user_name, NULL)) {
-            send_OK(fd);
-            auth_state = 2;
-          } else {
-            send_ERR(fd);
-          }
-        }
-      } else {
-        send_ERR(fd);
-      }
+static int handle_RETR(void *session, const struct command *cmd) {
 
-    } else if (is_prefix(PASS, command)) {
-
-      if (auth_state == 2 && user_name != NULL) {
-        char* password = get_argument(command);
-
-        if (password == NULL) {
-          send_ERR(fd);
-        } else {
-          if (is_valid_user(user_name, password)) {
-            transaction_state = 1;
-            mail_list = load_user_mail(user_name);
-            send_OK(fd);
-          } else {
-            send_ERR(fd);
-          }
-        }
-      } else {
-        send_ERR(fd);
-      }
+  struct pop3_session *s = session;
+  if (!check_transactions_state(s->out, s->transaction_state))
+    return 0;
 
-    } else if (compare(STAT, command)) {
+  unsigned int position;
+  mail_item_t mail_item = get_message_argument(s, cmd, &position);
+  if (mail_item == NULL)
+    return 0;
 
-      if (check_transactions_state(fd, transaction_state)) {
-        int mail_count = get_mail_count(mail_list);
-        int mail_list_size = get_mail_list_size(mail_list);
+  int size = get_mail_item_size(mail_item);
+  int file = get_mail_item_fd(mail_item);
+  if (file < 0) {
+    send_ERR(s->out);
+    return 0;
+  }
 
-        send_formatted(fd, "%s %d %d\r\n", POSITIVE, mail_count, mail_list_size);
-      }
+  SEND_TEXT(s->out, POSITIVE SP);
+  ob_write_uint(s->out, size);
+  SEND_TEXT(s->out, " octets" CRLF);
+  int sent = send_multiline_file(s->out, file, is_mail_item_clean(mail_item));
+  close(file);
 
-    } else if (is_prefix(LIST, command)) {
-      
-      if (check_transactions_state(fd, transaction_state)) {
-        char* positionStr = get_argument(command);
-
-        if (positionStr == NULL) {
-          int mail_count = get_mail_count(mail_list);
-          int mail_list_size = get_mail_list_size(mail_list);
-
-          send_formatted(fd, "+OK %d messages (%d octets)\r\n", mail_count, mail_list_size);
-          
-          list_mail_items(fd, mail_list);
-        } else {
-          int position = atoi(positionStr);
-
-          mail_item_t mail_item = get_mail_item(mail_list, position - 1);
-
-          if (mail_item == NULL) {
-            send_ERR(fd);
-          } else {
-            int mail_size = get_mail_item_size(mail_item);
-            send_formatted(fd, "%s %d %d\r\n", POSITIVE, position, mail_size);
-          }
-        }
-      }
+  return sent < 0;
+}
 
-    } else if (is_prefix(RETR, command)) {
+/** Handles a TOP command, sending the header of a message and the
+ *  first lines of its body, directly from the mapped message.
+ */
+static int handle_TOP(void *session, const struct command *cmd) {
 
-      if (check_transactions_state(fd, transaction_state)) {
-        char* positionStr = get_argument(command);
+  struct pop3_session *s = session;
+  if (!check_transactions_state(s->out, s->transaction_state))
+    return 0;
 
-        if (positionStr == NULL) {
-          send_ERR(fd);
-          continue;
-        }
+  unsigned int position, lines;
+  mail_item_t mail_item = get_message_argument(s, cmd, &position);
+  if (mail_item == NULL)
+    return 0;
+
+  struct mail_contents contents;
+  if (command_number(&cmd->args[1], &lines) < 0 || map_mail_item(mail_item, &contents) < 0) {
+    send_ERR(s->out);
+    return 0;
+  }
 
-        int position = atoi(positionStr) - 1;
+  size_t len = get_mail_item_top(mail_item, &contents, lines);
+  send_static(s->out, &replies[REPLY_TOP]);
+  ssize_t sent = send_multiline_data(s->out, contents.data, len, is_mail_item_clean(mail_item));
+  unmap_mail_item(&contents);
 
-        mail_item_t mail_item = get_mail_item(mail_list, position);
+  return sent < 0;
+}
 
-        if (mail_item == NULL) {
-          send_ERR(fd);
-        } else {
-          int size = get_mail_item_size(mail_item);
+/** Writes a message number and unique id, ending the line.
+ */
+static void send_uid(out_buffer_t out, unsigned int position, mail_item_t item) {
+  const char *uid = get_mail_item_uid(item);
+  ob_write_uint(out, position);
+  SEND_TEXT(out, SP);
+  ob_write(out, uid, strlen(uid));
+  SEND_TEXT(out, CRLF);
+}
 
-          send_formatted(fd, "%s %d octets\r\n", POSITIVE, size);
+/** Handles a UIDL command, listing the unique id of one or all
+ *  messages. Ids come from the mailbox index, so no message is read.
+ */
+static int handle_UIDL(void *session, const struct command *cmd) {
 
-          FILE* file = get_mail_item_contents(mail_item);
-          char line[MAX_LINE_LENGTH + 1];
-          char buffer[MAX_LINE_LENGTH * (MAX_LINE_LENGTH + 1)];
+  struct pop3_session *s = session;
+  if (!check_transactions_state(s->out, s->transaction_state))
+    return 0;
 
-          while (fgets(line, sizeof(line), file)) {
-            if (strlen(line) == 0) {
-              break;
-            }
-            strcat(buffer, line);
-          } 
-          send_formatted(fd, "%s", buffer);
-          send_formatted(fd, ".\r\n");
-        }
+  if (cmd->arg_count == 0) {
+    unsigned int mail_count = get_mail_count(s->mail_list), count = 0;
+    send_static(s->out, &replies[REPLY_UIDL]);
+    for (unsigned int i = 0; count < mail_count; i++) {
+      mail_item_t item = get_mail_item(s->mail_list, i);
+      if (item != NULL) {
+	send_uid(s->out, i + 1, item);
+	count++;
       }
+    }
+    send_static(s->out, &replies[REPLY_END]);
+  } else {
+    unsigned int position;
+    mail_item_t mail_item = get_message_argument(s, cmd, &position);
+    if (mail_item != NULL) {
+      SEND_TEXT(s->out, POSITIVE SP);
+      send_uid(s->out, position, mail_item);
+    }
+  }
+  return 0;
+}
+
+static int handle_DELE(void *session, const struct command *cmd) {
+
+  struct pop3_session *s = session;
+  if (!check_transactions_state(s->out, s->transaction_state))
+    return 0;
+
+  unsigned int position;
+  mail_item_t mail_item = get_message_argument(s, cmd, &position);
+  if (mail_item != NULL) {
+    mark_mail_item_deleted(mail_item);
+    SEND_TEXT(s->out, POSITIVE " message ");
+    ob_write_uint(s->out, position);
+    SEND_TEXT(s->out, " deleted" CRLF);
+  }
+  return 0;
+}
 
-    } else if (is_prefix(DELE, command)) {
+static int handle_RSET(void *session, const struct command *cmd) {
 
-      if (check_transactions_state(fd, transaction_state)) {
-        char* positionStr = get_argument(command);
+  struct pop3_session *s = session;
+  if (check_transactions_state(s->out, s->transaction_state)) {
+    int number_of_reset_messages = reset_mail_list_deleted_flag(s->mail_list);
+    SEND_TEXT(s->out, POSITIVE SP);
+    ob_write_uint(s->out, number_of_reset_messages);
+    SEND_TEXT(s->out, " messages recovered" CRLF);
+  }
+  return 0;
+}
 
-        if (positionStr == NULL) {
-          send_ERR(fd);
-          continue;
-        }
+static int handle_NOOP(void *session, const struct command *cmd) {
 
-        int position = atoi(positionStr) - 1;
+  struct pop3_session *s = session;
+  send_OK(s->out);
+  return 0;
+}
 
-        mail_item_t mail_item = get_mail_item(mail_list, position);
+static int handle_QUIT(void *session, const struct command *cmd) {
 
-        if (mail_item == NULL) {
-          send_ERR(fd);
-        } else {
-          mark_mail_item_deleted(mail_item);
-          send_formatted(fd, "%s message %d deleted\r\n", POSITIVE, position + 1);
-        }
-      }
+  struct pop3_session *s = session;
+  s->quit_received = 1;
+  send_OK(s->out);
+  return 1;
+}
 
-    } else if (compare(NOOP, command)) {
+// Commands, in the same order as their operations in op_names
+static const struct command_entry pop3_commands[OP_UNKNOWN] = {
+  [OP_USER] = { COMMAND_VERB('U','S','E','R'), 1, 1, handle_USER },
+  [OP_PASS] = { COMMAND_VERB('P','A','S','S'), 1, 1, handle_PASS },
+  [OP_STAT] = { COMMAND_VERB('S','T','A','T'), 0, 0, handle_STAT },
+  [OP_LIST] = { COMMAND_VERB('L','I','S','T'), 0, 1, handle_LIST },
+  [OP_RETR] = { COMMAND_VERB('R','E','T','R'), 1, 1, handle_RETR },
+  [OP_DELE] = { COMMAND_VERB('D','E','L','E'), 1, 1, handle_DELE },
+  [OP_RSET] = { COMMAND_VERB('R','S','E','T'), 0, 0, handle_RSET },
+  [OP_NOOP] = { COMMAND_VERB('N','O','O','P'), 0, 0, handle_NOOP },
+  [OP_QUIT] = { COMMAND_VERB('Q','U','I','T'), 0, 0, handle_QUIT },
+  [OP_TOP]  = { COMMAND_VERB('T','O','P',' '), 2, 2, handle_TOP },
+  [OP_UIDL] = { COMMAND_VERB('U','I','D','L'), 0, 1, handle_UIDL },
+};
+
+/** Starts a new POP3 session on a newly accepted connection, sending
+ *  the welcome message.
+ *
+ *  Parameters: out: Output buffer for the connection.
+ *
+ *  Returns: Session object to be passed to pop3_session_line.
+ */
+static void *pop3_session_open(out_buffer_t out) {
+
+  arena_t arena = arena_create(SESSION_ARENA_SIZE);
+  struct pop3_session *s = arena_alloc(arena, sizeof(struct pop3_session));
+  s->arena = arena;
+  s->out = out;
+  s->transaction_state = 0;
+  s->user_name = NULL;
+  s->mail_list = NULL;
+  s->maildrop_lock = -1;
+  s->quit_received = 0;
+  s->client = auth_client(ob_fd(out));
+
+  send_ready_message(out);
 
-      // check_transactions_state(fd, transaction_state);
-      send_OK(fd);
+  // Transitioning into AUTHORIZATION state
+  s->auth_state = 1;
+  return s;
+}
 
-    } else if (compare(RSET, command)) {
+/** Processes a single command received from the client, dispatching
+ *  it to its handler in pop3_commands, and recording how long it
+ *  takes.
+ *
+ *  Parameters: session: Session object returned by pop3_session_open.
+ *              recvbuf: Null-terminated line, including the line
+ *                       terminator. May be modified.
+ *              len: Number of bytes in the line.
+ *
+ *  Returns: Non-zero if the connection should be closed.
+ */
+static int pop3_session_line(void *session, char *recvbuf, int len) {
+
+  struct pop3_session *s = session;
+  struct command cmd;
+  int rv = 0;
+
+  uint64_t start = metrics_now();
+  command_parse(recvbuf, len, &cmd);
+  int op = command_find(pop3_commands, OP_UNKNOWN, &cmd);
+  if (op < 0) {
+    op = OP_UNKNOWN;
+    send_ERR(s->out);
+  } else if (!command_args_valid(&pop3_commands[op], &cmd)) {
+    send_ERR(s->out);
+  } else {
+    rv = pop3_commands[op].handler(s, &cmd);
+  }
+  metrics_op(op, start);
+  return rv;
+}
 
-      if (check_transactions_state(fd, transaction_state)) {
-        int number_of_reset_messages = reset_mail_list_deleted_flag(mail_list);
-        send_formatted(fd, "+OK %d messages recovered\r\n", number_of_reset_messages);
-      }
-      
-    } else if (compare(QUIT, command)) {
-      send_OK(fd);
-      break;
+/** Ends a POP3 session. Messages marked for deletion are only deleted
+ *  if the session ended with QUIT; as required by RFC 1939, a session
+ *  that ends in any other way (e.g., the client disconnects, or the
+ *  autologout timer expires) does not enter the UPDATE state, so the
+ *  messages are kept.
+ *
+ *  Parameters: session: Session object returned by pop3_session_open.
+ */
+static void pop3_session_close(void *session) {
+
+  struct pop3_session *s = session;
+  uint64_t start = metrics_now();
+  if (!s->quit_received && s->mail_list)
+    reset_mail_list_deleted_flag(s->mail_list);
+  destroy_mail_list(s->mail_list);
+  unlock_user_maildrop(s->maildrop_lock);
+  metrics_op(OP_UPDATE, start);
+  arena_destroy(s->arena); // also frees the session
+}
+
+/** Returns how long the session waits for the next command.
+ *
+ *  Parameters: session: Session object returned by pop3_session_open.
+ *
+ *  Returns: The timeout, in milliseconds.
+ */
+static unsigned int pop3_session_timeout(void *session) {
+  return AUTOLOGOUT_TIMEOUT;
+}
+
+void handle_client(int fd) {
+  
+  char *line;
+  int result = 0;
+  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+  out_buffer_t out = ob_create(fd, OUT_BUFFER_SIZE);
+  void *session = pop3_session_open(out);
+  
+  nb_set_timeout(nb, session_timeout(&pop3_handler, session));
+  while (1) {
+    // Commands already received are processed before replies are
+    // sent, so the replies to pipelined commands are sent together
+    result = nb_peek_next_line(nb, &line);
+    if (result == 0) {
+      if (ob_flush(out) < 0)
+        break;
+      result = nb_peek_line(nb, &line);
     }
+
+    if (result <= 0 || pop3_session_line(session, line, result))
+      break;
+    nb_consume(nb, result);
+    nb_set_timeout(nb, session_timeout(&pop3_handler, session));
   }
-    
-  destroy_mail_list(mail_list);
+
+  pop3_session_close(session);
+  ob_flush(out);
+  ob_destroy(out);
   nb_destroy(nb);
 }
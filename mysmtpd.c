@@ -1,12 +1,23 @@
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "metrics.h"
+#include "trace.h"
+#include "command.h"
+#include "arena.h"
+#include "groupcommit.h"
+#include "uring.h"
+#include "textscan.h"
+#include "mailqueue.h"
+#include "mailstore.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/utsname.h>
-#include <ctype.h>
 
 #define HELO "HELO"
 #define EHLO "EHLO"
@@ -18,7 +29,7 @@
 #define NOOP "NOOP"
 #define QUIT "QUIT"
 
-#define MAX_LINE_LENGTH 1024
+#define MAX_LINE_LENGTH 16384 // also the most message contents handled at a time
 #define SERVER_READY "220"
 #define CONNECTION_ERROR "554"
 #define DATA_START "354"
@@ -30,262 +41,770 @@
 #define USER_DOES_NOT_EXIST "550"
 #define INVALID_ARG "501"
 #define USER_NOT_LOCAL "551"
+#define LOCAL_ERROR "451"
+#define SIZE_EXCEEDED "552"
+#define SERVICE_UNAVAILABLE "421"
+
+#define SPOOL_BUFFER_SIZE 65536 // bytes of message contents written at a time
+#define SESSION_ARENA_SIZE 2048 // bytes allocated at once for a session
+#define TRANSACTION_ARENA_SIZE 4096 // bytes allocated at once for a transaction
+#define RCPT_BATCH_SIZE 64 // pipelined recipients looked up together
+#define DEFAULT_MAX_MESSAGE_SIZE (10 * 1024 * 1024)
+
+// Time the server waits for input (RFC 5321, section 4.5.3.2): for
+// the next command, and for the next block of message contents
+#define COMMAND_TIMEOUT (5 * 60 * 1000)
+#define DATA_BLOCK_TIMEOUT (3 * 60 * 1000)
+
+#define METRICS_FILE "mysmtpd.metrics"
+#define TRACE_FILE "mysmtpd.trace"
+
+// Operations measured in the metrics segment: one per command (in the
+// same order as in the command table, smtp_commands), plus
+// unknown commands and message deliveries
+enum { OP_HELO, OP_EHLO, OP_MAIL, OP_RCPT, OP_DATA, OP_RSET, OP_VRFY, OP_NOOP, OP_QUIT,
+       OP_UNKNOWN, OP_DELIVER, OP_COUNT };
+static const char *const op_names[OP_COUNT] = {
+  HELO, EHLO, MAIL, RCPT, DATA, RSET, VRFY, NOOP, QUIT, "unknown", "deliver"
+};
+
+// Options accepted by this server, in addition to the server options
+#define SMTP_OPTIONS SERVER_OPTIONS "s:f:q:"
+#define SMTP_USAGE SERVER_USAGE " [-s max_message_size] [-f sync_window_us|off] [-q delivery_workers|off]"
 
 #define CRLF "\r\n"
 #define SP " "
 
+struct smtp_session {
+  arena_t arena; // memory freed when the session ends
+  arena_t transaction; // memory freed when the mail transaction ends
+  out_buffer_t out;
+  int session_state; // 1 - initialized, 0 - not initialized
+  int transaction_state; // 1 - MAIL ACCPETED, 2 - RCPT ACCEPTED
+  int in_data; // 1 - receiving message contents after DATA
+  user_list_t user_list; // allocated from the transaction arena
+  const char *pending_rcpt[RCPT_BATCH_SIZE]; // recipients not yet looked up, in the transaction arena
+  unsigned int pending_count;
+  char spool_file[16];
+  int spool_fd;
+  char *spool_buf; // contents not yet written to the spool file
+  size_t spool_len;
+  off_t spool_offset; // bytes of the spool file written or being written
+  char *spool_writing; // contents being written with io_uring, NULL if not used
+  size_t spool_writing_len; // bytes being written, 0 if no write is pending
+  struct uring_op spool_write;
+  size_t message_size; // bytes of message contents received so far
+  int at_line_start; // 1 - next line received starts a new line
+  int spool_failed; // 1 - spool file could not be written
+};
+
+// Maximum size of a message, 0 if unlimited
+static size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+
+// Time waited for more deliveries before syncing them, -1 if
+// deliveries are not synced before they are accepted
+static long sync_window = GROUP_COMMIT_DEFAULT_WINDOW;
+
+// Number of processes delivering queued messages, 0 if messages are
+// delivered before they are accepted
+static long delivery_workers = MAIL_QUEUE_DEFAULT_WORKERS;
+
+// Replies sent as they are. Those including the host name or the
+// configuration are formatted at startup, by format_replies.
+enum { REPLY_READY, REPLY_HELO, REPLY_EHLO, REPLY_QUIT, REPLY_TIMEOUT,
+       REPLY_OK, REPLY_DATA_START, REPLY_BAD_SEQUENCE, REPLY_INVALID, REPLY_INVALID_ARG,
+       REPLY_USER_NOT_LOCAL, REPLY_USER_DOES_NOT_EXIST, REPLY_SIZE_EXCEEDED,
+       REPLY_LOCAL_ERROR, REPLY_QUEUE_FULL, REPLY_COUNT };
+static struct static_reply replies[REPLY_COUNT] = {
+  [REPLY_OK]                  = STATIC_REPLY(OK " OK" CRLF),
+  [REPLY_DATA_START]          = STATIC_REPLY(DATA_START " Start mail input; end with ." CRLF),
+  [REPLY_BAD_SEQUENCE]        = STATIC_REPLY(BAD_SEQUENCE " BAD_SEQUENCE" CRLF),
+  [REPLY_INVALID]             = STATIC_REPLY(INVALID CRLF),
+  [REPLY_INVALID_ARG]         = STATIC_REPLY(INVALID_ARG " Invalid argument" CRLF),
+  [REPLY_USER_NOT_LOCAL]      = STATIC_REPLY(USER_NOT_LOCAL " User not local" CRLF),
+  [REPLY_USER_DOES_NOT_EXIST] = STATIC_REPLY(USER_DOES_NOT_EXIST " User does not exist" CRLF),
+  [REPLY_SIZE_EXCEEDED]       = STATIC_REPLY(SIZE_EXCEEDED
+					     " Message size exceeds fixed maximum message size" CRLF),
+  [REPLY_LOCAL_ERROR]         = STATIC_REPLY(LOCAL_ERROR " Local error in processing" CRLF),
+  [REPLY_QUEUE_FULL]          = STATIC_REPLY(LOCAL_ERROR
+					     " Too many messages queued, try again later" CRLF),
+};
+
 static void handle_client(int fd);
+static void format_replies(void);
+static int deliver_message(const char *file, user_list_t users);
+static void *smtp_session_open(out_buffer_t out);
+static int smtp_session_line(void *session, char *line, int len);
+static void smtp_session_close(void *session);
+static int smtp_session_data(void *session, char *data, int len);
+static void smtp_session_flush(void *session);
+static unsigned int smtp_session_timeout(void *session);
+static void smtp_session_expire(void *session);
+
+static const struct session_handler smtp_handler = {
+  smtp_session_open, smtp_session_line, smtp_session_close, smtp_session_data,
+  smtp_session_flush, smtp_session_timeout, smtp_session_expire
+};
 
 int main(int argc, char *argv[]) {
   
-  if (argc != 2) {
-    fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+  struct server_config config;
+  int opt;
+  
+  server_config_init(&config);
+  while ((opt = getopt(argc, argv, SMTP_OPTIONS)) != -1) {
+    int rv = server_config_option(&config, opt, optarg);
+    if (rv == 0 && opt == 's') {
+      char *end;
+      max_message_size = strtoul(optarg, &end, 10);
+      rv = *optarg && !*end ? 1 : -1;
+    } else if (rv == 0 && opt == 'f') {
+      char *end;
+      sync_window = strcasecmp(optarg, "off") ? strtol(optarg, &end, 10) : -1;
+      rv = sync_window == -1 || (*optarg && !*end && sync_window >= 0) ? 1 : -1;
+    } else if (rv == 0 && opt == 'q') {
+      char *end;
+      delivery_workers = strcasecmp(optarg, "off") ? strtol(optarg, &end, 10) : 0;
+      rv = !strcasecmp(optarg, "off") || (*optarg && !*end && delivery_workers >= 0) ? 1 : -1;
+    }
+    if (rv != 1) {
+      fprintf(stderr, "Invalid arguments. Expected: %s " SMTP_USAGE " <port>\n", argv[0]);
+      return 1;
+    }
+  }
+  
+  if (argc != optind + 1) {
+    fprintf(stderr, "Invalid arguments. Expected: %s " SMTP_USAGE " <port>\n", argv[0]);
     return 1;
   }
   
-  run_server(argv[1], handle_client);
+  config.port = argv[optind];
+  if (metrics_open(METRICS_FILE, op_names, OP_COUNT) < 0)
+    perror(METRICS_FILE);
+  if (config.trace_sample && trace_open(TRACE_FILE, config.trace_sample) < 0)
+    perror(TRACE_FILE);
+  // messages are spooled and queued under the current directory, and
+  // stored in the shards of the mail storage, which may be mounted
+  // from other filesystems
+  const char *sync_paths[MAIL_STORE_MAX_SHARDS + 1] = { "." };
+  unsigned int sync_count = 1 + get_mail_store_roots(sync_paths + 1, MAIL_STORE_MAX_SHARDS);
+  if (sync_window >= 0 && group_commit_init(sync_paths, sync_count, sync_window) < 0)
+    perror("group commit");
+  if (mail_queue_init(delivery_workers, deliver_message) < 0)
+    perror("mail queue");
+  load_user_directory();
+  format_replies();
+  run_configured_server(&config, handle_client, &smtp_handler, MAX_LINE_LENGTH);
   
   return 0;
 }
 
-int is_prefix(char* prefix, char* s) {
-  return strncasecmp(prefix, s, strlen(prefix));
-}
+/** Formats the replies that include the host name (taken once, at
+ *  startup) or the configuration, so every reply is sent as is.
+ */
+static void format_replies(void) {
 
-int is_command_supported(char* command) {
-  return 
-    strcasecmp(command, HELO) == 0 ||
-    strcasecmp(command, EHLO) == 0 ||
-    is_prefix(MAIL, command) == 0 ||
-    is_prefix(RCPT, command) == 0 ||
-    strcasecmp(command, DATA) == 0 ||
-    strcasecmp(command, RSET) == 0 ||
-    is_prefix(VRFY, command) == 0 ||
-    strcasecmp(command, NOOP) == 0 ||
-    strcasecmp(command, QUIT) == 0 ||
-    strcasecmp("\n", command) == 0;
+  struct utsname my_uname;
+  uname(&my_uname);
+  const char *host = my_uname.nodename;
+
+  static_reply_format(&replies[REPLY_READY], "%s %s Simple Mail Transfer Service Ready\r\n",
+		      SERVER_READY, host);
+  static_reply_format(&replies[REPLY_HELO], "%s %s\r\n", OK, host);
+  static_reply_format(&replies[REPLY_EHLO], "%s-%s\r\n%s-PIPELINING\r\n%s-SIZE %zu\r\n%s 8BITMIME\r\n",
+		      OK, host, OK, OK, max_message_size, OK);
+  static_reply_format(&replies[REPLY_QUIT], "%s %s Service closing transmission channel\r\n",
+		      QUIT_CODE, host);
+  static_reply_format(&replies[REPLY_TIMEOUT],
+		      "%s %s Timeout waiting for client input, closing transmission channel\r\n",
+		      SERVICE_UNAVAILABLE, host);
 }
 
-void send_ready_message(int fd, net_buffer_t nb, struct utsname my_uname) {
+void send_ready_message(out_buffer_t out) {
   // welcome message
-  send_formatted(fd, "%s %s Simple Mail Transfer Service Ready\r\n", SERVER_READY, my_uname.nodename);
+  send_static(out, &replies[REPLY_READY]);
 }
 
-void handle_HELO(int fd, net_buffer_t nb, struct utsname my_uname) {
-  send_formatted(fd, "%s %s\r\n", OK, my_uname.nodename);
+/** Returns the message size declared in the SIZE parameter of a MAIL
+ *  command, or 0 if the parameter is not present.
+ */
+size_t get_size_parameter(const struct command *cmd) {
+  for (int i = 1; i < cmd->arg_count && i < COMMAND_MAX_ARGS; i++) {
+    if (strncasecmp(cmd->args[i].ptr, "SIZE=", 5) == 0)
+      return strtoul(cmd->args[i].ptr + 5, NULL, 10);
+  }
+  return 0;
 }
 
-char* get_client(int fd, char* command, int for_mail) {
-  if (strchr(command, ' ') == NULL) {
+/** Returns the mailbox in the path of a MAIL or RCPT command (e.g.,
+ *  "FROM:<user@example.com>" for MAIL), null-terminated in place, or
+ *  NULL if the path is missing or invalid. A space between the colon
+ *  and the path is tolerated.
+ *
+ *  Parameters: cmd: MAIL or RCPT command.
+ *              keyword: Keyword before the colon ("FROM" or "TO").
+ */
+char* get_path(const struct command *cmd, const char *keyword) {
+
+  size_t keyword_len = strlen(keyword);
+  char *path = cmd->args[0].ptr;
+  size_t len = cmd->args[0].len;
+
+  if (len <= keyword_len || strncasecmp(path, keyword, keyword_len) != 0 ||
+      path[keyword_len] != ':')
     return NULL;
-  }
 
-  char* token = strtok(command, " ");
-  token = strtok(NULL, " ");
+  path += keyword_len + 1;
+  len -= keyword_len + 1;
+  if (len == 0 && cmd->arg_count > 1) {
+    path = cmd->args[1].ptr;
+    len = cmd->args[1].len;
+  }
 
-  if (token == NULL || strchr(token, ':') == NULL) {
+  if (len < 3 || path[0] != '<' || path[len - 1] != '>' || !memchr(path, '@', len))
     return NULL;
+
+  path[len - 1] = '\0';
+  return path + 1;
+}
+
+void send_OK(out_buffer_t out) {
+  send_static(out, &replies[REPLY_OK]);
+}
+
+void send_BAD_SEQUENCE(out_buffer_t out) {
+  send_static(out, &replies[REPLY_BAD_SEQUENCE]);
+}
+
+/** Internal function that writes message contents to the spool file
+ *  at a given offset, marking the message as failed if it cannot be
+ *  written.
+ */
+static void write_spool_file(struct smtp_session *s, const char *p, size_t len, off_t offset) {
+
+  while (!s->spool_failed && len > 0) {
+    ssize_t rv = pwrite(s->spool_fd, p, len, offset);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0) {
+      s->spool_failed = 1;
+      break;
+    }
+    p += rv;
+    len -= rv;
+    offset += rv;
+  }
+}
+
+/** Waits for the pending io_uring write of the spool file, if any,
+ *  completing it with blocking writes if it was short.
+ */
+static void wait_spool(struct smtp_session *s) {
+
+  if (!s->spool_writing_len)
+    return;
+  int rv = uring_wait(&s->spool_write);
+  size_t len = s->spool_writing_len;
+  s->spool_writing_len = 0;
+  if (rv < 0)
+    s->spool_failed = 1;
+  else if ((size_t) rv < len)
+    write_spool_file(s, s->spool_writing + rv, len - rv, s->spool_offset - len + rv);
+}
+
+/** Resets the mail transaction of a session, discarding the
+ *  recipient list and any partially received message.
+ */
+static void reset_transaction(struct smtp_session *s) {
+
+  arena_reset(s->transaction);
+  s->user_list = create_user_list();
+  s->pending_count = 0;
+  s->transaction_state = 0;
+  s->in_data = 0;
+  if (s->spool_fd >= 0) {
+    wait_spool(s);
+    close(s->spool_fd);
+    unlink(s->spool_file);
+    s->spool_fd = -1;
   }
+}
 
-  if (for_mail == 1) {
-    if (is_prefix("FROM", token) != 0) {
-      return NULL;
+/** Writes the buffered message contents to the spool file. If the
+ *  file cannot be written, the message is marked as failed, and will
+ *  not be delivered.
+ *
+ *  With io_uring, the write is only queued, and the buffers are
+ *  swapped, so the next contents are received while the previous ones
+ *  are written; wait_spool must be called before the file is used.
+ */
+static void flush_spool(struct smtp_session *s) {
+
+  wait_spool(s);
+  if (!s->spool_failed && s->spool_len > 0) {
+    if (s->spool_writing &&
+	uring_write(s->spool_fd, s->spool_buf, s->spool_len, s->spool_offset, &s->spool_write) == 0) {
+      uring_submit();
+      char *next = s->spool_writing;
+      s->spool_writing = s->spool_buf;
+      s->spool_writing_len = s->spool_len;
+      s->spool_buf = next;
+    } else {
+      write_spool_file(s, s->spool_buf, s->spool_len, s->spool_offset);
     }
+    s->spool_offset += s->spool_len;
+  }
+  s->spool_len = 0;
+}
+
+/** Adds message contents to the spool buffer, writing the buffer to
+ *  the spool file once it is full. Contents are discarded if the
+ *  message is already over the maximum size or failed.
+ */
+static void write_spool(struct smtp_session *s, const char *data, size_t len) {
+
+  if (s->spool_failed ||
+      (max_message_size && s->message_size > max_message_size))
+    return;
+
+  if (s->spool_len + len > SPOOL_BUFFER_SIZE)
+    flush_spool(s);
+  memcpy(s->spool_buf + s->spool_len, data, len);
+  s->spool_len += len;
+}
+
+/** Delivers a message to all its recipients. Called by the delivery
+ *  workers for queued messages (see mailqueue.c), or directly if the
+ *  message cannot be queued.
+ *
+ *  Returns: 0 if the message was delivered to every recipient, -1
+ *           otherwise.
+ */
+static int deliver_message(const char *file, user_list_t users) {
+  uint64_t start = metrics_now();
+  int rv = save_user_mail(file, users);
+  metrics_op(OP_DELIVER, start);
+  return rv;
+}
+
+/** Handles the end of the message contents, queueing the message for
+ *  delivery to all recipients (or delivering it directly, if it
+ *  cannot be queued), unless it could not be spooled. If the queue
+ *  is full, the message is refused with a temporary error, so the
+ *  client retries once the queue is drained; the same is done if
+ *  the message cannot be delivered directly. The reply is held until
+ *  the message is on disk (see groupcommit.c), so a message is never
+ *  accepted before it is safely stored, and replaced with a temporary
+ *  error if the sync fails.
+ */
+static void end_data(struct smtp_session *s) {
+
+  int queued = -1;
+  flush_spool(s);
+  wait_spool(s);
+  if (max_message_size && s->message_size > max_message_size) {
+    send_static(s->out, &replies[REPLY_SIZE_EXCEEDED]);
+  } else if (s->spool_failed) {
+    send_static(s->out, &replies[REPLY_LOCAL_ERROR]);
+  } else if ((queued = mail_queue_add(s->spool_file, s->user_list)) < 0 && errno == EAGAIN) {
+    send_static(s->out, &replies[REPLY_QUEUE_FULL]);
+  } else if (queued < 0 && deliver_message(s->spool_file, s->user_list) < 0) {
+    send_static(s->out, &replies[REPLY_LOCAL_ERROR]);
   } else {
-    if (is_prefix("TO", token) != 0) {
-      return NULL;
+    send_committed(s->out, group_commit_request(), &replies[REPLY_OK],
+		   &replies[REPLY_LOCAL_ERROR]);
+  }
+  reset_transaction(s);
+}
+
+/** Handles a block of message contents received after DATA, made of
+ *  any number of lines (or parts of lines). The message is written to
+ *  a spool file as it is received, with the dot-stuffing removed
+ *  (messages are stored as they were before transmission, and
+ *  stuffed again when retrieved), and delivered once the terminating
+ *  line is found. Only lines starting with a dot are examined (see
+ *  textscan_line_dot); everything else is spooled unchanged.
+ *
+ *  Returns: The number of bytes consumed, which is less than len if
+ *           the block ends with a line that may be the terminating
+ *           line, but is not complete, or if the terminating line was
+ *           found (the bytes following it are commands).
+ */
+static int handle_data_block(struct smtp_session *s, char *data, int len) {
+
+  char *p = data, *end = data + len;
+  while (p < end) {
+    char *dot = (char *) textscan_line_dot(p, end, s->at_line_start ? '\n' : 0);
+    if (dot > p) {
+      s->message_size += dot - p;
+      write_spool(s, p, dot - p);
+      s->at_line_start = dot[-1] == '\n';
+      p = dot;
+    }
+    if (dot == end)
+      break;
+
+    // a line starting with a dot is either the end of the contents,
+    // or dot-stuffed
+    if (end - dot < 2 || (dot[1] == '\r' && end - dot < 3))
+      break;
+    if (dot[1] == '\n' || (dot[1] == '\r' && dot[2] == '\n')) {
+      end_data(s);
+      return dot + (dot[1] == '\n' ? 2 : 3) - data;
     }
+    s->at_line_start = 0;
+    p = dot + 1;
   }
-  
-  
-  token = strtok(token, ":");
-  token = strtok(NULL, ":");
+  return p - data;
+}
 
-  if (strchr(token, '<') == NULL) {
-    return NULL;
+static int handle_HELO(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  send_static(s->out, &replies[REPLY_HELO]);
+  s->session_state = 1;
+  return 0;
+}
+
+/** Replies to EHLO, listing the supported service extensions: command
+ *  pipelining (RFC 2920), message size declaration (RFC 1870) and
+ *  8-bit MIME transport (RFC 6152).
+ */
+static int handle_EHLO(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  send_static(s->out, &replies[REPLY_EHLO]);
+  s->session_state = 1;
+  return 0;
+}
+
+static int handle_MAIL(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  if (s->session_state != 1) {
+    send_BAD_SEQUENCE(s->out);
+    return 0;
   }
 
-  token = strtok(token, "<");
+  size_t declared_size = get_size_parameter(cmd);
+  char* sender = get_path(cmd, "FROM");
+  if (sender == NULL) {
+    send_static(s->out, &replies[REPLY_INVALID_ARG]);
+  } else if (max_message_size && declared_size > max_message_size) {
+    send_static(s->out, &replies[REPLY_SIZE_EXCEEDED]);
+  } else {
+    s->transaction_state = 1;
+    send_OK(s->out);
+  }
+  return 0;
+}
 
-  if (strchr(token, '@') == NULL) {
-    return NULL;
+/** Looks up the recipients of the RCPT commands not yet replied to,
+ *  all at once, and sends their replies, in the order the commands
+ *  were received. Must be called before any other reply is sent.
+ */
+static void resolve_recipients(struct smtp_session *s) {
+
+  int valid[RCPT_BATCH_SIZE];
+  if (!s->pending_count)
+    return;
+
+  check_valid_users(s->pending_rcpt, s->pending_count, valid);
+  for (unsigned int i = 0; i < s->pending_count; i++) {
+    if (valid[i]) {
+      add_user_to_arena_list(&s->user_list, s->pending_rcpt[i], s->transaction);
+      s->transaction_state = 2;
+      send_OK(s->out);
+    } else {
+      send_static(s->out, &replies[REPLY_USER_NOT_LOCAL]);
+    }
   }
+  s->pending_count = 0;
+}
 
-  if (token[strlen(token) - 1] != '>') {
-    return NULL;
+/** Handles a RCPT command. The recipient is not looked up right away:
+ *  recipients of pipelined commands are looked up together, once no
+ *  more commands were received or a command other than RCPT is
+ *  (see resolve_recipients).
+ */
+static int handle_RCPT(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  if ((s->transaction_state != 1 && s->transaction_state != 2) || s->session_state == 0) {
+    resolve_recipients(s);
+    send_BAD_SEQUENCE(s->out);
+    return 0;
   }
 
-  token[strlen(token) - 1] = '\0';
-  return token;
+  char* recipient = get_path(cmd, "TO");
+  if (recipient == NULL) {
+    resolve_recipients(s);
+    send_static(s->out, &replies[REPLY_INVALID_ARG]);
+    return 0;
+  }
+
+  if (s->pending_count == RCPT_BATCH_SIZE)
+    resolve_recipients(s);
+  s->pending_rcpt[s->pending_count++] = arena_strdup(s->transaction, recipient);
+  return 0;
 }
 
-void send_OK(int fd) {
-  send_formatted(fd, "%s OK\r\n", OK);  
+/** Handles a DATA command, creating the spool file that will hold
+ *  the message contents.
+ */
+static int handle_DATA(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  if (s->session_state == 0 || s->transaction_state != 2) {
+    send_BAD_SEQUENCE(s->out);
+    return 0;
+  }
+
+  strcpy(s->spool_file, "tmpXXXXXX");
+  s->spool_fd = mkstemp(s->spool_file);
+  if (s->spool_fd < 0) {
+    send_static(s->out, &replies[REPLY_LOCAL_ERROR]);
+    return 0;
+  }
+
+  // the spool buffer is kept for the following transactions
+  if (!s->spool_buf) {
+    s->spool_buf = arena_alloc(s->arena, SPOOL_BUFFER_SIZE);
+    if (uring_available())
+      s->spool_writing = arena_alloc(s->arena, SPOOL_BUFFER_SIZE);
+  }
+  s->spool_len = 0;
+  s->spool_offset = 0;
+  s->message_size = 0;
+  s->at_line_start = 1;
+  s->spool_failed = 0;
+  s->in_data = 1;
+  send_static(s->out, &replies[REPLY_DATA_START]);
+  return 0;
 }
 
-void send_BAD_SEQUENCE(int fd) {
-  send_formatted(fd, "%s BAD_SEQUENCE\r\n", BAD_SEQUENCE);  
+static int handle_RSET(void *session, const struct command *cmd) {
+
+  struct smtp_session *s = session;
+  reset_transaction(s);
+  send_OK(s->out);
+  return 0;
 }
 
-void handle_client(int fd) {
-  
-  char recvbuf[MAX_LINE_LENGTH + 1];
-  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
-  int session_state = 0; // 1 - initialized, 0 - not initialized
-  int transaction_state = 0; // 1 - MAIL ACCPETED, 2 - RCPT ACCEPTED
+static int handle_VRFY(void *session, const struct command *cmd) {
 
-  struct utsname my_uname;
-  uname(&my_uname);
-  
-  /* recipient BE COMPLETED BY THE STUDENT */
-  char* sender;
-  user_list_t user_list = create_user_list();
+  struct smtp_session *s = session;
+  if (is_valid_user(cmd->args[0].ptr, NULL)) {
+    send_OK(s->out);
+  } else {
+    send_static(s->out, &replies[REPLY_USER_DOES_NOT_EXIST]);
+  }
+  return 0;
+}
 
-  send_ready_message(fd, nb, my_uname);
+static int handle_NOOP(void *session, const struct command *cmd) {
 
-  while (1) {
-    char* command;
-    int result = nb_read_line(nb, recvbuf);
+  struct smtp_session *s = session;
+  send_OK(s->out);
+  return 0;
+}
 
-    if (result <= 0) {
-      nb_destroy(nb);
-      destroy_user_list(user_list);
-      return;
-    }
+static int handle_QUIT(void *session, const struct command *cmd) {
 
-    command = recvbuf;
-    if (strlen(command) >= 4) {
-      command = strtok(command, CRLF);
-    }
+  struct smtp_session *s = session;
+  send_static(s->out, &replies[REPLY_QUIT]);
+  return 1;
+}
 
-    // if (!is_command_supported(command)) {
-    //   send_formatted(fd, "%s\r\n", UNSUPPORTED);
-    //   break;
-    // }  
-    if (is_prefix(HELO, command) == 0 || is_prefix(EHLO, command) == 0) {
-    
-      handle_HELO(fd, nb, my_uname);
-      session_state = 1;
-
-    } else if (is_prefix(MAIL, command) == 0) {
-
-      if (session_state == 1) {
-        sender = get_client(fd, command, 1);
-        
-        if (sender == NULL || strlen(sender) == 0) {
-          send_formatted(fd, "%s Invalid argument\r\n", INVALID_ARG);
-        } else {
-          transaction_state = 1;
-          send_OK(fd); 
-        }
-        
-      } else {
-        send_BAD_SEQUENCE(fd);
-      }
-        
-    } else if (is_prefix(RCPT, command) == 0) {
-
-      if ((transaction_state != 1 && transaction_state != 2) || session_state == 0 ) {
-        send_BAD_SEQUENCE(fd);
-      } else {
-        char* recipient = get_client(fd, command, 0);
-        if (recipient == NULL) {
-          send_formatted(fd, "%s Invalid argument\r\n", INVALID_ARG);
-        } else {
-          if (is_valid_user(recipient, NULL)) {
-            add_user_to_list(&user_list, recipient);
-            transaction_state = 2;
-            send_OK(fd);  
-          } else {
-            send_formatted(fd, "%s User not local\r\n", USER_NOT_LOCAL);
-          }
-        }
-
-      }        
-    } else if (strcasecmp(command, DATA) == 0) {
-
-      if (session_state == 0 || transaction_state != 2) {
-        send_BAD_SEQUENCE(fd);
-      }
-
-      send_formatted(fd, "%s Start mail input; end with .\r\n", DATA_START);
-      result = nb_read_line(nb, recvbuf);
-      
-      char text_buffer[MAX_LINE_LENGTH + 1][MAX_LINE_LENGTH + 1];
-      int idx = 0;
-
-      char* line;
-      line = recvbuf;
-
-      while (idx <= MAX_LINE_LENGTH && result > 0 && strcmp(line, ".\r\n") != 0) {  
-        strcpy(text_buffer[idx], recvbuf);
-
-        result = nb_read_line(nb, recvbuf);
-        line = recvbuf;
-        idx += 1;
-      }
-
-      char template[] = "tmpXXXXXX";
-      int f = mkstemp(template);
-      FILE* tmp = fdopen(f, "wb");
-      
-      for (int i = 0; i < MAX_LINE_LENGTH; i++) {
-        write(f, text_buffer[i], strlen(text_buffer[i]));
-      }
-
-      // char* termination = ".\r\n";
-      // fputs(termination, tmp);
-
-      save_user_mail(template, user_list);
-      unlink(template);
-      fclose(tmp);
-      
-      transaction_state = 0;
-      send_OK(fd);  
-
-    } else if (strcasecmp(command, RSET) == 0) {
-      
-      sender = NULL;
-      destroy_user_list(user_list);
-      user_list = create_user_list();
-      transaction_state = 0;
-
-      send_OK(fd);
-
-    } else if ((is_prefix(VRFY, command) == 0)) {
-
-      if (strchr(command, ' ') == NULL) {
-        send_formatted(fd, "%s Invalid argument\r\n", INVALID_ARG);
-      } else {
-        char* username = strtok(command, " ");
-        username = strtok(NULL, " ");
-
-        if (is_valid_user(username, NULL)) {
-          send_OK(fd);
-        } else {
-          send_formatted(fd, "%s User does not exist\r\n", USER_DOES_NOT_EXIST);
-        }
-      }
-
-    } else if (strcasecmp(command, QUIT) == 0) {
-      
-      send_formatted(fd, "%s %s Service closing transmission channel\r\n", QUIT_CODE, my_uname.nodename);
-      break;
+// Commands, in the same order as their operations in op_names
+static const struct command_entry smtp_commands[OP_UNKNOWN] = {
+  [OP_HELO] = { COMMAND_VERB('H','E','L','O'), 0, COMMAND_ANY_ARGS, handle_HELO },
+  [OP_EHLO] = { COMMAND_VERB('E','H','L','O'), 0, COMMAND_ANY_ARGS, handle_EHLO },
+  [OP_MAIL] = { COMMAND_VERB('M','A','I','L'), 1, COMMAND_ANY_ARGS, handle_MAIL },
+  [OP_RCPT] = { COMMAND_VERB('R','C','P','T'), 1, COMMAND_ANY_ARGS, handle_RCPT },
+  [OP_DATA] = { COMMAND_VERB('D','A','T','A'), 0, 0, handle_DATA },
+  [OP_RSET] = { COMMAND_VERB('R','S','E','T'), 0, 0, handle_RSET },
+  [OP_VRFY] = { COMMAND_VERB('V','R','F','Y'), 1, COMMAND_ANY_ARGS, handle_VRFY },
+  [OP_NOOP] = { COMMAND_VERB('N','O','O','P'), 0, COMMAND_ANY_ARGS, handle_NOOP },
+  [OP_QUIT] = { COMMAND_VERB('Q','U','I','T'), 0, 0, handle_QUIT },
+};
+
+/** Starts a new SMTP session on a newly accepted connection, sending
+ *  the welcome message.
+ *
+ *  Parameters: out: Output buffer for the connection.
+ *
+ *  Returns: Session object to be passed to smtp_session_line.
+ */
+static void *smtp_session_open(out_buffer_t out) {
+
+  arena_t arena = arena_create(SESSION_ARENA_SIZE);
+  struct smtp_session *s = arena_alloc(arena, sizeof(struct smtp_session));
+  s->arena = arena;
+  s->transaction = arena_create(TRANSACTION_ARENA_SIZE);
+  s->out = out;
+  s->session_state = 0;
+  s->transaction_state = 0;
+  s->in_data = 0;
+  s->user_list = create_user_list();
+  s->pending_count = 0;
+  s->spool_fd = -1;
+  s->spool_buf = NULL;
+  s->spool_writing = NULL;
+  s->spool_writing_len = 0;
+
+  send_ready_message(out);
+  return s;
+}
 
-    } else if (is_prefix(NOOP, command) == 0) {
+/** Processes the data received from the client while it sends
+ *  message contents, in blocks of whatever was received so far.
+ *
+ *  Returns: The number of bytes consumed, or -1 if the session is
+ *           receiving commands, which are processed one line at a time
+ *           by smtp_session_line.
+ */
+static int smtp_session_data(void *session, char *data, int len) {
+
+  struct smtp_session *s = session;
+  if (!s->in_data)
+    return -1;
+  return handle_data_block(s, data, len);
+}
 
-      send_OK(fd);
+/** Processes a single line received from the client, either part of
+ *  the message contents during DATA, or a command, which is
+ *  dispatched to its handler in smtp_commands. The time each command
+ *  takes is recorded; lines of message contents are not measured
+ *  individually.
+ *
+ *  Parameters: session: Session object returned by smtp_session_open.
+ *              recvbuf: Null-terminated line, including the line
+ *                       terminator. May be modified.
+ *              len: Number of bytes in the line.
+ *
+ *  Returns: Non-zero if the connection should be closed.
+ */
+static int smtp_session_line(void *session, char *recvbuf, int len) {
+
+  struct smtp_session *s = session;
+  struct command cmd;
+  int rv = 0;
+
+  if (s->in_data) {
+    handle_data_block(s, recvbuf, len);
+    return 0;
+  }
 
-    } else {
-      send_formatted(fd, "%s\r\n", INVALID);
-    }
+  uint64_t start = metrics_now();
+  command_parse(recvbuf, len, &cmd);
+  int op = command_find(smtp_commands, OP_UNKNOWN, &cmd);
+  // replies held for RCPT commands go before the reply to any other one
+  if (op != OP_RCPT || !command_args_valid(&smtp_commands[op], &cmd))
+    resolve_recipients(s);
+  if (op < 0) {
+    op = OP_UNKNOWN;
+    send_static(s->out, &replies[REPLY_INVALID]);
+  } else if (!command_args_valid(&smtp_commands[op], &cmd)) {
+    send_static(s->out, &replies[REPLY_INVALID_ARG]);
+  } else {
+    rv = smtp_commands[op].handler(s, &cmd);
   }
-  
-  nb_destroy(nb);
-  return;
+  metrics_op(op, start);
+  return rv;
+}
+
+/** Ends an SMTP session, discarding any incomplete transaction.
+ *
+ *  Parameters: session: Session object returned by smtp_session_open.
+ */
+static void smtp_session_close(void *session) {
+
+  struct smtp_session *s = session;
+  reset_transaction(s);
+  arena_destroy(s->transaction);
+  arena_destroy(s->arena); // also frees the session
 }
 
+/** Sends the replies held for pipelined RCPT commands, once all
+ *  commands received so far are processed.
+ *
+ *  Parameters: session: Session object returned by smtp_session_open.
+ */
+static void smtp_session_flush(void *session) {
+  resolve_recipients(session);
+}
 
+/** Returns how long the session waits for the client: for a block
+ *  of message contents during DATA, or for the next command.
+ *
+ *  Parameters: session: Session object returned by smtp_session_open.
+ *
+ *  Returns: The timeout, in milliseconds.
+ */
+static unsigned int smtp_session_timeout(void *session) {
+
+  struct smtp_session *s = session;
+  return s->in_data ? DATA_BLOCK_TIMEOUT : COMMAND_TIMEOUT;
+}
 
+/** Tells the client that the session timed out, before the
+ *  connection is closed. Any incomplete transaction is discarded when
+ *  the session is closed.
+ *
+ *  Parameters: session: Session object returned by smtp_session_open.
+ */
+static void smtp_session_expire(void *session) {
 
+  struct smtp_session *s = session;
+  send_static(s->out, &replies[REPLY_TIMEOUT]);
+}
 
+void handle_client(int fd) {
+  
+  char *line;
+  int result = 0;
+  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+  out_buffer_t out = ob_create(fd, OUT_BUFFER_SIZE);
+  void *session = smtp_session_open(out);
+
+  nb_set_timeout(nb, session_timeout(&smtp_handler, session));
+  while (1) {
+    // Message contents are processed in blocks of all the data
+    // received so far, and are waited for once the block is consumed
+    result = nb_peek_data(nb, &line);
+    int used = smtp_session_data(session, line, result);
+    if (used > 0) {
+      nb_consume(nb, used);
+      nb_set_timeout(nb, session_timeout(&smtp_handler, session));
+      continue;
+    }
+    if (used == 0) {
+      if (ob_flush(out) < 0 || (result = nb_peek_line(nb, &line)) <= 0)
+	break;
+      continue;
+    }
+
+    // Commands already received are processed before replies are
+    // sent, so the replies to pipelined commands are sent together
+    result = nb_peek_next_line(nb, &line);
+    if (result == 0) {
+      smtp_session_flush(session);
+      if (ob_flush(out) < 0)
+        break;
+      result = nb_peek_line(nb, &line);
+    }
+
+    if (result <= 0 || smtp_session_line(session, line, result))
+      break;
+    nb_consume(nb, result);
+    nb_set_timeout(nb, session_timeout(&smtp_handler, session));
+  }
+
+  if (result < 0 && errno == ETIMEDOUT)
+    smtp_session_expire(session);
+  smtp_session_close(session);
+  ob_flush(out);
+  ob_destroy(out);
+  nb_destroy(nb);
+}
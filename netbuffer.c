@@ -6,16 +6,25 @@
  */
 
 #include "netbuffer.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 struct net_buffer {
   int    fd;
   size_t max_bytes;
-  size_t avail_data;
+  size_t start;       // offset of the first byte of data in buf
+  size_t avail_data;  // bytes of data, starting at buf[start]
+  size_t term_pos;    // offset of the null byte added by a peek, if any
+  char   term_saved;  // byte replaced by the null byte
+  int    terminated;  // set if a peeked line is null-terminated in place
+  uint64_t deadline;  // time (in microseconds) nb_peek_line gives up waiting, 0 if none
   // Buffer set as size zero, but since it's the last member of the
   // struct, it is possible to malloc additional memory after this
   // struct to be used as part of the buffer (e.g., nb->buf[5] will
@@ -40,10 +49,14 @@ struct net_buffer {
  */
 net_buffer_t nb_create(int fd, size_t max_buffer_size) {
 
-  net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+  // one extra byte is allocated for the null byte after a full buffer
+  net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size + 1);
   nb->fd          = fd;
   nb->max_bytes   = max_buffer_size;
+  nb->start       = 0;
   nb->avail_data  = 0;
+  nb->terminated  = 0;
+  nb->deadline    = 0;
   return nb;
 }
 
@@ -55,6 +68,201 @@ void nb_destroy(net_buffer_t nb) {
   free(nb);
 }
 
+/** Sets how long nb_peek_line may wait for the rest of a line, from
+ *  now on. The time is a deadline for the whole line rather than for
+ *  each recv, so a client sending a line a few bytes at a time cannot
+ *  hold the connection indefinitely. The deadline is usually set
+ *  again after each line is consumed.
+ *
+ *  Parameters: nb: buffer object to be modified.
+ *              timeout_ms: time allowed, in milliseconds, or 0 to
+ *                          wait with no limit.
+ */
+void nb_set_timeout(net_buffer_t nb, unsigned int timeout_ms) {
+  nb->deadline = timeout_ms ? metrics_now() + (uint64_t) timeout_ms * 1000 : 0;
+}
+
+/** Internal function that waits until the socket is readable or the
+ *  deadline passes. Returns -1 (with errno set to ETIMEDOUT) if the
+ *  deadline passes first, or 0 otherwise.
+ */
+static int nb_wait(net_buffer_t nb) {
+
+  struct pollfd pfd = { .fd = nb->fd, .events = POLLIN };
+  while (nb->deadline) {
+    uint64_t now = metrics_now();
+    if (now >= nb->deadline)
+      break;
+    int rv = poll(&pfd, 1, (nb->deadline - now + 999) / 1000);
+    if (rv > 0 || (rv < 0 && errno != EINTR))
+      return 0;
+  }
+  if (!nb->deadline)
+    return 0;
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+/** Internal function that restores the byte replaced by the null
+ *  byte of the last peeked line.
+ */
+static void nb_unterminate(net_buffer_t nb) {
+  if (nb->terminated) {
+    nb->buf[nb->term_pos] = nb->term_saved;
+    nb->terminated = 0;
+  }
+}
+
+/** Internal function that makes room for more data at the end of the
+ *  buffer. Data is only moved to the start of the buffer once the
+ *  end of the buffer is reached, so each byte is moved at most once
+ *  per buffer size received, no matter how many lines are read.
+ *
+ *  Returns: The number of bytes that can be received.
+ */
+static size_t nb_make_room(net_buffer_t nb) {
+
+  if (nb->start + nb->avail_data >= nb->max_bytes && nb->start > 0) {
+    memmove(nb->buf, nb->buf + nb->start, nb->avail_data);
+    nb->start = 0;
+  }
+  return nb->max_bytes - nb->start - nb->avail_data;
+}
+
+/** Internal function that returns the length of the first complete
+ *  line in the buffer, i.e., up to and including the first LF, or
+ *  the whole buffer if it is full. Returns 0 if there is no complete
+ *  line.
+ */
+static size_t nb_line_length(net_buffer_t nb) {
+
+  char *eos = memchr(nb->buf + nb->start, '\n', nb->avail_data);
+  if (eos)
+    return eos - (nb->buf + nb->start) + 1;
+  return nb->avail_data >= nb->max_bytes ? nb->max_bytes : 0;
+}
+
+/** Internal function that null-terminates a line of len bytes at the
+ *  start of the data, returning a pointer to it.
+ */
+static char *nb_terminate(net_buffer_t nb, size_t len) {
+
+  nb->term_pos = nb->start + len;
+  nb->term_saved = nb->buf[nb->term_pos];
+  nb->buf[nb->term_pos] = 0;
+  nb->terminated = 1;
+  return nb->buf + nb->start;
+}
+
+/** Returns a single line from the socket/buffer (i.e., a string
+ *  ending in LF, aka "\n"), without copying or removing it from the
+ *  buffer. Receives data from the socket as needed, in the same way
+ *  as nb_read_line. The line remains in the buffer until nb_consume
+ *  is called, so calling this function again returns the same line.
+ *
+ *  The returned line points into the buffer, and is null-terminated
+ *  in place (the byte following the line is restored once the line
+ *  is consumed). The line may be modified by the caller, but is only
+ *  valid until the next call to any other function on the same
+ *  buffer.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             line: set to the start of the line.
+ *
+ *  Returns: If the connection was terminated properly, returns 0. If
+ *           the connection was terminated abruptly or another unknown
+ *           error is found, or the deadline set by nb_set_timeout
+ *           passes (errno set to ETIMEDOUT), returns -1. Otherwise,
+ *           returns the number of bytes in the line, which must be
+ *           passed to nb_consume.
+ */
+int nb_peek_line(net_buffer_t nb, char **line) {
+
+  size_t len;
+  int rv;
+
+  nb_unterminate(nb);
+  while ((len = nb_line_length(nb)) == 0) {
+
+    uint64_t start = TRACE_START();
+    if (nb_wait(nb) < 0)
+      return -1;
+    rv = recv(nb->fd, nb->buf + nb->start + nb->avail_data, nb_make_room(nb), 0);
+    TRACE_SPAN(TRACE_RECV, start);
+    // If recv returns an error, return the same error.
+    if (rv < 0)
+      return rv;
+    // If recv returns 0 (i.e., end of data), return whatever is
+    // available in the buffer.
+    if (rv == 0) {
+      len = nb->avail_data;
+      if (len == 0)
+	return 0;
+      break;
+    }
+    metrics_bytes_in(rv);
+    nb->avail_data += rv;
+  }
+
+  *line = nb_terminate(nb, len);
+  return len;
+}
+
+/** Returns a single line from data already cached in the buffer,
+ *  without reading from the socket. Works like nb_peek_line, except
+ *  that, if the buffer does not yet contain a complete line (and is
+ *  not full), no line is returned.
+ *
+ *  Parameter: nb: buffer object where cache data is stored.
+ *             line: set to the start of the line.
+ *
+ *  Returns: The number of bytes in the line, which must be passed to
+ *           nb_consume, or 0 if no complete line is available in the
+ *           buffer.
+ */
+int nb_peek_next_line(net_buffer_t nb, char **line) {
+
+  nb_unterminate(nb);
+  size_t len = nb_line_length(nb);
+  if (len)
+    *line = nb_terminate(nb, len);
+  return len;
+}
+
+/** Returns all data already cached in the buffer, without reading
+ *  from the socket or splitting it into lines (e.g., to process
+ *  message contents in blocks). The data remains in the buffer until
+ *  nb_consume is called, and is only valid until the next call to
+ *  any other function on the same buffer.
+ *
+ *  Parameter: nb: buffer object where cache data is stored.
+ *             data: set to the start of the data.
+ *
+ *  Returns: The number of bytes available, possibly 0.
+ */
+int nb_peek_data(net_buffer_t nb, char **data) {
+
+  nb_unterminate(nb);
+  *data = nb->buf + nb->start;
+  return nb->avail_data;
+}
+
+/** Removes data from the start of the buffer, usually a line
+ *  returned by nb_peek_line or nb_peek_next_line.
+ *
+ *  Parameter: nb: buffer object where cache data is stored.
+ *             len: number of bytes to remove, no more than the
+ *                  number of bytes available.
+ */
+void nb_consume(net_buffer_t nb, size_t len) {
+
+  nb_unterminate(nb);
+  nb->start += len;
+  nb->avail_data -= len;
+  if (nb->avail_data == 0)
+    nb->start = 0;
+}
+
 /** Reads a single line from the socket/buffer (i.e., a string ending
  *  in LF, aka "\n"). If the socket returns more than one line in a
  *  single call to recv, returns a single line and caches the
@@ -72,6 +280,9 @@ void nb_destroy(net_buffer_t nb) {
  *  byte). The caller may identify the case by checking if the last
  *  character in the string is not LF.
  *
+ *  This function copies the line to out; nb_peek_line can be used
+ *  to access the line in the buffer instead.
+ *
  *  Parameter: nb: buffer object where socket and cache data are stored.
  *             out: array of bytes where the read line will be
  *                  stored. It must have space for at least
@@ -85,39 +296,67 @@ void nb_destroy(net_buffer_t nb) {
  */
 int nb_read_line(net_buffer_t nb, char out[]) {
 
-  char *eos;
-  int rv;
-  // Check if the buffer already has a line-feed character.
-  while ((eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
-
-    // Check if the buffer has space for more data to be received
-    if (nb->avail_data < nb->max_bytes) {
-      rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
-      // If recv returns an error, return the same error.
-      if (rv < 0)
-	return rv;
-      // If recv returns 0 (i.e., end of data), return whatever is
-      // available in the buffer.
-      if (rv == 0) {
-	eos = nb->buf + nb->avail_data - 1;
-	break;
-      }
-      nb->avail_data += rv;
-    } else {
-      // If the buffer is already full, return the full buffer.
-      eos = nb->buf + nb->max_bytes - 1;
-      break;
-    }
+  char *line;
+  int rv = nb_peek_line(nb, &line);
+  if (rv > 0) {
+    memcpy(out, line, rv + 1);
+    nb_consume(nb, rv);
   }
+  return rv;
+}
+
+/** Receives whatever data is immediately available in the socket
+ *  into the buffer, without blocking. This function is used by
+ *  event-driven servers, which only call it once the socket is known
+ *  to be readable, and then use nb_peek_next_line (or nb_next_line)
+ *  to extract the lines that were completed by the new data.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *
+ *  Returns: If the connection was terminated properly, returns 0. If
+ *           no data is available (errno set to EAGAIN or
+ *           EWOULDBLOCK), the connection was terminated abruptly or
+ *           another unknown error is found, returns -1. If the buffer
+ *           is already full, returns the number of bytes in the
+ *           buffer without calling recv. Otherwise, returns the
+ *           number of bytes received.
+ */
+int nb_fill(net_buffer_t nb) {
+
+  nb_unterminate(nb);
+  if (nb->avail_data >= nb->max_bytes)
+    return nb->avail_data;
 
-  // Copy received data from the buffer to the output.
-  rv = eos - nb->buf + 1;
-  memcpy(out, nb->buf, rv);
-  out[rv] = 0;
-  nb->avail_data -= rv;
-  // If the received data contains more than one line, move the
-  // remaining data to the start of the buffer.
-  if (nb->avail_data)
-    memmove(nb->buf, eos + 1, nb->avail_data);
+  int rv = recv(nb->fd, nb->buf + nb->start + nb->avail_data, nb_make_room(nb),
+		MSG_DONTWAIT);
+  if (rv > 0) {
+    metrics_bytes_in(rv);
+    nb->avail_data += rv;
+  }
+  return rv;
+}
+
+/** Extracts a single line from data already cached in the buffer,
+ *  without reading from the socket. Works like nb_read_line, except
+ *  that, if the buffer does not yet contain a complete line (and is
+ *  not full), no data is returned and the partial line is kept in
+ *  the buffer.
+ *
+ *  Parameter: nb: buffer object where cache data is stored.
+ *             out: array of bytes where the read line will be
+ *                  stored, with the same size requirements as
+ *                  nb_read_line.
+ *
+ *  Returns: The number of bytes in the extracted line, or 0 if no
+ *           complete line is available in the buffer.
+ */
+int nb_next_line(net_buffer_t nb, char out[]) {
+
+  char *line;
+  int rv = nb_peek_next_line(nb, &line);
+  if (rv > 0) {
+    memcpy(out, line, rv + 1);
+    nb_consume(nb, rv);
+  }
   return rv;
 }
@@ -10,24 +10,127 @@
  */
 
 #include "server.h"
+#include "netbuffer.h"
+#include "metrics.h"
+#include "groupcommit.h"
+#include "uring.h"
+#include "textscan.h"
+#include "timerwheel.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 
 
-#define BACKLOG 10     // how many pending connections queue will hold
+#define BACKLOG 10           // how many pending connections queue will hold
+#define MAX_EVENTS 64        // how many epoll events are handled per wait call
+#define DEFAULT_POOL_SIZE 16 // how many workers a pool has if not configured
+#define SEND_CHUNK_SIZE 16384 // bytes read at a time when dot-stuffing a file
+#define SEND_TIMEOUT 60      // seconds replies may stay unsent before the connection is dropped
+#define SEND_MIN_RATE 4096   // bytes per second a client must take pending replies at
+
+// File queued to be sent as the data of a multi-line response by a
+// non-blocking output buffer (see send_multiline_file)
+struct out_file {
+  int    fd;     // -1 if no file is queued
+  off_t  offset; // next byte of the file to be sent
+  off_t  end;    // size of the file
+  int    clean;  // 1 if the file is sent as is, 0 if it is dot-stuffed
+  char   prev;   // last byte of the file sent, for dot-stuffing
+  size_t pos;    // bytes of the buffer to be sent before the file
+};
+
+// Reply held in an output buffer for a group commit, replaced if the
+// commit fails (see send_committed)
+struct out_commit {
+  uint64_t                   ticket;
+  size_t                     pos;    // offset of the reply in the buffer
+  const struct static_reply *reply;
+  const struct static_reply *failed; // reply sent instead if the commit fails
+};
+
+struct out_buffer {
+  int    fd;
+  size_t size;     // bytes buffered before data is sent
+  size_t capacity; // bytes allocated, larger than size if non-blocking or a reply was replaced
+  size_t len;      // bytes buffered but not yet sent
+  int    failed;   // set once a send fails; nothing else is sent
+  int    nonblocking; // 1 if data that cannot be sent at once is kept
+  uint64_t commit_ticket; // group commit ticket to wait for before sending, 0 if none
+  struct out_file file;   // file queued in the buffer, if non-blocking
+  struct out_commit *commits; // replies held for group commits, in order
+  unsigned int commit_count;
+  unsigned int commit_capacity;
+  char  *buf;
+};
+
+// State of a connection handled by the event loop
+struct connection {
+  int          fd;
+  net_buffer_t nb;
+  out_buffer_t out;
+  void        *session;
+  uint64_t     started; // time the session started, for metrics
+  int          closing; // 1 if the connection is closed once its replies are sent
+  uint32_t     events;  // EPOLLIN, EPOLLOUT while replies are pending, 0 while they are held
+  int          held;    // 1 while its replies wait for a group commit
+  struct connection *next_held; // next connection in the loop's held list
+  struct event_loop *loop;
+  struct timer       timer;     // closes the connection once the session times out
+  uint32_t           trace;     // traced session id, 0 if the session is not traced
+};
+
+// State of an event loop, shared by all its connections
+struct event_loop {
+  int                           epfd;
+  int                           sockfd;
+  const struct session_handler *session;
+  size_t                        max_line;
+  int                           sessions;     // number of open connections
+  int                           max_sessions; // session limit, 0 for unlimited
+  int                           accepting;    // whether the listener is in epoll
+  struct connection            *held;         // connections with replies held for a commit
+  int                           commit_fd;    // eventfd signalled by the committer, -1 until started
+  pthread_mutex_t               commit_lock;
+  pthread_cond_t                commit_requested;
+  uint64_t                      commit_ticket; // last ticket the committer is asked to sync
+  struct timer_wheel            timers;       // session timeouts of all connections
+};
+
+static void ob_set_nonblocking(out_buffer_t out);
+static int ob_backlogged(out_buffer_t out);
+static size_t ob_pending(out_buffer_t out);
+static int ob_grow(out_buffer_t out, size_t len);
+static int ob_make_room(out_buffer_t out, size_t len);
+static int ob_queue_file(out_buffer_t out, int file_fd, off_t offset, off_t end, int clean);
+
+// Number of forked children still running, updated by sigchld_handler
+static volatile sig_atomic_t active_children = 0;
+
+// Limit on session timeouts, in milliseconds (0 for none), set by
+// run_configured_server
+static unsigned int max_timeout = 0;
 
 /** Signal handler used to destroy zombie children (forked) processes
  *  once they finish executing.
@@ -36,7 +139,12 @@ static void sigchld_handler(int s) {
 
   // waitpid() might overwrite errno, so we save and restore it:
   int saved_errno = errno;
-  while(waitpid(-1, NULL, WNOHANG) > 0);
+  // only sessions, which stay in the process group of the server,
+  // are reaped; other children (e.g., the supervisor of the mail
+  // queue) are left to whoever started them, so their process ids
+  // are not reused before they are seen to exit
+  while(waitpid(0, NULL, WNOHANG) > 0)
+    active_children--;
   errno = saved_errno;
 }
 
@@ -50,29 +158,63 @@ static void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Prints the address of a newly connected client.
+ */
+static void log_connection(struct sockaddr_storage *their_addr) {
+
+  char s[INET6_ADDRSTRLEN];
+  inet_ntop(their_addr->ss_family, get_in_addr((struct sockaddr *)their_addr),
+	    s, sizeof(s));
+  printf("server: got connection from %s\n", s);
+  fflush(stdout);
+  metrics_connection();
+}
+
+/** Limits how long sending to a connection may block, so a client
+ *  that stops reading its replies cannot hold a worker forever. A
+ *  send that times out fails like any other. The event loop never
+ *  blocks in sends, and uses a deadline instead (see send_output).
+ */
+static void set_send_timeout(int fd) {
+  struct timeval tv = { .tv_sec = SEND_TIMEOUT, .tv_usec = 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/** Serves a connection with a blocking handler, recording the
+ *  duration of the session.
+ */
+static void serve_connection(void (*handler)(int), int fd) {
+
+  uint64_t start = metrics_now();
+  set_send_timeout(fd);
+  metrics_session_start();
+  trace_session_open();
+  handler(fd);
+  trace_session_close(start);
+  metrics_session_end(start);
+}
+
+/** Creates a server socket at the specified port number and sets it
+ *  up to listen for new connections. Terminates the program if the
+ *  socket cannot be created.
  *
  *  Parameters: port: String corresponding to the port number (or
  *                    name) where the server will listen for new
  *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *              reuse_port: If non-zero, the socket is created with
+ *                          SO_REUSEPORT, so that several listeners
+ *                          (e.g., one per event loop) can be bound
+ *                          to the same port, with the kernel
+ *                          distributing connections among them.
+ *              backlog: Maximum number of pending connections.
+ *
+ *  Returns: File descriptor of the listening socket.
  */
-void run_server(const char *port, void (*handler)(int)) {
-  
+static int create_listener(const char *port, int reuse_port, int backlog) {
+
   int sockfd; // fd used for listening connections
-  int new_fd; // fd used to transfer data to/from an accepted connection
   struct addrinfo hints, *servinfo, *p;
-  struct sockaddr_storage their_addr; // connector's address information
-  socklen_t sin_size;
-  struct sigaction sa;
   int yes = 1;
-  char s[INET6_ADDRSTRLEN];
   int rv;
   
   memset(&hints, 0, sizeof hints);
@@ -101,6 +243,13 @@ void run_server(const char *port, void (*handler)(int)) {
       exit(1);
     }
     
+    // allow other listeners in this program to bind to the same port
+    if (reuse_port &&
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+      perror("setsockopt");
+      exit(1);
+    }
+    
     // bind to the specified port number
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
       close(sockfd);
@@ -122,10 +271,26 @@ void run_server(const char *port, void (*handler)(int)) {
   }
   
   // set up a queue of incoming connections to be received by the server
-  if (listen(sockfd, BACKLOG) == -1) {
+  if (listen(sockfd, backlog) == -1) {
     perror("listen");
     exit(1);
   }
+
+  return sockfd;
+}
+
+/** Accepts connections from a listening socket, creating a new forked
+ *  process for each new client, in which the handler is called. If
+ *  max_sessions is positive, no new connection is accepted while
+ *  that many children are still running. Never returns.
+ */
+static void fork_server(int sockfd, void (*handler)(int), int max_sessions) {
+  
+  int new_fd; // fd used to transfer data to/from an accepted connection
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+  struct sigaction sa;
+  sigset_t chld_set, old_set;
   
   // set up a signal handler to kill zombie forked processes when they exit
   sa.sa_handler = sigchld_handler;
@@ -135,10 +300,20 @@ void run_server(const char *port, void (*handler)(int)) {
     perror("sigaction");
     exit(1);
   }
+  sigemptyset(&chld_set);
+  sigaddset(&chld_set, SIGCHLD);
   
   printf("server: waiting for connections...\n");
   
   while(1) {
+    // wait for a running session to finish if the limit is reached;
+    // SIGCHLD is blocked between the check and sigsuspend so that a
+    // child finishing in between is not missed
+    sigprocmask(SIG_BLOCK, &chld_set, &old_set);
+    while (max_sessions > 0 && active_children >= max_sessions)
+      sigsuspend(&old_set);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    
     // wait for new client to connect
     sin_size = sizeof(their_addr);
     new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
@@ -147,24 +322,892 @@ void run_server(const char *port, void (*handler)(int)) {
       continue;
     }
     
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-	      s, sizeof(s));
-    printf("server: got connection from %s\n", s);
+    log_connection(&their_addr);
     
     // Create a new process to handle the new client; parent process
     // will wait for another client.
-    if (!fork()) {
+    sigprocmask(SIG_BLOCK, &chld_set, &old_set);
+    pid_t pid = fork();
+    if (!pid) {
       // this is the child process
+      sigprocmask(SIG_SETMASK, &old_set, NULL);
       close(sockfd); // child doesn't need the listener, close
-      handler(new_fd);
+      serve_connection(handler, new_fd);
       close(new_fd);
       exit(0);
     }
+    if (pid > 0)
+      active_children++;
+    else
+      perror("fork");
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
     
     // Parent proceeds from here. In parent, client socket is not needed.
     close(new_fd);
   }
+}
+
+/** Creates a server socket at the specified port number, listens for
+ *  new connections and accepts them. A new forked process is created
+ *  for each new client, calling the provided handler function for
+ *  this client.
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) where the server will listen for new
+ *                    connections.
+ *              handler: Function to be called when a new connection
+ *                       is accepted. Will receive, as the only
+ *                       parameter, the file descriptor corresponding
+ *                       to the newly accepted connection.
+ */
+void run_server(const char *port, void (*handler)(int)) {
+  fork_server(create_listener(port, 0, BACKLOG), handler, 0);
+}
+
+/** Accepts connections from a listening socket shared with other
+ *  workers, and serves each of them with the handler, one at a
+ *  time. Used by both pre-forked processes and pool threads. Never
+ *  returns.
+ */
+static void pool_worker(int sockfd, void (*handler)(int)) {
+
+  int new_fd; // fd used to transfer data to/from an accepted connection
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+
+  while (1) {
+    sin_size = sizeof(their_addr);
+    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+    if (new_fd == -1) {
+      if (errno != EINTR)
+	perror("accept");
+      continue;
+    }
+
+    log_connection(&their_addr);
+    serve_connection(handler, new_fd);
+    close(new_fd);
+  }
+}
+
+/** Runs a pool of pre-forked worker processes that block in accept on
+ *  a shared listener. The parent process replaces any worker that
+ *  terminates. Never returns.
+ */
+static void prefork_server(int sockfd, void (*handler)(int), int workers) {
+
+  int running = 0;
+
+  printf("server: waiting for connections (%d workers)...\n", workers);
+  fflush(stdout);
+
+  while (1) {
+    for (; running < workers; running++) {
+      pid_t pid = fork();
+      if (pid == -1) {
+	perror("fork");
+	sleep(1);
+	break;
+      }
+      if (pid == 0)
+	pool_worker(sockfd, handler);
+    }
+
+    // wait for a worker to finish, so it can be replaced; only the
+    // workers are in the process group of the server (other children,
+    // e.g., the supervisor of the mail queue, are left to whoever
+    // started them)
+    if (waitpid(0, NULL, 0) > 0)
+      running--;
+    else if (errno == ECHILD)
+      running = 0;
+  }
+}
+
+struct pool_thread_args {
+  int sockfd;
+  void (*handler)(int);
+};
+
+/** Thread entry point for pool threads, see pool_worker.
+ */
+static void *pool_thread(void *arg) {
+  struct pool_thread_args *args = arg;
+  pool_worker(args->sockfd, args->handler);
+  return NULL;
+}
+
+/** Runs a pool of threads that block in accept on a shared
+ *  listener. The handler must be thread-safe. Never returns.
+ */
+static void thread_server(int sockfd, void (*handler)(int), int workers) {
+
+  static struct pool_thread_args args;
+  pthread_t thread;
+  args.sockfd = sockfd;
+  args.handler = handler;
+
+  printf("server: waiting for connections (%d threads)...\n", workers);
+  fflush(stdout);
+
+  for (int i = 1; i < workers; i++) {
+    int rv = pthread_create(&thread, NULL, pool_thread, &args);
+    if (rv) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+      break;
+    }
+    pthread_detach(thread);
+  }
+
+  // the main thread is also part of the pool
+  pool_worker(sockfd, handler);
+}
+
+/** Registers or unregisters the listener in the event loop. The
+ *  listener is removed while the loop is at its session limit, so
+ *  pending connections wait in the listen queue (or are picked up by
+ *  another loop) instead of being accepted.
+ */
+static void set_accepting(struct event_loop *loop, int accepting) {
+
+  struct epoll_event ev;
+  if (loop->accepting == accepting)
+    return;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; // a NULL pointer identifies the listener
+  if (epoll_ctl(loop->epfd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		loop->sockfd, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+  loop->accepting = accepting;
+}
+
+/** Closes a connection handled by the event loop, releasing its
+ *  session and all memory associated to it.
+ */
+static void close_connection(struct event_loop *loop, struct connection *conn) {
+
+  timer_cancel(&loop->timers, &conn->timer);
+  trace_session_switch(conn->trace);
+  loop->session->close(conn->session);
+  trace_session_close(conn->started);
+  metrics_session_end(conn->started);
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  if (conn->held) {
+    struct connection **link = &loop->held;
+    while (*link != conn)
+      link = &(*link)->next_held;
+    *link = conn->next_held;
+  }
+  close(conn->fd);
+  nb_destroy(conn->nb);
+  ob_destroy(conn->out);
+  free(conn);
+
+  loop->sessions--;
+  set_accepting(loop, 1);
+}
+
+/** Arms (or cancels) the timer of a connection with the timeout of
+ *  its session in its current state, counted from now.
+ */
+static void arm_timeout(struct event_loop *loop, struct connection *conn) {
+
+  unsigned int timeout = session_timeout(loop->session, conn->session);
+  if (timeout)
+    timer_arm(&loop->timers, &conn->timer, metrics_now() / 1000 + timeout);
+  else
+    timer_cancel(&loop->timers, &conn->timer);
+}
+
+/** Closes a connection whose session timed out, once the session has
+ *  had a chance to send a final reply.
+ */
+static void expire_connection(struct timer *timer) {
+
+  struct connection *conn = (struct connection *)
+    ((char *) timer - offsetof(struct connection, timer));
+  struct event_loop *loop = conn->loop;
+
+  trace_session_switch(conn->trace);
+  if (loop->session->expire)
+    loop->session->expire(conn->session);
+  ob_flush(conn->out);
+  close_connection(loop, conn);
+}
+
+/** Sets the event a connection waits for: input, or, while some of
+ *  its replies are pending, the socket draining, or none while its
+ *  replies are held for a group commit. No input is read while
+ *  replies are pending, so a client that does not read its replies
+ *  cannot make its session produce more of them.
+ *
+ *  Returns: 0 if the event was set, -1 otherwise.
+ */
+static int watch_connection(struct event_loop *loop, struct connection *conn, uint32_t events) {
+
+  struct epoll_event ev;
+  if (conn->events == events)
+    return 0;
+  ev.events = events;
+  ev.data.ptr = conn;
+  conn->events = events;
+  return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/** Sends the replies of a connection, as far as the socket takes them
+ *  without blocking, and waits for the socket to drain if some are
+ *  left. The connection is closed if sending fails, or once all
+ *  replies are sent if the session has ended.
+ *
+ *  Returns: 0 if all replies were sent, 1 if some are pending, or -1
+ *           if the connection was closed.
+ */
+static int send_output(struct event_loop *loop, struct connection *conn) {
+
+  int writing = conn->events == EPOLLOUT;
+  int rv = ob_flush(conn->out);
+  if (rv < 0 || (rv == 0 && conn->closing) ||
+      watch_connection(loop, conn, rv > 0 ? EPOLLOUT : EPOLLIN) < 0) {
+    close_connection(loop, conn);
+    return -1;
+  }
+
+  // pending replies must be taken by a deadline set when they become
+  // pending, and not moved by partial sends, so a client reading them
+  // a few bytes at a time is dropped too
+  if (rv > 0 && !writing)
+    timer_arm(&loop->timers, &conn->timer, metrics_now() / 1000 + SEND_TIMEOUT * 1000 +
+	      ob_pending(conn->out) * 1000 / SEND_MIN_RATE);
+  else if (rv == 0 && writing)
+    arm_timeout(loop, conn);
+  return rv;
+}
+
+/** Internal function run by the committer thread of an event loop:
+ *  waits for the last ticket the loop asked for to be done, syncing
+ *  it if no other process or thread is doing it already, and signals
+ *  the loop. Never returns.
+ */
+static void *run_committer(void *arg) {
+
+  struct event_loop *loop = arg;
+  uint64_t synced = 0, one = 1;
+  pthread_mutex_lock(&loop->commit_lock);
+  while (1) {
+    while (loop->commit_ticket <= synced)
+      pthread_cond_wait(&loop->commit_requested, &loop->commit_lock);
+    uint64_t ticket = loop->commit_ticket;
+    pthread_mutex_unlock(&loop->commit_lock);
+
+    group_commit_wait(ticket);
+    synced = ticket;
+    if (write(loop->commit_fd, &one, sizeof(one)) < 0)
+      perror("eventfd");
+    pthread_mutex_lock(&loop->commit_lock);
+  }
+  return NULL;
+}
+
+/** Internal function that starts the committer thread of an event
+ *  loop, the first time a reply is held.
+ *
+ *  Returns: 0 if the committer is running, -1 otherwise.
+ */
+static int start_committer(struct event_loop *loop) {
+
+  struct epoll_event ev;
+  pthread_t thread;
+  if (loop->commit_fd >= 0)
+    return 0;
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &loop->commit_fd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    close(fd);
+    return -1;
+  }
+  loop->commit_fd = fd;
+  if (pthread_create(&thread, NULL, run_committer, loop) != 0) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    loop->commit_fd = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/** Holds the replies of a connection until the group commit they are
+ *  waiting for is done. The sync is left to the committer thread, so
+ *  the loop never waits for the disk, and one sync covers all the
+ *  connections held meanwhile. The connection waits for no event
+ *  until its replies are sent (see send_held_replies).
+ *
+ *  Returns: 0 if the connection is held, -1 if the committer could
+ *           not be started, in which case the commit is waited for.
+ */
+static int hold_connection(struct event_loop *loop, struct connection *conn) {
+
+  if (start_committer(loop) < 0) {
+    perror("group commit");
+    group_commit_wait(conn->out->commit_ticket);
+    return -1;
+  }
+  if (watch_connection(loop, conn, 0) < 0) {
+    group_commit_wait(conn->out->commit_ticket);
+    return -1;
+  }
+  conn->held = 1;
+  conn->next_held = loop->held;
+  loop->held = conn;
+
+  pthread_mutex_lock(&loop->commit_lock);
+  if (conn->out->commit_ticket > loop->commit_ticket) {
+    loop->commit_ticket = conn->out->commit_ticket;
+    pthread_cond_signal(&loop->commit_requested);
+  }
+  pthread_mutex_unlock(&loop->commit_lock);
+  return 0;
+}
+
+/** Accepts all pending connections in a non-blocking listener,
+ *  opening a new session for each of them and registering them in
+ *  the event loop.
+ */
+static void accept_connections(struct event_loop *loop) {
+
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+  struct epoll_event ev;
+  int new_fd;
+
+  while (1) {
+    if (loop->max_sessions > 0 && loop->sessions >= loop->max_sessions) {
+      set_accepting(loop, 0);
+      return;
+    }
+
+    sin_size = sizeof(their_addr);
+    new_fd = accept(loop->sockfd, (struct sockaddr *)&their_addr, &sin_size);
+    if (new_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	perror("accept");
+      return;
+    }
+
+    log_connection(&their_addr);
+
+    // Neither reads nor sends block: replies the socket does not take
+    // are kept in the output buffer until the socket drains
+    fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+    struct connection *conn = malloc(sizeof(struct connection));
+    conn->fd = new_fd;
+    conn->nb = nb_create(new_fd, loop->max_line);
+    conn->out = ob_create(new_fd, OUT_BUFFER_SIZE);
+    ob_set_nonblocking(conn->out);
+    conn->started = metrics_now();
+    conn->closing = 0;
+    conn->events = EPOLLIN;
+    conn->held = 0;
+    conn->loop = loop;
+    timer_init(&conn->timer, expire_connection);
+    conn->trace = trace_session_open();
+    conn->session = loop->session->open(conn->out);
+    if (!conn->session) {
+      close(new_fd);
+      nb_destroy(conn->nb);
+      ob_destroy(conn->out);
+      free(conn);
+      continue;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+      loop->session->close(conn->session);
+      close(new_fd);
+      nb_destroy(conn->nb);
+      ob_destroy(conn->out);
+      free(conn);
+      continue;
+    }
+    metrics_session_start();
+    loop->sessions++;
+    arm_timeout(loop, conn);
+    send_output(loop, conn);
+  }
+}
+
+/** Passes the input received by a connection to its session, and
+ *  sends the replies. Every complete line is passed to the session,
+ *  unless the session ends or its replies build up a backlog, in
+ *  which case the rest is kept until the backlog is sent.
+ */
+static void process_input(struct event_loop *loop, struct connection *conn) {
+
+  // lines (or blocks of data) are passed to the session directly
+  // from the buffer, and the replies to all of them are sent together;
+  // input left behind while the replies were backlogged is processed
+  // as soon as they are sent, since no new event may come for it
+  char *line;
+  int rv, stalled;
+  do {
+    int consumed = 0;
+    stalled = 0;
+    while (!conn->closing && !(stalled = ob_backlogged(conn->out))) {
+      if (loop->session->data && (rv = nb_peek_data(conn->nb, &line)) > 0) {
+	int used = loop->session->data(conn->session, line, rv);
+	if (used > 0) {
+	  nb_consume(conn->nb, used);
+	  consumed = 1;
+	  continue;
+	}
+	if (used == 0)
+	  break;
+      }
+      if ((rv = nb_peek_next_line(conn->nb, &line)) <= 0)
+	break;
+      int done = loop->session->line(conn->session, line, rv);
+      nb_consume(conn->nb, rv);
+      consumed = 1;
+      if (done) {
+	conn->closing = 1;
+	break;
+      }
+    }
+
+    if (loop->session->flush)
+      loop->session->flush(conn->session);
+
+    // the timeout only starts again once input is consumed, so a
+    // partial line sent a few bytes at a time does not keep it alive
+    if (consumed && !conn->closing)
+      arm_timeout(loop, conn);
+
+    if (!group_commit_done(conn->out->commit_ticket) && hold_connection(loop, conn) == 0)
+      return;
+  } while (send_output(loop, conn) == 0 && stalled);
+}
+
+/** Handles a connection that has data available to be read, closing
+ *  it if the client disconnected.
+ */
+static void handle_readable(struct event_loop *loop, struct connection *conn) {
+
+  trace_session_switch(conn->trace);
+  int rv = nb_fill(conn->nb);
+  if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    close_connection(loop, conn);
+    return;
+  }
+  process_input(loop, conn);
+}
+
+/** Handles a connection whose socket can take more of its pending
+ *  replies. Once they are all sent, input received in the meantime
+ *  is processed.
+ */
+static void handle_writable(struct event_loop *loop, struct connection *conn) {
+
+  trace_session_switch(conn->trace);
+  if (send_output(loop, conn) == 0)
+    process_input(loop, conn);
+}
+
+/** Sends the replies held by connections of the event loop whose
+ *  group commit is done, once the committer signals a sync, and
+ *  processes the input they received in the meantime.
+ */
+static void send_held_replies(struct event_loop *loop) {
+
+  uint64_t count;
+  if (read(loop->commit_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+
+  // a connection held again is added at the head of the list, where
+  // the ticket it waits for is found not to be done
+  struct connection **link = &loop->held;
+  while (*link) {
+    struct connection *conn = *link;
+    if (!group_commit_done(conn->out->commit_ticket)) {
+      link = &conn->next_held;
+      continue;
+    }
+    *link = conn->next_held;
+    conn->held = 0;
+    trace_session_switch(conn->trace);
+    if (send_output(loop, conn) == 0)
+      process_input(loop, conn);
+  }
+}
+
+/** Runs an event loop that accepts connections from a listening
+ *  socket and drives all their sessions from a single thread. If
+ *  max_sessions is positive, at most that many sessions are open at
+ *  a time. Never returns.
+ */
+static void event_loop(int sockfd, const struct session_handler *session,
+		       size_t max_line, int max_sessions) {
+
+  struct epoll_event events[MAX_EVENTS];
+  struct event_loop loop;
+
+  loop.sockfd = sockfd;
+  loop.session = session;
+  loop.max_line = max_line;
+  loop.sessions = 0;
+  loop.max_sessions = max_sessions;
+  loop.accepting = 0;
+  loop.held = NULL;
+  loop.commit_fd = -1;
+  loop.commit_ticket = 0;
+  pthread_mutex_init(&loop.commit_lock, NULL);
+  pthread_cond_init(&loop.commit_requested, NULL);
+  timer_wheel_init(&loop.timers, metrics_now() / 1000);
+  loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop.epfd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  // the listener must not block once all pending connections are accepted
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+  set_accepting(&loop, 1);
+
+  while (1) {
+    int n = epoll_wait(loop.epfd, events, MAX_EVENTS,
+		       timer_wheel_next(&loop.timers, metrics_now() / 1000));
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    // held replies are sent once all events are handled, as a
+    // connection they release may be closed
+    int synced = 0;
+    for (int i = 0; i < n; i++) {
+      struct connection *conn = events[i].data.ptr;
+      if (!conn)
+	accept_connections(&loop);
+      else if (events[i].data.ptr == &loop.commit_fd)
+	synced = 1;
+      else if (conn->events == EPOLLOUT)
+	handle_writable(&loop, conn);
+      else if (conn->events == EPOLLIN)
+	handle_readable(&loop, conn);
+      else
+	close_connection(&loop, conn); // only a hang-up is reported while held
+    }
+    if (synced)
+      send_held_replies(&loop);
+    timer_wheel_advance(&loop.timers, metrics_now() / 1000);
+  }
+}
+
+/** Runs an event-driven server, with one event loop per
+ *  worker. Each worker is a separate process with its own
+ *  SO_REUSEPORT listener, so the kernel balances new connections
+ *  among them and no state needs to be shared. The session limit is
+ *  split evenly among the loops.
+ */
+static void run_event_server(const struct server_config *config,
+			     const struct session_handler *session, size_t max_line) {
+
+  int workers = config->workers;
+  int max_sessions = 0;
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+  if (config->max_sessions > 0)
+    max_sessions = (config->max_sessions + workers - 1) / workers;
+
+  printf("server: waiting for connections (%d event loops)...\n", workers);
+  fflush(stdout);
+
+  if (workers == 1)
+    event_loop(create_listener(config->port, 1, config->backlog),
+	       session, max_line, max_sessions);
+
+  for (int i = 0; i < workers; i++) {
+    pid_t pid = fork();
+    if (pid == -1)
+      perror("fork");
+    else if (pid == 0)
+      event_loop(create_listener(config->port, 1, config->backlog),
+		 session, max_line, max_sessions);
+  }
+
+  // The parent only waits for the event loops, which never return
+  // unless they crash, and which are the only children in its
+  // process group (see prefork_server).
+  while (waitpid(0, NULL, 0) > 0 || errno == EINTR);
+}
+
+/** Initializes a server configuration with its default values: a
+ *  forked process for every connection, with no session limit.
+ *
+ *  Parameters: config: Configuration object to be initialized.
+ */
+void server_config_init(struct server_config *config) {
+  config->port         = NULL;
+  config->mode         = SERVER_MODE_FORK;
+  config->workers      = 0;
+  config->max_sessions = 0;
+  config->backlog      = BACKLOG;
+  config->io_uring     = 0;
+  config->timeout      = 0;
+  config->trace_sample = 0;
+}
+
+/** Applies a command-line option, as returned by getopt using
+ *  SERVER_OPTIONS, to a server configuration. The following options
+ *  are supported:
+ *
+ *   -m mode: server mode, one of "fork" (the default, one process
+ *            per connection), "prefork" (pool of worker processes),
+ *            "thread" (pool of worker threads) or "event"
+ *            (non-blocking sessions on epoll loops).
+ *   -w num:  number of pool workers (default is the session limit,
+ *            or 16 if there is no limit) or event loops (default is
+ *            one per core).
+ *   -c num:  maximum number of concurrent sessions (default is no
+ *            limit). In pool modes, the pool is never larger than
+ *            this limit.
+ *   -b num:  size of the listen queue (default is 10).
+ *   -t secs: maximum time a session may wait for input, in seconds
+ *            (default is the protocol's own timeouts).
+ *   -T num:  trace one in every num sessions (see trace.c); the
+ *            trace file is opened by the server program.
+ *   -u:      use io_uring for file operations, where supported by
+ *            the kernel (see uring.c).
+ *
+ *  Parameters: config: Configuration object to be modified.
+ *              opt: Option character returned by getopt.
+ *              arg: Option argument (optarg), if any.
+ *
+ *  Returns: 1 if the option was applied, 0 if the option is not a
+ *           server option, or -1 if the option argument is invalid.
+ */
+int server_config_option(struct server_config *config, int opt, const char *arg) {
 
+  switch (opt) {
+  case 'm':
+    if (!strcasecmp(arg, "fork"))
+      config->mode = SERVER_MODE_FORK;
+    else if (!strcasecmp(arg, "prefork"))
+      config->mode = SERVER_MODE_PREFORK;
+    else if (!strcasecmp(arg, "thread"))
+      config->mode = SERVER_MODE_THREAD;
+    else if (!strcasecmp(arg, "event"))
+      config->mode = SERVER_MODE_EVENT;
+    else
+      return -1;
+    return 1;
+  case 'w':
+    config->workers = atoi(arg);
+    return config->workers >= 0 ? 1 : -1;
+  case 'c':
+    config->max_sessions = atoi(arg);
+    return config->max_sessions >= 0 ? 1 : -1;
+  case 'b':
+    config->backlog = atoi(arg);
+    return config->backlog > 0 ? 1 : -1;
+  case 't':
+    if (atoi(arg) <= 0)
+      return -1;
+    config->timeout = atoi(arg);
+    return 1;
+  case 'T':
+    if (atoi(arg) <= 0)
+      return -1;
+    config->trace_sample = atoi(arg);
+    return 1;
+  case 'u':
+    config->io_uring = 1;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Runs a server using the mode selected in the configuration. In
+ *  fork and pool modes, the handler is called for every new
+ *  connection, in a new process or in the next available worker. In
+ *  event mode, the session callbacks are called by an event loop as
+ *  lines are received. Never returns.
+ *
+ *  Parameters: config: Server configuration, including the port.
+ *              handler: Blocking handler used in fork and pool
+ *                       modes. Must be thread-safe in thread mode.
+ *              session: Session callbacks used in event mode.
+ *              max_line: Maximum line size passed to the session.
+ */
+void run_configured_server(const struct server_config *config, void (*handler)(int),
+			   const struct session_handler *session, size_t max_line) {
+
+  int workers = config->workers;
+  if (workers <= 0)
+    workers = config->max_sessions > 0 ? config->max_sessions : DEFAULT_POOL_SIZE;
+  if (config->max_sessions > 0 && workers > config->max_sessions)
+    workers = config->max_sessions;
+  max_timeout = config->timeout * 1000;
+  if (config->io_uring) {
+    uring_enable();
+    if (!uring_available())
+      fprintf(stderr, "io_uring is not available, using blocking file operations\n");
+  }
+
+  switch (config->mode) {
+  case SERVER_MODE_EVENT:
+    run_event_server(config, session, max_line);
+    break;
+  case SERVER_MODE_PREFORK:
+    prefork_server(create_listener(config->port, 0, config->backlog), handler, workers);
+    break;
+  case SERVER_MODE_THREAD:
+    thread_server(create_listener(config->port, 0, config->backlog), handler, workers);
+    break;
+  default:
+    fork_server(create_listener(config->port, 0, config->backlog), handler,
+		config->max_sessions);
+    break;
+  }
+}
+
+/** Returns how long a session may wait for input in its current
+ *  state, i.e., the timeout requested by the session handler,
+ *  limited by the -t option of the server. Used by the event loop
+ *  and by blocking handlers, which pass it to nb_set_timeout.
+ *
+ *  Parameters: handler: Session callbacks.
+ *              session: Session, as returned by the open callback.
+ *
+ *  Returns: The timeout, in milliseconds, or 0 for no limit.
+ */
+unsigned int session_timeout(const struct session_handler *handler, void *session) {
+
+  unsigned int timeout = handler->timeout ? handler->timeout(session) : 0;
+  if (max_timeout && (!timeout || timeout > max_timeout))
+    timeout = max_timeout;
+  return timeout;
+}
+
+/** Adds the decimal representation of a number to an output buffer,
+ *  without printf (e.g., for the counts and sizes in POP3 replies).
+ *
+ *  Parameters: out: buffer object.
+ *              value: Number to be written.
+ *
+ *  Returns: The number of bytes written, or -1 if a send failed.
+ */
+int ob_write_uint(out_buffer_t out, uint64_t value) {
+
+  char digits[20]; // enough for any 64-bit value
+  char *p = digits + sizeof(digits);
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  return ob_write(out, p, digits + sizeof(digits) - p);
+}
+
+/** Adds a reply formatted in advance to an output buffer.
+ *
+ *  Parameters: out: buffer object.
+ *              reply: Reply to be sent, either initialized with
+ *                     STATIC_REPLY or by static_reply_format.
+ *
+ *  Returns: The number of bytes written, or -1 if a send failed.
+ */
+int send_static(out_buffer_t out, const struct static_reply *reply) {
+  return ob_write(out, reply->text, reply->len);
+}
+
+/** Adds a reply formatted in advance that only holds once the writes
+ *  covered by a group commit ticket are on disk (e.g., accepting a
+ *  message). The buffer is held until the ticket is done, as with
+ *  ob_require_commit, and the reply is replaced with another one if
+ *  the writes could not be synced.
+ *
+ *  Parameters: out: buffer object.
+ *              ticket: Ticket returned by group_commit_request.
+ *              reply: Reply to be sent once the writes are on disk.
+ *              failed: Reply to be sent instead if the sync failed.
+ *
+ *  Returns: The number of bytes written, or -1 if a send failed.
+ */
+int send_committed(out_buffer_t out, uint64_t ticket, const struct static_reply *reply,
+		   const struct static_reply *failed) {
+
+  if (!ticket)
+    return send_static(out, reply);
+  if (out->failed)
+    return -1;
+
+  // the reply is written in the buffer itself, so it can be replaced
+  // until the buffer is sent
+  if (out->nonblocking ? ob_make_room(out, reply->len) < 0 :
+      reply->len > out->capacity - out->len && ob_flush(out) < 0)
+    return -1;
+  if (ob_grow(out, reply->len) < 0)
+    return -1;
+  if (out->commit_count == out->commit_capacity) {
+    unsigned int capacity = out->commit_capacity ? out->commit_capacity * 2 : 4;
+    struct out_commit *commits = realloc(out->commits, capacity * sizeof(struct out_commit));
+    if (!commits) {
+      out->failed = 1;
+      return -1;
+    }
+    out->commits = commits;
+    out->commit_capacity = capacity;
+  }
+
+  ob_require_commit(out, ticket);
+  struct out_commit *commit = &out->commits[out->commit_count++];
+  commit->ticket = ticket;
+  commit->pos    = out->len;
+  commit->reply  = reply;
+  commit->failed = failed;
+  memcpy(out->buf + out->len, reply->text, reply->len);
+  out->len += reply->len;
+  return reply->len;
+}
+
+/** Formats a reply that only depends on values known at startup
+ *  (e.g., the host name), to be sent with send_static. The text is
+ *  allocated once and never freed. Terminates the program if there is
+ *  no memory for it.
+ *
+ *  Parameters: reply: Reply to be initialized.
+ *              str: Format string, as in printf, followed by its
+ *                   arguments.
+ */
+void static_reply_format(struct static_reply *reply, const char *str, ...) {
+
+  va_list args;
+  va_start(args, str);
+  int len = vsnprintf(NULL, 0, str, args);
+  va_end(args);
+
+  char *text = len < 0 ? NULL : malloc(len + 1);
+  if (!text) {
+    perror("static_reply_format");
+    exit(1);
+  }
+  va_start(args, str);
+  vsnprintf(text, len + 1, str, args);
+  va_end(args);
+
+  reply->text = text;
+  reply->len = len;
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -189,10 +1232,13 @@ int send_all(int fd, char buf[], size_t size) {
   
   size_t rem = size;
   while (rem > 0) {
+    uint64_t start = TRACE_START();
     int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+    TRACE_SPAN(TRACE_SEND, start);
     // If there was an error, interrupt sending and returns an error
     if (rv <= 0)
       return rv;
+    metrics_bytes_out(rv);
     buf += rv;
     rem -= rv;
   }
@@ -217,8 +1263,9 @@ int send_all(int fd, char buf[], size_t size) {
  */
 int send_formatted(int fd, const char *str, ...) {
   
-  static char *buf = NULL;
-  static int bufsize = 0;
+  // Each thread has its own buffer, so pool threads can send concurrently
+  static __thread char *buf = NULL;
+  static __thread int bufsize = 0;
   va_list args;
   int strsize;
   
@@ -238,7 +1285,7 @@ int send_formatted(int fd, const char *str, ...) {
       return -1;
     
     // If buffer was enough to fit entire string, send it
-    if (strsize <= bufsize)
+    if (strsize < bufsize)
       break;
     
     // Try again with more space
@@ -249,3 +1296,700 @@ int send_formatted(int fd, const char *str, ...) {
   return send_all(fd, buf, strsize);
 }
 
+/** Sends the contents of a file, or part of it, to a socket. The data
+ *  is copied by the kernel (using sendfile), without being read into
+ *  user memory.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: File descriptor of the file to be sent.
+ *              offset: Position in the file where data starts.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: If the data was successfully sent, returns size. If the
+ *           file is shorter than expected, returns the number of
+ *           bytes sent. Otherwise, returns -1.
+ */
+ssize_t send_file(int fd, int file_fd, off_t offset, size_t size) {
+
+  size_t rem = size;
+  while (rem > 0) {
+    uint64_t start = TRACE_START();
+    ssize_t rv = sendfile(fd, file_fd, &offset, rem);
+    TRACE_SPAN(TRACE_SENDFILE, start);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv < 0)
+      return -1;
+    if (rv == 0)
+      break;
+    metrics_bytes_out(rv);
+    rem -= rv;
+  }
+  return size - rem;
+}
+
+/** Internal function that writes the end of a multi-line response,
+ *  terminating the last line if needed, to a buffer of at least 5
+ *  bytes.
+ *
+ *  Returns: The number of bytes written to out.
+ */
+static size_t end_multiline(char *out, char prev) {
+
+  size_t o = 0;
+  if (prev != '\n') {
+    out[o++] = '\r';
+    out[o++] = '\n';
+  }
+  memcpy(out + o, ".\r\n", 3);
+  return o + 3;
+}
+
+/** Sends the contents of a file as the data of a multi-line response
+ *  (e.g., a message in POP3 RETR), followed by the terminating line
+ *  (a single dot).
+ *
+ *  If the file is known to be already in the transfer format (i.e.,
+ *  with CRLF line terminators and no line starting with a dot), it is
+ *  sent unmodified with sendfile. Otherwise, the file is read through
+ *  a fixed-size buffer, and lines starting with a dot are
+ *  dot-stuffed, bare LF characters are replaced by CRLF, and a line
+ *  terminator is added to an unterminated last line. Either way, the
+ *  memory used does not depend on the size of the file.
+ *
+ *  If the output buffer is non-blocking (in the event loop), the file
+ *  is queued in the buffer instead, and sent (or read and stuffed)
+ *  from where it stopped every time the socket can take more data.
+ *  The caller may close file_fd right away.
+ *
+ *  Parameters: ob: Output buffer of the connection.
+ *              file_fd: File descriptor of the file to be sent, read
+ *                       from its current position.
+ *              clean: non-zero if the file can be sent unmodified.
+ *
+ *  Returns: If the data was successfully sent, returns the number of
+ *           bytes sent (including the terminating line). Otherwise,
+ *           returns -1.
+ */
+ssize_t send_multiline_file(out_buffer_t ob, int file_fd, int clean) {
+
+  char in[2][SEND_CHUNK_SIZE];
+  // each byte in the input is at most doubled, plus a final CRLF and dot
+  char out[2 * SEND_CHUNK_SIZE + 5];
+  size_t total = 0;
+  ssize_t len;
+  char prev = '\n';
+  struct stat file_stat;
+
+  // A non-blocking buffer queues the file after the buffered replies,
+  // unless another file is already queued
+  if (ob->nonblocking && ob->file.fd < 0 && fstat(file_fd, &file_stat) == 0) {
+    off_t offset = lseek(file_fd, 0, SEEK_CUR);
+    if (offset < 0)
+      offset = 0;
+    if (ob->failed || ob_queue_file(ob, file_fd, offset, file_stat.st_size, clean) < 0)
+      return -1;
+    return file_stat.st_size - offset + 3;
+  }
+
+  // buffered replies are sent before the file
+  if (clean && !ob->nonblocking && fstat(file_fd, &file_stat) == 0) {
+    off_t offset = lseek(file_fd, 0, SEEK_CUR);
+    if (offset < 0)
+      offset = 0;
+    if (ob_flush(ob) < 0)
+      return -1;
+    len = send_file(ob->fd, file_fd, offset, file_stat.st_size - offset);
+    if (len < 0)
+      return -1;
+    return ob_write(ob, ".\r\n", 3) < 0 ? -1 : len + 3;
+  }
+
+  // With io_uring, each chunk is read into one buffer while the
+  // previous chunk, in the other buffer, is stuffed and sent
+  struct uring_op op;
+  off_t read_offset = lseek(file_fd, 0, SEEK_CUR);
+  int ahead = read_offset >= 0 &&
+    uring_read(file_fd, in[0], SEND_CHUNK_SIZE, read_offset, &op) == 0;
+  int cur = 0;
+
+  while (1) {
+    uint64_t start = TRACE_START();
+    if (ahead) {
+      len = uring_wait(&op);
+      if (len > 0) {
+	read_offset += len;
+	if (uring_read(file_fd, in[!cur], SEND_CHUNK_SIZE, read_offset, &op) == 0) {
+	  uring_submit();
+	} else {
+	  ahead = 0;
+	  lseek(file_fd, read_offset, SEEK_SET);
+	}
+      } else {
+	ahead = 0;
+      }
+    } else {
+      len = read(file_fd, in[cur], SEND_CHUNK_SIZE);
+    }
+    TRACE_SPAN(TRACE_FILE_READ, start);
+    if (len <= 0)
+      break;
+
+    size_t o = textscan_stuff(in[cur], len, out, &prev);
+    if (ob_write(ob, out, o) < 0) {
+      // the buffers cannot be released while a read is pending
+      if (ahead)
+	uring_wait(&op);
+      return -1;
+    }
+    total += o;
+    cur = !cur;
+  }
+  if (len < 0)
+    return -1;
+
+  size_t o = end_multiline(out, prev);
+  if (ob_write(ob, out, o) < 0)
+    return -1;
+  return total + o;
+}
+
+/** Creates a new buffer for replies sent to a socket. Replies are
+ *  appended to the buffer with ob_write and ob_printf, and sent
+ *  together once ob_flush is called (or once the buffer is full), so
+ *  that replies to several commands can be sent with a single system
+ *  call.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              size: Number of bytes buffered before data is sent.
+ *
+ *  Returns: An out_buffer_t object that can be used in other functions
+ *           to send buffered data.
+ */
+out_buffer_t ob_create(int fd, size_t size) {
+
+  out_buffer_t out = malloc(sizeof(struct out_buffer));
+  out->fd       = fd;
+  out->size     = size;
+  out->capacity = size;
+  out->len      = 0;
+  out->failed   = 0;
+  out->nonblocking = 0;
+  out->commit_ticket = 0;
+  out->file.fd  = -1;
+  out->commits  = NULL;
+  out->commit_count = 0;
+  out->commit_capacity = 0;
+  out->buf      = malloc(size);
+  return out;
+}
+
+/** Frees all memory used by an out_buffer_t object. Data not yet
+ *  flushed is discarded.
+ *
+ *  Parameters: out: buffer object to be freed.
+ */
+void ob_destroy(out_buffer_t out) {
+  if (out->file.fd >= 0)
+    close(out->file.fd);
+  free(out->commits);
+  free(out->buf);
+  free(out);
+}
+
+/** Internal function that makes an output buffer non-blocking, for a
+ *  socket in non-blocking mode (e.g., in the event loop). Data that
+ *  the socket does not take right away is kept in the buffer, which
+ *  grows as needed, and a file sent as a multi-line response is
+ *  queued and sent as the socket drains, so no call ever waits for
+ *  the client. ob_flush then returns 1 while data is still pending.
+ */
+static void ob_set_nonblocking(out_buffer_t out) {
+  out->nonblocking = 1;
+}
+
+/** Internal function that checks if a non-blocking buffer has a
+ *  backlog, i.e., more data than it normally holds, or a queued
+ *  file, so the session should not produce more output for now.
+ */
+static int ob_backlogged(out_buffer_t out) {
+  return out->len >= out->size || out->file.fd >= 0;
+}
+
+/** Internal function that returns how many bytes a non-blocking
+ *  buffer still has to send, including the rest of its queued file.
+ */
+static size_t ob_pending(out_buffer_t out) {
+  return out->len + (out->file.fd >= 0 ? out->file.end - out->file.offset : 0);
+}
+
+/** Internal function that grows a non-blocking buffer so that it has
+ *  room for at least len more bytes.
+ *
+ *  Returns: 0 if there is room, -1 if no memory is available (in
+ *           which case the buffer is marked as failed).
+ */
+static int ob_grow(out_buffer_t out, size_t len) {
+
+  if (len <= out->capacity - out->len)
+    return 0;
+  size_t capacity = out->capacity * 2;
+  if (capacity < out->len + len)
+    capacity = out->len + len;
+  char *buf = realloc(out->buf, capacity);
+  if (!buf) {
+    out->failed = 1;
+    return -1;
+  }
+  out->buf = buf;
+  out->capacity = capacity;
+  return 0;
+}
+
+/** Internal function that inserts data at a position of a
+ *  non-blocking buffer (e.g., data of the queued file, ahead of the
+ *  replies that follow it).
+ *
+ *  Returns: 0 if the data was inserted, -1 otherwise.
+ */
+static int ob_insert(out_buffer_t out, size_t pos, const char *data, size_t len) {
+
+  if (ob_grow(out, len) < 0)
+    return -1;
+  memmove(out->buf + pos + len, out->buf + pos, out->len - pos);
+  memcpy(out->buf + pos, data, len);
+  out->len += len;
+  return 0;
+}
+
+static size_t end_multiline(char *out, char prev);
+
+/** Internal function that sends the next part of the file queued in a
+ *  non-blocking buffer, once all data buffered before it is sent. A
+ *  clean file is sent with sendfile, from the offset where the last
+ *  call stopped; otherwise the next chunk is read, dot-stuffed and
+ *  added to the buffer. The terminating line is added to the buffer
+ *  once the end of the file is reached, and the file is closed.
+ *
+ *  Returns: 0 if the file advanced, 1 if the socket cannot take more
+ *           data, or -1 if sending or reading failed.
+ */
+static int ob_send_file_part(out_buffer_t out) {
+
+  struct out_file *file = &out->file;
+  char in[SEND_CHUNK_SIZE];
+  char stuffed[2 * SEND_CHUNK_SIZE + 5];
+  ssize_t len = 0;
+
+  if (file->clean && file->offset < file->end) {
+    uint64_t start = TRACE_START();
+    len = sendfile(out->fd, file->fd, &file->offset, file->end - file->offset);
+    TRACE_SPAN(TRACE_SENDFILE, start);
+    if (len > 0)
+      metrics_bytes_out(len);
+  } else if (!file->clean) {
+    uint64_t start = TRACE_START();
+    len = pread(file->fd, in, sizeof(in), file->offset);
+    TRACE_SPAN(TRACE_FILE_READ, start);
+    if (len > 0) {
+      file->offset += len;
+      size_t o = textscan_stuff(in, len, stuffed, &file->prev);
+      if (ob_insert(out, 0, stuffed, o) < 0)
+	return -1;
+      file->pos = o;
+    }
+  }
+  if (len < 0 && errno == EINTR)
+    return 0;
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && file->clean)
+    return 1;
+  if (len < 0) {
+    out->failed = 1;
+    return -1;
+  }
+  if (len > 0)
+    return 0;
+
+  // the end of the file was reached (or the file is shorter than
+  // expected)
+  size_t o = end_multiline(stuffed, file->prev);
+  close(file->fd);
+  file->fd = -1;
+  return ob_insert(out, 0, stuffed, o);
+}
+
+/** Internal function that replaces the replies held for group commits
+ *  that failed, once all of them are done. Nothing is sent before
+ *  that, so the replies are still where they were written.
+ *
+ *  Returns: 0 if the replies are final, -1 if there was no memory to
+ *           replace one of them.
+ */
+static int ob_resolve_commits(out_buffer_t out) {
+
+  // the last reply is replaced first, so the others do not move
+  for (unsigned int i = out->commit_count; i-- > 0; ) {
+    struct out_commit *commit = &out->commits[i];
+    if (!group_commit_failed(commit->ticket))
+      continue;
+    size_t old_len = commit->reply->len, new_len = commit->failed->len;
+    if (new_len > old_len && ob_grow(out, new_len - old_len) < 0)
+      return -1;
+    memmove(out->buf + commit->pos + new_len, out->buf + commit->pos + old_len,
+	    out->len - commit->pos - old_len);
+    memcpy(out->buf + commit->pos, commit->failed->text, new_len);
+    out->len = out->len - old_len + new_len;
+    if (out->file.fd >= 0 && commit->pos < out->file.pos)
+      out->file.pos = out->file.pos - old_len + new_len;
+  }
+  out->commit_count = 0;
+  return 0;
+}
+
+/** Internal function that sends as much of the data in a non-blocking
+ *  buffer (and of its queued file) as the socket takes without
+ *  blocking. Nothing is sent while the group commit ticket of the
+ *  buffer is not done.
+ *
+ *  Returns: 0 if all the data was sent, 1 if some data is still
+ *           pending, or -1 if this or a previous send failed.
+ */
+static int ob_send_nonblocking(out_buffer_t out) {
+
+  if (out->failed)
+    return -1;
+  if (out->commit_ticket) {
+    if (!group_commit_done(out->commit_ticket))
+      return 1;
+    out->commit_ticket = 0;
+    if (ob_resolve_commits(out) < 0)
+      return -1;
+  }
+
+  while (1) {
+    size_t limit = out->file.fd >= 0 ? out->file.pos : out->len;
+    if (!limit) {
+      if (out->file.fd < 0)
+	return 0;
+      int rv = ob_send_file_part(out);
+      if (rv)
+	return rv;
+      continue;
+    }
+
+    uint64_t start = TRACE_START();
+    ssize_t rv = send(out->fd, out->buf, limit, MSG_NOSIGNAL | MSG_DONTWAIT);
+    TRACE_SPAN(TRACE_SEND, start);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    if (rv <= 0) {
+      out->failed = 1;
+      return -1;
+    }
+    metrics_bytes_out(rv);
+    memmove(out->buf, out->buf + rv, out->len - rv);
+    out->len -= rv;
+    if (out->file.fd >= 0)
+      out->file.pos -= rv;
+  }
+}
+
+/** Internal function that makes room for len more bytes in a
+ *  non-blocking buffer: if the buffer would go over its size, as much
+ *  data as possible is sent first, and the buffer grows if needed.
+ *
+ *  Returns: 0 if there is room, -1 if a send failed.
+ */
+static int ob_make_room(out_buffer_t out, size_t len) {
+
+  if (out->len + len > out->size && ob_send_nonblocking(out) < 0)
+    return -1;
+  return ob_grow(out, len);
+}
+
+/** Internal function that queues a file in a non-blocking buffer, to
+ *  be sent after the data already buffered (see ob_send_file_part).
+ *
+ *  Returns: 0 if the file was queued, -1 otherwise.
+ */
+static int ob_queue_file(out_buffer_t out, int file_fd, off_t offset, off_t end, int clean) {
+
+  int fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  out->file.fd = fd;
+  out->file.offset = offset;
+  out->file.end = end;
+  out->file.clean = clean;
+  out->file.prev = '\n';
+  out->file.pos = out->len;
+  return 0;
+}
+
+/** Returns the socket file descriptor of an output buffer, for data
+ *  sent without the buffer (e.g., with send_file). Any buffered data
+ *  must be flushed first.
+ *
+ *  Parameters: out: buffer object.
+ *
+ *  Returns: The socket file descriptor informed in ob_create.
+ */
+int ob_fd(out_buffer_t out) {
+  return out->fd;
+}
+
+/** Holds the data in an output buffer (including data added later)
+ *  until the writes covered by a group commit ticket are on disk,
+ *  e.g., so that a message is only accepted once it is safely stored.
+ *  The buffer waits for the ticket before its data is sent.
+ *
+ *  Parameters: out: buffer object.
+ *              ticket: Ticket returned by group_commit_request.
+ */
+void ob_require_commit(out_buffer_t out, uint64_t ticket) {
+  if (ticket > out->commit_ticket)
+    out->commit_ticket = ticket;
+}
+
+/** Internal function that waits for the group commit ticket, if any,
+ *  of an output buffer, before its data is sent, and replaces the
+ *  replies held for failed commits.
+ *
+ *  Returns: 0 if the data can be sent, -1 otherwise.
+ */
+static int ob_wait_commit(out_buffer_t out) {
+  if (out->commit_ticket) {
+    group_commit_wait(out->commit_ticket);
+    out->commit_ticket = 0;
+    if (ob_resolve_commits(out) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/** Internal function that sends all the data in a list of segments
+ *  with as few system calls as possible, like send_all.
+ *
+ *  Returns: 0 if all the data was sent, or -1 otherwise.
+ */
+static int send_segments(int fd, struct iovec *iov, int count) {
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  while (count > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    uint64_t start = TRACE_START();
+    ssize_t rv = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    TRACE_SPAN(TRACE_SEND, start);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      return -1;
+    metrics_bytes_out(rv);
+
+    // skip the segments that were completely sent
+    while (count > 0 && rv >= iov->iov_len) {
+      rv -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + rv;
+      iov->iov_len -= rv;
+    }
+  }
+  return 0;
+}
+
+/** Adds data to an output buffer. If the data does not fit in the
+ *  buffer, the buffered data and the new data are sent together,
+ *  without copying the new data.
+ *
+ *  Parameters: out: buffer object.
+ *              data: Data to be sent.
+ *              len: Number of bytes in data.
+ *
+ *  Returns: If the data was buffered or sent, returns len. If a
+ *           previous or current send failed, returns -1.
+ */
+int ob_write(out_buffer_t out, const void *data, size_t len) {
+
+  if (out->failed)
+    return -1;
+
+  if (out->nonblocking && ob_make_room(out, len) < 0)
+    return -1;
+  if (len <= out->capacity - out->len) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return len;
+  }
+
+  if (ob_wait_commit(out) < 0)
+    return -1;
+  struct iovec iov[2] = {
+    { out->buf, out->len },
+    { (void *) data, len }
+  };
+  out->len = 0;
+  if (send_segments(out->fd, iov, 2) < 0) {
+    out->failed = 1;
+    return -1;
+  }
+  return len;
+}
+
+/** Sends all data in an output buffer.
+ *
+ *  Parameters: out: buffer object.
+ *
+ *  Returns: 0 if all buffered data was sent, 1 if the buffer is
+ *           non-blocking and some data could not be sent yet, or -1
+ *           if this or a previous send failed.
+ */
+int ob_flush(out_buffer_t out) {
+
+  if (out->nonblocking)
+    return ob_send_nonblocking(out);
+  if (out->failed)
+    return -1;
+
+  if (ob_wait_commit(out) < 0)
+    return -1;
+  struct iovec iov = { out->buf, out->len };
+  out->len = 0;
+  if (iov.iov_len && send_segments(out->fd, &iov, 1) < 0) {
+    out->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/** Sends data in memory (e.g., a mapped file) as the data of a
+ *  multi-line response, followed by the terminating line, as in
+ *  send_multiline_file. If the data is known to be in the transfer
+ *  format, it is sent with any buffered replies and the terminating
+ *  line in a single system call, without being copied.
+ *
+ *  Parameters: ob: Output buffer of the connection.
+ *              data: Data to be sent.
+ *              len: Number of bytes in data.
+ *              clean: non-zero if the data can be sent unmodified.
+ *
+ *  Returns: If the data was successfully sent, returns the number of
+ *           bytes sent (including the terminating line). Otherwise,
+ *           returns -1.
+ */
+ssize_t send_multiline_data(out_buffer_t ob, const char *data, size_t len, int clean) {
+
+  char out[2 * SEND_CHUNK_SIZE + 5];
+  size_t total = 0;
+  char prev = '\n';
+
+  if (ob->failed)
+    return -1;
+
+  // a non-blocking buffer keeps what the socket does not take, so the
+  // data is copied
+  if (clean && ob->nonblocking) {
+    if (ob_write(ob, data, len) < 0 || ob_write(ob, ".\r\n", 3) < 0)
+      return -1;
+    return len + 3;
+  }
+
+  if (clean) {
+    if (ob_wait_commit(ob) < 0)
+      return -1;
+    struct iovec iov[3] = {
+      { ob->buf, ob->len },
+      { (void *) data, len },
+      { ".\r\n", 3 }
+    };
+    ob->len = 0;
+    if (send_segments(ob->fd, iov, 3) < 0) {
+      ob->failed = 1;
+      return -1;
+    }
+    return len + 3;
+  }
+
+  for (size_t i = 0; i < len; i += SEND_CHUNK_SIZE) {
+    size_t chunk = len - i < SEND_CHUNK_SIZE ? len - i : SEND_CHUNK_SIZE;
+    size_t o = textscan_stuff(data + i, chunk, out, &prev);
+    if (ob_write(ob, out, o) < 0)
+      return -1;
+    total += o;
+  }
+
+  size_t o = end_multiline(out, prev);
+  if (ob_write(ob, out, o) < 0)
+    return -1;
+  return total + o;
+}
+
+/** Adds a printf-style formatted string to an output buffer, with
+ *  the same format rules as send_formatted. The string is formatted
+ *  directly into the buffer if it fits.
+ *
+ *  Parameters: out: buffer object.
+ *              str: String to be sent, including potential
+ *                   printf-like format directives.
+ *              additional parameters based on string format.
+ *
+ *  Returns: If the string was buffered or sent, returns its
+ *           length. Otherwise, returns -1.
+ */
+int ob_printf(out_buffer_t out, const char *str, ...) {
+
+  va_list args;
+  int strsize;
+
+  if (out->failed)
+    return -1;
+
+  va_start(args, str);
+  strsize = vsnprintf(out->buf + out->len, out->capacity - out->len, str, args);
+  va_end(args);
+  if (strsize < 0)
+    return -1;
+  if (strsize < out->capacity - out->len) {
+    out->len += strsize;
+    return strsize;
+  }
+
+  // A non-blocking buffer makes room for the string in the buffer
+  if (out->nonblocking) {
+    if (ob_make_room(out, strsize + 1) < 0)
+      return -1;
+    va_start(args, str);
+    vsnprintf(out->buf + out->len, out->capacity - out->len, str, args);
+    va_end(args);
+    out->len += strsize;
+    return strsize;
+  }
+
+  // If the string does not fit in the space left, the buffer is sent
+  // and the string is formatted again at its start
+  if (strsize < out->size) {
+    if (ob_flush(out) < 0)
+      return -1;
+    va_start(args, str);
+    vsnprintf(out->buf, out->size, str, args);
+    va_end(args);
+    out->len = strsize;
+    return strsize;
+  }
+
+  // Strings bigger than the buffer are formatted in a separate buffer
+  // and sent along with the buffered data
+  char *buf = malloc(strsize + 1);
+  va_start(args, str);
+  vsnprintf(buf, strsize + 1, str, args);
+  va_end(args);
+  int rv = ob_write(out, buf, strsize);
+  free(buf);
+  return rv;
+}
@@ -8,10 +8,113 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Default size of the output buffer of a connection
+#define OUT_BUFFER_SIZE 16384
+
+// Options accepted by server_config_option, to be used in getopt
+#define SERVER_OPTIONS "m:w:c:b:t:T:u"
+
+// Usage string describing the options in SERVER_OPTIONS
+#define SERVER_USAGE "[-m fork|prefork|thread|event] [-w workers] [-c max_sessions] [-b backlog] [-t timeout] [-T trace_sample] [-u]"
+
+typedef struct out_buffer *out_buffer_t;
+
+// Reply formatted in advance, sent as is with send_static, so fixed
+// replies don't go through printf for every command
+struct static_reply {
+  const char *text;
+  size_t      len;
+};
+
+// Initializer of a static_reply for a string literal
+#define STATIC_REPLY(text) { text, sizeof(text) - 1 }
+
+typedef enum {
+  SERVER_MODE_FORK,    // one forked process per connection
+  SERVER_MODE_PREFORK, // pool of pre-forked processes blocking in accept
+  SERVER_MODE_THREAD,  // pool of threads blocking in accept
+  SERVER_MODE_EVENT,   // non-blocking sessions on one epoll loop per core
+} server_mode_t;
+
+struct server_config {
+  const char   *port;
+  server_mode_t mode;
+  int           workers;      // pool size or number of event loops, 0 for default
+  int           max_sessions; // maximum concurrent sessions, 0 for unlimited
+  int           backlog;      // size of the listen queue
+  int           io_uring;     // 1 if file operations may use io_uring
+  unsigned int  timeout;      // limit on session idle timeouts, in seconds, 0 for none
+  unsigned int  trace_sample; // one in this many sessions is traced, 0 for none
+};
+
+// Callbacks used to drive a protocol session as a state machine, one
+// line at a time. open is called once the connection is accepted
+// (and usually sends the greeting), line is called for each line
+// received, and returns non-zero if the connection should be closed,
+// and close is called before the socket is closed. The line passed
+// to line is null-terminated and may be modified, but is only valid
+// during the call. Replies are written to the connection's output
+// buffer, which is flushed by the server once the received lines are
+// processed.
+//
+// data is optional. If set, it is called before any line is passed to
+// line, with all the data received and not yet consumed, and returns
+// the number of bytes it consumed (0 if it needs more data), or -1 if
+// the data must be passed to line one line at a time instead (e.g.,
+// if the session is receiving commands rather than message contents).
+//
+// flush is optional. If set, it is called once all complete lines
+// received so far are processed, before the replies are sent, so a
+// session may hold replies to pipelined commands and produce them
+// together (e.g., after a single lookup for all of them).
+//
+// timeout is optional. If set, it returns how long (in milliseconds)
+// the session may wait for the next line or block of data in its
+// current state, or 0 for no limit. It is checked again every time
+// the session consumes input, so a client sending a partial line
+// slowly is not given more time. Once the time passes, expire (if
+// set) is called, e.g. to send a final reply, and the connection is
+// closed.
+struct session_handler {
+  void *(*open)(out_buffer_t out);
+  int   (*line)(void *session, char *line, int len);
+  void  (*close)(void *session);
+  int   (*data)(void *session, char *data, int len);
+  void  (*flush)(void *session);
+  unsigned int (*timeout)(void *session);
+  void  (*expire)(void *session);
+};
 
 void run_server(const char *port, void (*handler)(int));
 
+void server_config_init(struct server_config *config);
+int server_config_option(struct server_config *config, int opt, const char *arg);
+void run_configured_server(const struct server_config *config, void (*handler)(int),
+			   const struct session_handler *session, size_t max_line);
+unsigned int session_timeout(const struct session_handler *handler, void *session);
+
 int send_all(int fd, char buf[], size_t size);
+ssize_t send_file(int fd, int file_fd, off_t offset, size_t size);
+ssize_t send_multiline_file(out_buffer_t out, int file_fd, int clean);
+ssize_t send_multiline_data(out_buffer_t out, const char *data, size_t len, int clean);
+
+out_buffer_t ob_create(int fd, size_t size);
+void ob_destroy(out_buffer_t out);
+int ob_fd(out_buffer_t out);
+int ob_write(out_buffer_t out, const void *data, size_t len);
+int ob_flush(out_buffer_t out);
+void ob_require_commit(out_buffer_t out, uint64_t ticket);
+int ob_printf(out_buffer_t out, const char *str, ...)
+  __attribute__ ((format(printf, 2, 3)));
+int ob_write_uint(out_buffer_t out, uint64_t value);
+int send_static(out_buffer_t out, const struct static_reply *reply);
+int send_committed(out_buffer_t out, uint64_t ticket, const struct static_reply *reply,
+		   const struct static_reply *failed);
+void static_reply_format(struct static_reply *reply, const char *str, ...)
+  __attribute__ ((format(printf, 2, 3)));
 
 // The __attribute__ in this function allows the compiler to provided
 // useful warnings when compiling the code.
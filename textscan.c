@@ -0,0 +1,168 @@
+/* textscan.c
+ * Scanning of message text in blocks.
+ *
+ * Message contents are mostly plain text where only two bytes matter
+ * to the protocols: the LF ending each line (which must be preceded
+ * by CR when sent) and a dot at the start of a line (which is
+ * stuffed when sent, and may be the end of the data when received).
+ * Instead of examining every byte, the scanner searches a whole
+ * block for the next of these bytes, 16 bytes at a time with SSE2 or
+ * 32 at a time with AVX2 (selected once, on the first call,
+ * depending on the processor), and the bytes in between are copied
+ * or written as they are. Other processors use a byte-by-byte
+ * search.
+ */
+
+#include "textscan.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXTSCAN_X86 1
+#endif
+
+/** Internal function that finds the first occurrence of either of
+ *  two bytes, examining one byte at a time.
+ */
+static const char *find_scalar(const char *p, const char *end, char a, char b) {
+  for (; p < end; p++) {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return end;
+}
+
+#ifdef TEXTSCAN_X86
+__attribute__ ((target("sse2")))
+static const char *find_sse2(const char *p, const char *end, char a, char b) {
+
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+							_mm_cmpeq_epi8(v, vb)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return find_scalar(p, end, a, b);
+}
+
+__attribute__ ((target("avx2")))
+static const char *find_avx2(const char *p, const char *end, char a, char b) {
+
+  const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+							     _mm256_cmpeq_epi8(v, vb)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return find_sse2(p, end, a, b);
+}
+#endif
+
+static const char *find_first(const char *p, const char *end, char a, char b);
+
+// Implementation used by textscan_find, chosen on the first call
+static const char *(*find_impl)(const char *, const char *, char, char) = find_first;
+
+/** Internal function that selects the implementation for this
+ *  processor, and runs it.
+ */
+static const char *find_first(const char *p, const char *end, char a, char b) {
+
+  const char *(*impl)(const char *, const char *, char, char) = find_scalar;
+#ifdef TEXTSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    impl = find_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    impl = find_sse2;
+#endif
+  __atomic_store_n(&find_impl, impl, __ATOMIC_RELAXED);
+  return impl(p, end, a, b);
+}
+
+/** Finds the first occurrence of either of two bytes in a block.
+ *
+ *  Parameters: p: Start of the block.
+ *              end: End of the block.
+ *              a, b: Bytes to be found.
+ *
+ *  Returns: Position of the first byte equal to a or b, or end if
+ *           there is none.
+ */
+const char *textscan_find(const char *p, const char *end, char a, char b) {
+  return __atomic_load_n(&find_impl, __ATOMIC_RELAXED)(p, end, a, b);
+}
+
+/** Finds the first dot at the start of a line in a block (i.e., the
+ *  first dot-stuffed line, or the terminating line, of received
+ *  multi-line data). Dots are rare in text, so the block is searched
+ *  for dots only, and the byte before each dot is checked.
+ *
+ *  Parameters: p: Start of the block.
+ *              end: End of the block.
+ *              prev: Byte before the block ('\n' if it starts a line).
+ *
+ *  Returns: Position of the first dot starting a line, or end if
+ *           there is none.
+ */
+const char *textscan_line_dot(const char *p, const char *end, char prev) {
+
+  const char *start = p;
+  while (p < end) {
+    const char *dot = memchr(p, '.', end - p);
+    if (!dot)
+      return end;
+    if ((dot == start ? prev : dot[-1]) == '\n')
+      return dot;
+    p = dot + 1;
+  }
+  return end;
+}
+
+/** Converts a block of the data of a multi-line response to the
+ *  transfer format, dot-stuffing lines starting with a dot and
+ *  replacing bare LF characters by CRLF. Text between line
+ *  terminators and dots is copied unchanged.
+ *
+ *  Parameters: in: Data to be converted.
+ *              len: Number of bytes in in.
+ *              out: Buffer of at least 2 * len bytes.
+ *              prev: Last byte of the previous block ('\n' for the
+ *                    first block), updated to the last byte of this
+ *                    block.
+ *
+ *  Returns: The number of bytes written to out.
+ */
+size_t textscan_stuff(const char *in, size_t len, char *out, char *prev) {
+
+  const char *p = in, *end = in + len;
+  char *o = out;
+  char last = *prev;
+
+  while (p < end) {
+    const char *q = textscan_find(p, end, '\n', '.');
+    if (q > p) {
+      memcpy(o, p, q - p);
+      o += q - p;
+      last = q[-1];
+    }
+    if (q == end)
+      break;
+    if (*q == '.' ? last == '\n' : last != '\r')
+      *o++ = *q == '.' ? '.' : '\r';
+    *o++ = *q;
+    last = *q;
+    p = q + 1;
+  }
+
+  *prev = last;
+  return o - out;
+}
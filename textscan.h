@@ -0,0 +1,15 @@
+/* textscan.h
+ * Scanning of message text in blocks, for the dot-stuffing and line
+ * terminators of SMTP and POP3 multi-line data.
+ */
+
+#ifndef _TEXTSCAN_H_
+#define _TEXTSCAN_H_
+
+#include <stddef.h>
+
+const char *textscan_find(const char *p, const char *end, char a, char b);
+const char *textscan_line_dot(const char *p, const char *end, char prev);
+size_t textscan_stuff(const char *in, size_t len, char *out, char *prev);
+
+#endif
@@ -0,0 +1,187 @@
+/* timerwheel.c
+ * Hierarchical timer wheel.
+ *
+ * Time is divided in ticks of 2^TIMER_TICK_BITS milliseconds. The
+ * wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each; a timer
+ * expiring within TIMER_SLOTS ticks is kept in the first level, in
+ * the slot of its tick, and later timers in the level whose slots
+ * cover a range of ticks that includes it. Each slot is a doubly
+ * linked list, so a timer is armed or cancelled in constant time,
+ * wherever it is. As time advances, the slots of the first level are
+ * run one tick at a time, and every time the first level wraps
+ * around, the next slot of the level above is moved down (and so on
+ * up the levels), so each timer is moved at most TIMER_LEVELS - 1
+ * times before it runs.
+ *
+ * A wheel is not locked; it is meant to be used by a single thread
+ * (e.g., an event loop, for the timeouts of its connections).
+ */
+
+#include "timerwheel.h"
+
+#include <stddef.h>
+#include <limits.h>
+
+#define TIMER_MAX_TICKS ((uint64_t) 1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+/** Initializes an empty wheel.
+ *
+ *  Parameters: wheel: Wheel to be initialized.
+ *              now_ms: Current time, in milliseconds.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+  wheel->now = now_ms >> TIMER_TICK_BITS;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_SLOTS; slot++)
+      wheel->slots[level][slot] = NULL;
+  }
+}
+
+/** Initializes a timer that is not armed.
+ *
+ *  Parameters: timer: Timer to be initialized.
+ *              callback: Function called when the timer expires.
+ */
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer)) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->callback = callback;
+}
+
+/** Internal function that adds a timer to the slot covering its
+ *  expiration tick. Timers expiring before the base tick (the next
+ *  tick to be run) expire at that tick instead.
+ */
+static void link_timer(struct timer_wheel *wheel, struct timer *timer, uint64_t base) {
+
+  if (timer->expires < base)
+    timer->expires = base;
+  if (timer->expires - wheel->now >= TIMER_MAX_TICKS)
+    timer->expires = wheel->now + TIMER_MAX_TICKS - 1;
+
+  uint64_t delta = timer->expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >= (uint64_t) 1 << (TIMER_LEVEL_BITS * (level + 1)))
+    level++;
+
+  struct timer **slot = &wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) &
+					     (TIMER_SLOTS - 1)];
+  timer->next = *slot;
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/** Internal function that removes a timer from its slot.
+ */
+static void unlink_timer(struct timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/** Arms a timer, replacing its previous expiration time if it was
+ *  already armed.
+ *
+ *  Parameters: wheel: Wheel the timer is added to.
+ *              timer: Timer to be armed.
+ *              expires_ms: Time the timer expires, in milliseconds
+ *                          (rounded up to the next tick).
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms) {
+
+  timer_cancel(wheel, timer);
+  timer->expires = (expires_ms + (1 << TIMER_TICK_BITS) - 1) >> TIMER_TICK_BITS;
+  link_timer(wheel, timer, wheel->now + 1);
+  wheel->count++;
+}
+
+/** Cancels a timer. Nothing is done if the timer is not armed.
+ *
+ *  Parameters: wheel: Wheel the timer was added to.
+ *              timer: Timer to be cancelled.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+  if (timer->pprev) {
+    unlink_timer(timer);
+    wheel->count--;
+  }
+}
+
+/** Internal function that moves the timers of the current slot of a
+ *  level to the levels below, once the level below wraps around.
+ */
+static void cascade(struct timer_wheel *wheel, int level) {
+
+  struct timer **slot = &wheel->slots[level][(wheel->now >> (TIMER_LEVEL_BITS * level)) &
+					     (TIMER_SLOTS - 1)];
+  struct timer *timer = *slot;
+  *slot = NULL;
+  while (timer) {
+    struct timer *next = timer->next;
+    link_timer(wheel, timer, wheel->now);
+    timer = next;
+  }
+}
+
+/** Runs all timers expiring up to the current time, in the order of
+ *  their expiration ticks.
+ *
+ *  Parameters: wheel: Wheel to be advanced.
+ *              now_ms: Current time, in milliseconds.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms) {
+
+  uint64_t target = now_ms >> TIMER_TICK_BITS;
+  while (wheel->now < target) {
+    if (!wheel->count) {
+      wheel->now = target;
+      break;
+    }
+
+    wheel->now++;
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+      if ((wheel->now >> (TIMER_LEVEL_BITS * (level - 1))) & (TIMER_SLOTS - 1))
+	break;
+      cascade(wheel, level);
+    }
+
+    struct timer **slot = &wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+    while (*slot) {
+      struct timer *timer = *slot;
+      unlink_timer(timer);
+      wheel->count--;
+      timer->callback(timer);
+    }
+  }
+}
+
+/** Returns how long a caller may wait before advancing the wheel
+ *  again (e.g., as the timeout of epoll_wait): until the next tick
+ *  that has timers to run, or at which timers are moved between
+ *  levels, whichever comes first.
+ *
+ *  Parameters: wheel: Wheel to be checked.
+ *              now_ms: Current time, in milliseconds.
+ *
+ *  Returns: The time to wait, in milliseconds, or -1 if no timer is
+ *           armed.
+ */
+int timer_wheel_next(const struct timer_wheel *wheel, uint64_t now_ms) {
+
+  if (!wheel->count)
+    return -1;
+
+  uint64_t tick = wheel->now + 1;
+  while ((tick & (TIMER_SLOTS - 1)) && !wheel->slots[0][tick & (TIMER_SLOTS - 1)])
+    tick++;
+
+  uint64_t at = tick << TIMER_TICK_BITS;
+  if (at <= now_ms)
+    return 0;
+  return at - now_ms > INT_MAX ? INT_MAX : (int) (at - now_ms);
+}
@@ -0,0 +1,38 @@
+/* timerwheel.h
+ * Hierarchical timer wheel, for timeouts of many connections with
+ * constant-time arming and cancelling.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#define TIMER_TICK_BITS  7 // a tick is 2^7 = 128 milliseconds
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVELS     4 // timers up to 2^24 ticks (about 24 days) ahead
+#define TIMER_SLOTS      (1 << TIMER_LEVEL_BITS)
+
+// Timer embedded in the object it belongs to; the callback receives
+// the timer, and may arm or cancel any timer (including itself)
+struct timer {
+  struct timer  *next;
+  struct timer **pprev;   // link pointing to this timer, NULL if not armed
+  uint64_t       expires; // tick the timer expires at
+  void         (*callback)(struct timer *timer);
+};
+
+struct timer_wheel {
+  uint64_t      now;   // last tick processed
+  unsigned int  count; // timers armed
+  struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer));
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms);
+int timer_wheel_next(const struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,178 @@
+/* trace.c
+ * Sampled tracing of sessions.
+ *
+ * Like the metrics segment (see metrics.c), the trace segment is a
+ * file mapped with MAP_SHARED before the server starts accepting
+ * connections, so it is shared by every process and thread. One in
+ * every "sample" sessions is traced: its operations are recorded as
+ * spans (start time and duration) in a ring, which keeps the latest
+ * TRACE_RING_EVENTS spans. Each worker thread or process claims a
+ * ring the first time it records a span. Rings are not locked: a
+ * span is added by reserving its position with an atomic increment
+ * of the ring's head, so workers that end up sharing a ring (e.g.,
+ * forked processes, once there are more than TRACE_RINGS of them)
+ * never write the same event.
+ *
+ * The file can be read at any time, or after the server stops, and is
+ * converted to the Chrome trace format by trace2json.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+__thread uint32_t trace_current = 0;
+
+static struct trace_segment *segment = NULL;
+
+// Ring where the current thread records its spans, claimed on first
+// use, and the process that claimed it (a process forked after that
+// claims its own ring when it starts a session)
+static __thread struct trace_ring *thread_ring = NULL;
+static __thread uint32_t thread_pid = 0;
+
+static const char *const point_names[TRACE_POINTS] = {
+  "session", "recv", "send", "sendfile", "file_read", "user_lookup", "load_mail", "save_mail"
+};
+
+/** Creates the trace segment in a file, replacing any existing
+ *  trace, and starts tracing one in every sample sessions.
+ *
+ *  Parameters: path: Name of the file backing the segment.
+ *              sample: Sessions per traced session (1 traces all).
+ *
+ *  Returns: 0 if the segment was created, -1 otherwise.
+ */
+int trace_open(const char *path, unsigned int sample) {
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct trace_segment)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  struct trace_segment *s = mmap(NULL, sizeof(struct trace_segment),
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED)
+    return -1;
+
+  for (int i = 0; i < TRACE_POINTS; i++)
+    snprintf(s->point_names[i], TRACE_NAME_SIZE, "%s", point_names[i]);
+  s->point_count = TRACE_POINTS;
+  s->sample = sample ? sample : 1;
+  s->version = TRACE_VERSION;
+  __atomic_store_n(&s->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+
+  segment = s;
+  return 0;
+}
+
+/** Maps an existing trace file for reading, e.g., by trace2json.
+ *
+ *  Parameters: path: Name of the file backing the segment.
+ *
+ *  Returns: The mapped segment, or NULL if the file cannot be mapped
+ *           or does not contain a valid segment.
+ */
+struct trace_segment *trace_map(const char *path) {
+
+  struct stat file_stat;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size < sizeof(struct trace_segment)) {
+    close(fd);
+    return NULL;
+  }
+
+  struct trace_segment *s = mmap(NULL, sizeof(struct trace_segment),
+				 PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED)
+    return NULL;
+  if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC ||
+      s->version != TRACE_VERSION) {
+    munmap(s, sizeof(struct trace_segment));
+    return NULL;
+  }
+  return s;
+}
+
+/** Starts a new session, deciding whether it is traced, and makes it
+ *  the current session of the thread.
+ *
+ *  Returns: The id of the session if it is traced, to be passed to
+ *           trace_session_switch, or 0 otherwise.
+ */
+uint32_t trace_session_open(void) {
+
+  trace_current = 0;
+  if (!segment)
+    return 0;
+  uint64_t n = __atomic_fetch_add(&segment->sessions, 1, __ATOMIC_RELAXED);
+  if (n % segment->sample == 0) {
+    trace_current = (uint32_t) (n / segment->sample) + 1;
+    if (thread_ring && thread_pid != getpid())
+      thread_ring = NULL;
+  }
+  return trace_current;
+}
+
+/** Makes a session the current session of the thread, e.g., when an
+ *  event loop handles its connection.
+ *
+ *  Parameters: session: Id returned by trace_session_open, or 0 if
+ *                       the session is not traced.
+ */
+void trace_session_switch(uint32_t session) {
+  trace_current = session;
+}
+
+/** Ends the current session of the thread, recording its span if it
+ *  is traced.
+ *
+ *  Parameters: start: Time the session started (metrics_now).
+ */
+void trace_session_close(uint64_t start) {
+  if (trace_current)
+    trace_span(TRACE_SESSION, start);
+  trace_current = 0;
+}
+
+/** Records a span of the current session, from its start until now.
+ *
+ *  Parameters: point: Trace point (TRACE_RECV, etc).
+ *              start: Time the span started (from TRACE_START).
+ */
+void trace_span(int point, uint64_t start) {
+
+  if (!segment || !trace_current)
+    return;
+
+  uint64_t now = metrics_now();
+  if (!thread_ring) {
+    uint64_t n = __atomic_fetch_add(&segment->next_ring, 1, __ATOMIC_RELAXED);
+    thread_ring = &segment->rings[n % TRACE_RINGS];
+    thread_pid = getpid();
+  }
+
+  uint64_t pos = __atomic_fetch_add(&thread_ring->head, 1, __ATOMIC_RELAXED);
+  struct trace_event *e = &thread_ring->events[pos & (TRACE_RING_EVENTS - 1)];
+  __atomic_store_n(&e->stamp, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->start = start;
+  e->duration = now - start > UINT32_MAX ? UINT32_MAX : now - start;
+  e->session = trace_current;
+  e->pid = thread_pid;
+  e->point = point;
+  __atomic_store_n(&e->stamp, pos + 1, __ATOMIC_RELEASE);
+}
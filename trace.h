@@ -0,0 +1,82 @@
+/* trace.h
+ * Sampled tracing of sessions: timed spans of the operations of a
+ * session, recorded in rings kept in a shared-memory segment.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "metrics.h"
+
+#include <stdint.h>
+
+#define TRACE_MAGIC       0x43525454 // "TTRC"
+#define TRACE_VERSION     1
+#define TRACE_RINGS       64   // rings shared by all workers
+#define TRACE_RING_EVENTS 2048 // events kept in each ring (power of two)
+#define TRACE_MAX_POINTS  16   // maximum number of trace points
+#define TRACE_NAME_SIZE   16   // size of a trace point name, including null byte
+
+// Trace points, in the same order as their names in trace.c
+enum { TRACE_SESSION, TRACE_RECV, TRACE_SEND, TRACE_SENDFILE, TRACE_FILE_READ,
+       TRACE_USER_LOOKUP, TRACE_LOAD_MAIL, TRACE_SAVE_MAIL, TRACE_POINTS };
+
+// A span of a sampled session. stamp is written last, so readers
+// can tell complete events from those being written or overwritten.
+struct trace_event {
+  uint64_t start;    // time the span started (metrics_now)
+  uint32_t duration; // microseconds
+  uint32_t session;  // sampled session the span belongs to
+  uint32_t pid;      // process that recorded the span
+  uint16_t point;
+  uint16_t reserved;
+  uint64_t stamp;    // position of the event in its ring plus one, 0 while written
+};
+
+struct trace_ring {
+  uint64_t head;        // events ever added to the ring
+  uint64_t padding[7];  // keeps heads of different rings in different cache lines
+  struct trace_event events[TRACE_RING_EVENTS];
+};
+
+// Layout of the shared segment, which is also the format of the
+// trace file read by trace2json
+struct trace_segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t point_count;
+  uint32_t sample;      // one in this many sessions is traced
+  uint64_t sessions;    // sessions started, traced or not
+  uint64_t next_ring;   // ring claimed by the next worker
+  char     point_names[TRACE_MAX_POINTS][TRACE_NAME_SIZE];
+  struct trace_ring rings[TRACE_RINGS];
+};
+
+// Session traced by the current thread, 0 if none
+extern __thread uint32_t trace_current;
+
+int trace_open(const char *path, unsigned int sample);
+struct trace_segment *trace_map(const char *path);
+
+uint32_t trace_session_open(void);
+void trace_session_switch(uint32_t session);
+void trace_session_close(uint64_t start);
+void trace_span(int point, uint64_t start);
+
+// Trace points are placed around an operation with TRACE_START and
+// TRACE_SPAN. Unless the current session is traced, TRACE_START only
+// reads a thread-local variable, and TRACE_SPAN does nothing. Both
+// are removed if the server is built with -DTRACE_DISABLED.
+#ifdef TRACE_DISABLED
+#define TRACE_START() ((uint64_t) 0)
+#define TRACE_SPAN(point, start) ((void) (start))
+#else
+#define TRACE_START() (trace_current ? metrics_now() : 0)
+#define TRACE_SPAN(point, start)		\
+  do {						\
+    if (start)					\
+      trace_span(point, start);			\
+  } while (0)
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/* trace2json.c
+ * Converts a trace file written by a server (see trace.c) to the
+ * Chrome trace event format (JSON), which can be loaded in
+ * chrome://tracing or Perfetto. Each traced session is shown as its
+ * own thread, within the process that served it.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Orders events by start time.
+ */
+static int compare_events(const void *a, const void *b) {
+  const struct trace_event *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/** Copies the complete events of a ring, skipping events that were
+ *  being written (or overwritten) while the ring was read.
+ *
+ *  Returns: The number of events copied to out.
+ */
+static size_t read_ring(const struct trace_ring *ring, struct trace_event *out) {
+
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+  size_t count = 0;
+
+  for (uint64_t pos = first; pos < head; pos++) {
+    const struct trace_event *e = &ring->events[pos & (TRACE_RING_EVENTS - 1)];
+    if (__atomic_load_n(&e->stamp, __ATOMIC_ACQUIRE) != pos + 1)
+      continue;
+    out[count] = *e;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->stamp, __ATOMIC_RELAXED) == pos + 1)
+      count++;
+  }
+  return count;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc != 2) {
+    fprintf(stderr, "Invalid arguments. Expected: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  struct trace_segment *s = trace_map(argv[1]);
+  if (!s) {
+    fprintf(stderr, "%s: not a valid trace file\n", argv[1]);
+    return 1;
+  }
+
+  struct trace_event *events = malloc(sizeof(struct trace_event) * TRACE_RINGS * TRACE_RING_EVENTS);
+  size_t count = 0;
+  for (int i = 0; i < TRACE_RINGS; i++)
+    count += read_ring(&s->rings[i], events + count);
+  qsort(events, count, sizeof(struct trace_event), compare_events);
+
+  printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (size_t i = 0; i < count; i++) {
+    const struct trace_event *e = &events[i];
+    const char *name = e->point < s->point_count ? s->point_names[e->point] : "unknown";
+    printf("%s\n{\"name\":\"%.*s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%u,\"tid\":%u}",
+	   i ? "," : "", TRACE_NAME_SIZE, name, (unsigned long long) e->start,
+	   e->duration, e->pid, e->session);
+  }
+  printf("\n]}\n");
+
+  free(events);
+  return 0;
+}
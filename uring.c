@@ -0,0 +1,307 @@
+/* uring.c
+ * Optional io_uring backend for file operations, using the system
+ * calls directly (liburing is not required).
+ *
+ * Each thread (or process, in forked modes) that submits an
+ * operation gets its own ring, created on first use, so no locking
+ * is needed. Operations are queued by uring_statx, uring_read and
+ * uring_write and submitted together when uring_submit or
+ * uring_wait is called (or when the submission queue is full), so a
+ * batch of operations costs a single system call, and the kernel can
+ * run them concurrently. Completions may arrive in any order; each
+ * one is routed to its uring_op through the user data of the
+ * request.
+ *
+ * The backend is disabled unless uring_enable is called, and any
+ * thread whose ring cannot be created (e.g., if the kernel does not
+ * support io_uring) behaves as if it was disabled. Callers are
+ * expected to fall back to the equivalent blocking system call when
+ * an operation cannot be queued (returns -1).
+ */
+
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64 // size of the submission queue of each ring
+
+struct uring {
+  int                  fd;
+  pid_t                pid;       // process that created the ring
+  unsigned int        *sq_head;
+  unsigned int        *sq_tail;
+  unsigned int         sq_mask;
+  unsigned int         sq_entries;
+  unsigned int        *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int        *cq_head;
+  unsigned int        *cq_tail;
+  unsigned int         cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int         queued;    // requests queued but not yet submitted
+  int                  failed;    // 1 if the ring could not be created
+};
+
+static int enabled = 0;
+static __thread struct uring thread_ring;
+
+/** Enables the io_uring backend for all threads and processes
+ *  created afterwards.
+ */
+void uring_enable(void) {
+  enabled = 1;
+}
+
+/** Internal function that creates the ring of the calling thread.
+ *
+ *  Returns: 0 if the ring was created, -1 otherwise.
+ */
+static int create_ring(struct uring *r) {
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (r->fd < 0)
+    return -1;
+  fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+
+  // kernels without a single mapping for both rings are not supported
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+    close(r->fd);
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+  char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    r->fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    close(r->fd);
+    return -1;
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    munmap(ring, ring_size);
+    close(r->fd);
+    return -1;
+  }
+
+  r->sq_head    = (unsigned int *) (ring + p.sq_off.head);
+  r->sq_tail    = (unsigned int *) (ring + p.sq_off.tail);
+  r->sq_mask    = *(unsigned int *) (ring + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_array   = (unsigned int *) (ring + p.sq_off.array);
+  r->cq_head    = (unsigned int *) (ring + p.cq_off.head);
+  r->cq_tail    = (unsigned int *) (ring + p.cq_off.tail);
+  r->cq_mask    = *(unsigned int *) (ring + p.cq_off.ring_mask);
+  r->cqes       = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+  r->queued     = 0;
+  return 0;
+}
+
+/** Internal function that returns the ring of the calling thread,
+ *  creating it if needed, or NULL if the backend is not available.
+ *  A ring inherited from a parent process is never used (and its
+ *  mappings are left in place, since they are shared with the
+ *  parent's ring).
+ */
+static struct uring *get_ring(void) {
+
+  struct uring *r = &thread_ring;
+  if (!enabled)
+    return NULL;
+  if (r->pid != getpid()) {
+    r->pid = getpid();
+    r->failed = create_ring(r) < 0;
+  }
+  return r->failed ? NULL : r;
+}
+
+/** Returns 1 if operations can be queued by the calling thread, 0 if
+ *  the blocking system calls must be used instead.
+ */
+int uring_available(void) {
+  return get_ring() != NULL;
+}
+
+/** Internal function that submits all queued requests, optionally
+ *  waiting for at least one completion.
+ *
+ *  Returns: 0 on success, -1 if the ring failed.
+ */
+static int enter_ring(struct uring *r, unsigned int wait) {
+
+  while (1) {
+    int rv = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+		     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rv >= 0) {
+      r->queued -= rv;
+      if (!r->queued || wait)
+	return 0;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("io_uring_enter");
+      return -1;
+    }
+  }
+}
+
+/** Internal function that moves all available completions to their
+ *  operations.
+ */
+static void reap_completions(struct uring *r) {
+
+  unsigned int head = *r->cq_head;
+  unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+    struct uring_op *op = (struct uring_op *) (uintptr_t) cqe->user_data;
+    op->res = cqe->res;
+    op->pending = 0;
+    head++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/** Internal function that queues a request, submitting the queue
+ *  first if it is full.
+ *
+ *  Returns: The request to be filled, or NULL if the backend is not
+ *           available.
+ */
+static struct io_uring_sqe *queue_request(struct uring_op *op) {
+
+  struct uring *r = get_ring();
+  if (!r)
+    return NULL;
+
+  unsigned int tail = *r->sq_tail;
+  while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    if (enter_ring(r, 0) < 0)
+      return NULL;
+  }
+
+  unsigned int index = tail & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t) op;
+  r->sq_array[index] = index;
+  op->pending = 1;
+  return sqe;
+}
+
+/** Internal function that makes a filled request visible to the
+ *  kernel, to be submitted with the rest of the queue.
+ */
+static void commit_request(void) {
+  struct uring *r = &thread_ring;
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+  r->queued++;
+}
+
+/** Queues a lookup of the metadata of a file, as fstatat.
+ *
+ *  Parameters: dirfd: Directory the path is relative to.
+ *              path: Path of the file (must be valid until done).
+ *              st: Operation and its result; st->stx is filled once
+ *                  the operation is done, if st->op.res is 0.
+ *
+ *  Returns: 0 if the operation was queued, -1 if the backend is not
+ *           available.
+ */
+int uring_statx(int dirfd, const char *path, struct uring_stat *st) {
+
+  struct io_uring_sqe *sqe = queue_request(&st->op);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t) path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uintptr_t) &st->stx;
+  commit_request();
+  return 0;
+}
+
+/** Queues a read from a file, as pread.
+ *
+ *  Returns: 0 if the operation was queued, -1 if the backend is not
+ *           available.
+ */
+int uring_read(int fd, void *buf, size_t len, off_t offset, struct uring_op *op) {
+
+  struct io_uring_sqe *sqe = queue_request(op);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = offset;
+  commit_request();
+  return 0;
+}
+
+/** Queues a write to a file, as pwrite.
+ *
+ *  Returns: 0 if the operation was queued, -1 if the backend is not
+ *           available.
+ */
+int uring_write(int fd, const void *buf, size_t len, off_t offset, struct uring_op *op) {
+
+  struct io_uring_sqe *sqe = queue_request(op);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = offset;
+  commit_request();
+  return 0;
+}
+
+/** Submits all queued operations of the calling thread, without
+ *  waiting for them.
+ */
+void uring_submit(void) {
+  struct uring *r = get_ring();
+  if (r && r->queued)
+    enter_ring(r, 0);
+}
+
+/** Waits for an operation to be done, submitting any queued
+ *  operations first. Completions of other operations received in the
+ *  meantime are also recorded.
+ *
+ *  Parameters: op: Operation queued by the calling thread.
+ *
+ *  Returns: The result of the operation, or -EIO if the ring failed.
+ */
+int uring_wait(struct uring_op *op) {
+
+  struct uring *r = get_ring();
+  if (!r)
+    return op->res;
+
+  reap_completions(r);
+  while (op->pending) {
+    if (enter_ring(r, 1) < 0) {
+      op->pending = 0;
+      op->res = -EIO;
+      break;
+    }
+    reap_completions(r);
+  }
+  return op->res;
+}
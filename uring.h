@@ -0,0 +1,35 @@
+/* uring.h
+ * Optional io_uring backend for file operations, so that reads,
+ * writes and metadata lookups can be submitted in batches or
+ * overlapped with other work, instead of blocking one at a time.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/stat.h>
+
+// Completion of an operation. An operation must not be reused, and
+// its buffers must not be modified or freed, until it is done.
+struct uring_op {
+  int pending; // 1 while the operation is submitted and not complete
+  int res;     // result, as returned by the equivalent system call (or -errno)
+};
+
+struct uring_stat {
+  struct uring_op op;
+  struct statx    stx;
+};
+
+void uring_enable(void);
+int uring_available(void);
+
+int uring_statx(int dirfd, const char *path, struct uring_stat *st);
+int uring_read(int fd, void *buf, size_t len, off_t offset, struct uring_op *op);
+int uring_write(int fd, const void *buf, size_t len, off_t offset, struct uring_op *op);
+void uring_submit(void);
+int uring_wait(struct uring_op *op);
+
+#endif
@@ -0,0 +1,476 @@
+/* userdir.c
+ * In-memory directory of users and passwords, loaded from a users
+ * file. The file contains pairs of whitespace-separated user names
+ * and passwords, and is loaded once into an open-addressing hash
+ * table keyed by the case-folded user name, so lookups don't depend
+ * on the number of users. A Bloom filter built with the table rejects
+ * most names that are not in it (e.g., recipients probed by
+ * spammers) from a single word, without touching the table.
+ *
+ * Passwords are not kept in memory: each table has a random key, and
+ * stores only a keyed hash (SipHash-2-4) of each password, which is
+ * compared with the hash of the password being checked. The
+ * passwords are erased from the file contents once they are hashed.
+ *
+ * The directory is reloaded when the file's modification time
+ * changes. The process that opens the directory checks the file in a
+ * background thread; processes forked from it (which don't inherit
+ * that thread) check the file at most once per second during
+ * lookups.
+ */
+
+#include "userdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#define MIN_TABLE_SIZE 16 // minimum number of slots in a table
+#define CHECK_INTERVAL 1  // seconds between checks of the file's mtime
+#define BLOOM_BITS_PER_USER 16 // bits of the Bloom filter for each user
+#define BLOOM_HASHES 4         // bits set for each user, all in the same word
+#define BATCH_SIZE 64          // names looked up at a time by userdir_check_users
+
+struct user_entry {
+  uint32_t    hash;
+  const char *name;     // NULL for an empty slot
+  uint64_t    password; // keyed hash of the password
+};
+
+// A table is never modified once built; reloads build a new one
+struct user_table {
+  size_t             mask;    // number of slots minus one (power of two)
+  size_t             count;   // number of users
+  struct user_entry *slots;
+  uint64_t          *bloom;      // Bloom filter of the user names
+  size_t             bloom_mask; // number of words in bloom minus one (power of two)
+  char              *strings; // file contents, where entries point to
+  struct timespec    mtime;   // modification time of the loaded file
+  off_t              size;    // size of the loaded file
+  uint64_t           key[2];  // key of the password hashes
+};
+
+struct user_directory {
+  char              *path;
+  pthread_rwlock_t   lock;       // protects table
+  pthread_mutex_t    reload_lock;
+  struct user_table *table;
+  pid_t              owner;      // process running the background thread
+  time_t             last_check; // last mtime check in other processes
+};
+
+// Directory locked around fork, so a child never inherits a lock
+// held by the background thread (only the first directory opened)
+static user_directory_t fork_dir = NULL;
+
+/** Computes the hash of a user name, ignoring case (64-bit
+ *  FNV-1a). The low bits select the slot in the table, and the high
+ *  bits the word of the Bloom filter.
+ */
+static uint64_t hash_name(const char *name) {
+
+  uint64_t h = 14695981039346656037ull;
+  for (; *name; name++) {
+    h ^= (unsigned char) tolower((unsigned char) *name);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+/** Returns the bits of the Bloom filter word set for a name hash: a
+ *  few bit positions taken from a remix of the hash, so they don't
+ *  depend on the word chosen.
+ */
+static uint64_t bloom_bits(uint64_t h) {
+
+  uint64_t mix = h * 0x9e3779b97f4a7c15ull, bits = 0;
+  for (int i = 0; i < BLOOM_HASHES; i++)
+    bits |= 1ull << ((mix >> (58 - 6 * i)) & 63);
+  return bits;
+}
+
+/** Returns the word of the Bloom filter for a name hash.
+ */
+static uint64_t *bloom_word(struct user_table *table, uint64_t h) {
+  return &table->bloom[(h >> 32) & table->bloom_mask];
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND(v0, v1, v2, v3)				    \
+  do {								    \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);	    \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;			    \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;			    \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);	    \
+  } while (0)
+
+/** Computes the keyed hash of a password (SipHash-2-4).
+ */
+static uint64_t hash_password(const uint64_t key[2], const char *password) {
+
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ull;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dull;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ull;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ull;
+  size_t len = strlen(password);
+  const unsigned char *p = (const unsigned char *) password;
+
+  for (size_t left = len; left >= 8; left -= 8, p += 8) {
+    uint64_t m;
+    memcpy(&m, p, 8);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  // the last block holds the remaining bytes and the length
+  uint64_t m = (uint64_t) len << 56;
+  for (size_t i = 0; i < len % 8; i++)
+    m |= (uint64_t) p[i] << (8 * i);
+  v3 ^= m;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; i++)
+    SIPROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/** Counts the number of whitespace-separated tokens in a string.
+ */
+static size_t count_tokens(const char *s) {
+
+  size_t rv = 0;
+  int in_token = 0;
+  for (; *s; s++) {
+    if (isspace((unsigned char) *s)) {
+      in_token = 0;
+    } else if (!in_token) {
+      in_token = 1;
+      rv++;
+    }
+  }
+  return rv;
+}
+
+/** Frees a table and all its strings.
+ */
+static void free_table(struct user_table *table) {
+  if (!table) return;
+  free(table->slots);
+  free(table->bloom);
+  free(table->strings);
+  free(table);
+}
+
+/** Reads a users file into a new table. If the file cannot be read,
+ *  returns an empty table (with a zero mtime), so the file is loaded
+ *  once it is created.
+ */
+static struct user_table *load_table(const char *path) {
+
+  struct user_table *table = calloc(1, sizeof(struct user_table));
+  struct stat file_stat;
+  size_t len = 0, capacity = MIN_TABLE_SIZE;
+  FILE *file = fopen(path, "r");
+
+  if (file && fstat(fileno(file), &file_stat) == 0) {
+    table->mtime = file_stat.st_mtim;
+    table->size = file_stat.st_size;
+    table->strings = malloc(file_stat.st_size + 1);
+    len = fread(table->strings, 1, file_stat.st_size, file);
+  } else {
+    table->strings = malloc(1);
+  }
+  if (file)
+    fclose(file);
+  table->strings[len] = 0;
+
+  // without a random key, the hashes are still not the passwords
+  if (getrandom(table->key, sizeof(table->key), GRND_NONBLOCK) != sizeof(table->key)) {
+    table->key[0] = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    table->key[1] = (uintptr_t) table;
+  }
+
+  // Size the table for a load factor of at most 1/2
+  size_t tokens = count_tokens(table->strings);
+  while (capacity < tokens)
+    capacity *= 2;
+  table->slots = calloc(capacity, sizeof(struct user_entry));
+  table->mask = capacity - 1;
+
+  size_t words = 1;
+  while (words * 64 < tokens / 2 * BLOOM_BITS_PER_USER)
+    words *= 2;
+  table->bloom = calloc(words, sizeof(uint64_t));
+  table->bloom_mask = words - 1;
+
+  char *save;
+  char *name = strtok_r(table->strings, " \t\r\n\v\f", &save);
+  while (name) {
+    char *password = strtok_r(NULL, " \t\r\n\v\f", &save);
+    if (!password)
+      break;
+
+    uint64_t h = hash_name(name);
+    size_t i = h & table->mask;
+    while (table->slots[i].name && strcasecmp(table->slots[i].name, name))
+      i = (i + 1) & table->mask;
+
+    // if a user is listed more than once, the first entry is used
+    if (!table->slots[i].name) {
+      *bloom_word(table, h) |= bloom_bits(h);
+      table->slots[i].hash = (uint32_t) h;
+      table->slots[i].name = name;
+      table->slots[i].password = hash_password(table->key, password);
+      table->count++;
+    }
+    memset(password, 0, strlen(password));
+
+    name = strtok_r(NULL, " \t\r\n\v\f", &save);
+  }
+
+  return table;
+}
+
+/** Returns 0 if the Bloom filter of a table shows that no user has a
+ *  name with this hash, or 1 if the user may exist.
+ */
+static int may_exist(struct user_table *table, uint64_t h) {
+  uint64_t bits = bloom_bits(h);
+  return (*bloom_word(table, h) & bits) == bits;
+}
+
+/** Finds a user with a given name hash in a table, ignoring case.
+ *
+ *  Returns: The user's entry, or NULL if the user doesn't exist.
+ */
+static const struct user_entry *find_hashed_user(struct user_table *table,
+						 const char *username, uint64_t h) {
+
+  for (size_t i = h & table->mask; table->slots[i].name; i = (i + 1) & table->mask) {
+    if (table->slots[i].hash == (uint32_t) h && !strcasecmp(table->slots[i].name, username))
+      return &table->slots[i];
+  }
+  return NULL;
+}
+
+/** Finds a user in a table, ignoring case.
+ *
+ *  Returns: The user's entry, or NULL if the user doesn't exist.
+ */
+static const struct user_entry *find_user(struct user_table *table, const char *username) {
+
+  uint64_t h = hash_name(username);
+  if (!may_exist(table, h))
+    return NULL;
+  return find_hashed_user(table, username, h);
+}
+
+/** Internal function that reloads the directory, in processes forked
+ *  from its owner, if it may have changed.
+ */
+static void check_refresh(user_directory_t dir) {
+
+  // processes forked from the owner don't run the background thread
+  if (dir->owner != getpid()) {
+    time_t now = time(NULL);
+    if (__atomic_exchange_n(&dir->last_check, now, __ATOMIC_RELAXED) + CHECK_INTERVAL <= now)
+      userdir_refresh(dir);
+  }
+}
+
+/** Background thread that reloads the directory when the file
+ *  changes.
+ */
+static void *watch_directory(void *arg) {
+  user_directory_t dir = arg;
+  while (1) {
+    sleep(CHECK_INTERVAL);
+    userdir_refresh(dir);
+  }
+  return NULL;
+}
+
+static void fork_prepare(void) {
+  if (!fork_dir) return;
+  pthread_mutex_lock(&fork_dir->reload_lock);
+  pthread_rwlock_wrlock(&fork_dir->lock);
+}
+
+static void fork_parent(void) {
+  if (!fork_dir) return;
+  pthread_rwlock_unlock(&fork_dir->lock);
+  pthread_mutex_unlock(&fork_dir->reload_lock);
+}
+
+// The child's thread has a different id than the one that locked the
+// rwlock, so it cannot unlock it; the locks are recreated instead
+static void fork_child(void) {
+  if (!fork_dir) return;
+  pthread_rwlock_init(&fork_dir->lock, NULL);
+  pthread_mutex_init(&fork_dir->reload_lock, NULL);
+}
+
+static void register_atfork(void) {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/** Loads a users file into a new directory, and starts a background
+ *  thread to reload it when the file is modified. If the file does
+ *  not exist, the directory is empty until the file is created.
+ *
+ *  Parameters: path: Name of the users file.
+ *
+ *  Returns: A user_directory_t object, to be used in other userdir
+ *           functions.
+ */
+user_directory_t userdir_open(const char *path) {
+
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  pthread_t thread;
+
+  user_directory_t dir = malloc(sizeof(struct user_directory));
+  dir->path = strdup(path);
+  pthread_rwlock_init(&dir->lock, NULL);
+  pthread_mutex_init(&dir->reload_lock, NULL);
+  dir->table = load_table(path);
+  dir->owner = getpid();
+  dir->last_check = time(NULL);
+
+  if (!fork_dir) {
+    fork_dir = dir;
+    pthread_once(&atfork_once, register_atfork);
+  }
+
+  if (pthread_create(&thread, NULL, watch_directory, dir) == 0)
+    pthread_detach(thread);
+  return dir;
+}
+
+/** Reloads the directory if the users file was modified since it was
+ *  last loaded. Lookups are not blocked while the file is being
+ *  read, only while the new table replaces the old one.
+ *
+ *  Parameters: dir: Directory to be refreshed.
+ *
+ *  Returns: 1 if the directory was reloaded, 0 otherwise.
+ */
+int userdir_refresh(user_directory_t dir) {
+
+  struct stat file_stat;
+  int rv = 0;
+
+  // if another thread is already reloading, there is no need to wait for it
+  if (pthread_mutex_trylock(&dir->reload_lock))
+    return 0;
+
+  if (stat(dir->path, &file_stat) < 0) {
+    file_stat.st_mtim.tv_sec = file_stat.st_mtim.tv_nsec = 0;
+    file_stat.st_size = 0;
+  }
+
+  // only this thread replaces the table, so it can be read unlocked
+  struct user_table *old = dir->table;
+  if (file_stat.st_mtim.tv_sec != old->mtime.tv_sec ||
+      file_stat.st_mtim.tv_nsec != old->mtime.tv_nsec ||
+      file_stat.st_size != old->size) {
+
+    struct user_table *table = load_table(dir->path);
+    pthread_rwlock_wrlock(&dir->lock);
+    dir->table = table;
+    pthread_rwlock_unlock(&dir->lock);
+    free_table(old);
+    rv = 1;
+  }
+
+  pthread_mutex_unlock(&dir->reload_lock);
+  return rv;
+}
+
+/** Checks if the user name exists in the directory, ignoring case
+ *  and, if a password is informed, if the password matches the
+ *  user's password (case-sensitive).
+ *
+ *  Parameters: dir: Directory where the user is looked up.
+ *              username: Non-NULL name of the user to check.
+ *              password: Plain-text password to check. If NULL, will
+ *                        check only that the username exists.
+ *
+ *  Returns: non-zero (true) if the user exists and, if a password was
+ *           informed, the password matches, or zero (false)
+ *           otherwise.
+ */
+int userdir_check(user_directory_t dir, const char *username, const char *password) {
+
+  check_refresh(dir);
+  pthread_rwlock_rdlock(&dir->lock);
+  const struct user_entry *entry = find_user(dir->table, username);
+  int rv = entry && (password == NULL ||
+		     hash_password(dir->table->key, password) == entry->password);
+  pthread_rwlock_unlock(&dir->lock);
+  return rv;
+}
+
+/** Checks if each of several user names exists in the directory,
+ *  ignoring case, as userdir_check with no password, but with a
+ *  single lock of the directory for all of them. Names rejected by
+ *  the Bloom filter are answered without touching the table; for the
+ *  others, the slots where their search starts are prefetched first,
+ *  so the memory accesses of all lookups in a batch overlap.
+ *
+ *  Parameters: dir: Directory where the users are looked up.
+ *              usernames: Names of the users to check.
+ *              count: Number of names.
+ *              results: Set, for each name, to non-zero (true) if the
+ *                       user exists, or zero (false) otherwise.
+ */
+void userdir_check_users(user_directory_t dir, const char *const *usernames,
+			 size_t count, int *results) {
+
+  uint64_t hashes[BATCH_SIZE];
+
+  check_refresh(dir);
+  pthread_rwlock_rdlock(&dir->lock);
+  struct user_table *table = dir->table;
+  for (size_t start = 0; start < count; start += BATCH_SIZE) {
+    size_t n = count - start < BATCH_SIZE ? count - start : BATCH_SIZE;
+
+    for (size_t i = 0; i < n; i++) {
+      hashes[i] = hash_name(usernames[start + i]);
+      results[start + i] = may_exist(table, hashes[i]);
+      if (results[start + i])
+	__builtin_prefetch(&table->slots[hashes[i] & table->mask]);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (results[start + i])
+	results[start + i] = find_hashed_user(table, usernames[start + i], hashes[i]) != NULL;
+    }
+  }
+  pthread_rwlock_unlock(&dir->lock);
+}
+
+/** Returns the number of users currently loaded in a directory.
+ *
+ *  Parameters: dir: Directory to be assessed.
+ *
+ *  Returns: Number of distinct users in the directory.
+ */
+size_t userdir_count(user_directory_t dir) {
+
+  pthread_rwlock_rdlock(&dir->lock);
+  size_t rv = dir->table->count;
+  pthread_rwlock_unlock(&dir->lock);
+  return rv;
+}
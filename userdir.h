@@ -0,0 +1,19 @@
+/* userdir.h
+ * In-memory directory of users and passwords, loaded from a users file.
+ */
+
+#ifndef _USERDIR_H_
+#define _USERDIR_H_
+
+#include <stddef.h>
+
+typedef struct user_directory *user_directory_t;
+
+user_directory_t userdir_open(const char *path);
+int userdir_check(user_directory_t dir, const char *username, const char *password);
+void userdir_check_users(user_directory_t dir, const char *const *usernames,
+			 size_t count, int *results);
+int userdir_refresh(user_directory_t dir);
+size_t userdir_count(user_directory_t dir);
+
+#endif